@@ -3,47 +3,90 @@
 
 #include <stdint.h>
 #include <arpa/inet.h>
+#include <cstring>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <ioa/buffer.hpp>
+#include <ioa/shared_ptr.hpp>
 
 #include <iostream>
 
 // Reactive grammar.
 namespace rgram {
 
+  // Buffers parsed one after another as if they were one.
+  typedef std::vector<ioa::const_shared_ptr<ioa::buffer_interface> > buffer_chain;
+
   class buffer
   {
   private:
-    const ioa::buffer_interface& m_buffer;
-    size_t m_idx;
+    // Set when parsing a chain.  The next buffer to parse after the current one.
+    const buffer_chain* m_chain;
+    size_t m_next;
+    // The unconsumed part of the current buffer.
+    const unsigned char* m_ptr;
+    const unsigned char* m_limit;
+
+    // Move past used up buffers.
+    void advance () {
+      while (m_ptr == m_limit && m_chain != 0 && m_next != m_chain->size ()) {
+	const ioa::buffer_interface* buf = (*m_chain)[m_next++].get ();
+	if (buf != 0) {
+	  m_ptr = static_cast<const unsigned char*> (buf->data ());
+	  m_limit = m_ptr + buf->size ();
+	}
+      }
+    }
+
   public:
     buffer (const ioa::buffer_interface& buf) :
-      m_buffer (buf),
-      m_idx (0)
+      m_chain (0),
+      m_next (0),
+      m_ptr (static_cast<const unsigned char*> (buf.data ())),
+      m_limit (m_ptr + buf.size ())
     { }
 
+    buffer (const buffer_chain& chain) :
+      m_chain (&chain),
+      m_next (0),
+      m_ptr (0),
+      m_limit (0)
+    {
+      advance ();
+    }
+
     size_t consume (void* ptr,
 		    const size_t bytes) {
-      const unsigned char* src = static_cast<const unsigned char*> (m_buffer.data ()) + m_idx;
-      const unsigned char* const src_limit = static_cast<const unsigned char*> (m_buffer.data ()) + m_buffer.size ();
       unsigned char* dest = static_cast<unsigned char*> (ptr);
-      const unsigned char* dest_limit = dest + bytes;
+      size_t c = 0;
+      while (c != bytes && !empty ()) {
+	const size_t n = std::min (bytes - c, size ());
+	memcpy (dest + c, m_ptr, n);
+	c += n;
+	skip (n);
+      }
+      return c;
+    }
 
-      for (; src != src_limit && dest != dest_limit; *(dest++) = *(src++))
-	;;
+    // The unconsumed bytes of the current buffer.  Allows consumers to process data in place.
+    const void* data () const {
+      return m_ptr;
+    }
 
-      const size_t c = bytes - (dest_limit - dest);
-      m_idx += c;
-      return c;
+    void skip (const size_t bytes) {
+      assert (bytes <= size ());
+      m_ptr += bytes;
+      advance ();
     }
 
     bool empty () const {
-      return m_idx == m_buffer.size ();
+      return m_ptr == m_limit;
     }
 
+    // The size of data.  More may follow in the rest of a chain.
     size_t size () const {
-      return m_buffer.size () - m_idx;
+      return m_limit - m_ptr;
     }
   };
 
@@ -57,6 +100,20 @@ namespace rgram {
     virtual void reset () = 0;
   };
 
+  // Matches nothing.  The body of a message that is only a type.
+  class empty_gramel :
+    public gramel
+  {
+  public:
+    void put (buffer& buf) { }
+
+    bool done () const {
+      return true;
+    }
+
+    void reset () { }
+  };
+
   class char_gramel :
     public gramel
   {
@@ -169,7 +226,7 @@ namespace rgram {
 
     void put (buffer& buf) {
       assert (!done ());
-      m_count += buf.consume (&m_int, sizeof (m_int) - m_count);
+      m_count += buf.consume (reinterpret_cast<unsigned char*> (&m_int) + m_count, sizeof (m_int) - m_count);
       if (done ()) {
 	m_int = ntohs (m_int);
       }
@@ -204,7 +261,7 @@ namespace rgram {
 
     void put (buffer& buf) {
       assert (!done ());
-      m_count += buf.consume (&m_uint, sizeof (m_uint) - m_count);
+      m_count += buf.consume (reinterpret_cast<unsigned char*> (&m_uint) + m_count, sizeof (m_uint) - m_count);
       if (done ()) {
 	m_uint = ntohs (m_uint);
       }
@@ -239,7 +296,7 @@ namespace rgram {
 
     void put (buffer& buf) {
       assert (!done ());
-      m_count += buf.consume (&m_int, sizeof (m_int) - m_count);
+      m_count += buf.consume (reinterpret_cast<unsigned char*> (&m_int) + m_count, sizeof (m_int) - m_count);
       if (done ()) {
 	m_int = ntohl (m_int);
       }
@@ -274,7 +331,7 @@ namespace rgram {
 
     void put (buffer& buf) {
       assert (!done ());
-      m_count += buf.consume (&m_uint, sizeof (m_uint) - m_count);
+      m_count += buf.consume (reinterpret_cast<unsigned char*> (&m_uint) + m_count, sizeof (m_uint) - m_count);
       if (done ()) {
 	m_uint = ntohl (m_uint);
       }
@@ -429,11 +486,10 @@ namespace rgram {
   {
   private:
     Key m_action;
-    typedef std::map<typename Key::value_type, Value> map_type;
-
     bool m_bad_key;
     
   public:
+    typedef std::map<typename Key::value_type, Value> map_type;
     map_type choices;
 
     choice_gramel () :
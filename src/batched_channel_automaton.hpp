@@ -0,0 +1,73 @@
+#ifndef __batched_channel_automaton_hpp__
+#define __batched_channel_automaton_hpp__
+
+#include "channel_item_bytes.hpp"
+
+#include <deque>
+#include <vector>
+#include <ioa/ioa.hpp>
+
+/*
+  A channel that delivers everything queued in one action.
+
+  receive takes items from the front of the queue until it has max_items of them or they hold max_bytes.
+  Zero means no limit.  A batch always has at least one item even if it alone is over max_bytes.
+
+  For buffers the batch is an rgram::buffer_chain that can be parsed as one.
+*/
+
+template <class T>
+class batched_channel_automaton :
+  public ioa::automaton
+{
+public:
+  typedef std::vector<T> batch_type;
+
+private:
+  const size_t m_max_items;
+  const size_t m_max_bytes;
+  std::deque<T> m_queue;
+
+  void send_effect (const T& t) {
+    m_queue.push_back (t);
+  }
+
+  bool receive_precondition () const {
+    return !m_queue.empty () && ioa::binding_count (&batched_channel_automaton::receive) != 0;
+  }
+
+  ioa::const_shared_ptr<batch_type> receive_effect () {
+    batch_type* batch = new batch_type ();
+    size_t bytes = 0;
+    while (!m_queue.empty () &&
+	   (m_max_items == 0 || batch->size () != m_max_items) &&
+	   (m_max_bytes == 0 || batch->empty () || bytes + channel_item_bytes (m_queue.front ()) <= m_max_bytes)) {
+      bytes += channel_item_bytes (m_queue.front ());
+      batch->push_back (m_queue.front ());
+      m_queue.pop_front ();
+    }
+    return ioa::const_shared_ptr<batch_type> (batch);
+  }
+
+  void schedule () const {
+    if (receive_precondition ()) {
+      ioa::schedule (&batched_channel_automaton::receive);
+    }
+  }
+
+public:
+
+  batched_channel_automaton (const size_t max_items = 0,
+			     const size_t max_bytes = 0) :
+    m_max_items (max_items),
+    m_max_bytes (max_bytes)
+  {
+    schedule ();
+  }
+
+  V_UP_INPUT (batched_channel_automaton, send, T);
+  V_UP_OUTPUT (batched_channel_automaton, receive, ioa::const_shared_ptr<batch_type>);
+
+};
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef __bounded_channel_automaton_hpp__
+#define __bounded_channel_automaton_hpp__
+
+#include "channel_item_bytes.hpp"
+
+#include <queue>
+#include <stdint.h>
+#include <ioa/ioa.hpp>
+
+/*
+  A channel with room for max_items items holding max_bytes and credit-based flow control.
+
+  The channel grants its whole room as credit at the start and returns the room of every item it delivers.
+  A sender keeps count of what it has been granted and what it has sent.
+  It may send while it has been granted more items and more bytes than it has sent.
+  So one item may take the channel past max_bytes but never further.  Both limits must be positive.
+
+  An input cannot be refused so an item sent without credit is still queued and counted as an overrun.
+  The deepest the queue has been is published with the overruns whenever they change.
+*/
+
+struct channel_credit_t
+{
+  size_t items;
+  size_t bytes;
+
+  channel_credit_t (const size_t i = 0,
+		    const size_t b = 0) :
+    items (i),
+    bytes (b)
+  { }
+};
+
+struct channel_statistics_t
+{
+  // High-water marks of the queue.
+  size_t max_items;
+  size_t max_bytes;
+  // Items sent without credit.
+  size_t overruns;
+
+  channel_statistics_t () :
+    max_items (0),
+    max_bytes (0),
+    overruns (0)
+  { }
+};
+
+// The queue and accounting of the channel without the automaton.
+template <class T>
+class bounded_queue
+{
+private:
+  std::queue<T> m_queue;
+  size_t m_bytes;
+  // Room freed and not yet returned to the sender.
+  channel_credit_t m_credit;
+  // Totals granted to and sent by the sender.
+  uint64_t m_granted_items;
+  uint64_t m_granted_bytes;
+  uint64_t m_sent_items;
+  uint64_t m_sent_bytes;
+  channel_statistics_t m_statistics;
+  bool m_statistics_changed;
+
+public:
+  bounded_queue (const size_t max_items,
+		 const size_t max_bytes) :
+    m_bytes (0),
+    m_credit (max_items, max_bytes),
+    m_granted_items (0),
+    m_granted_bytes (0),
+    m_sent_items (0),
+    m_sent_bytes (0),
+    m_statistics_changed (false)
+  { }
+
+  void push (const T& t) {
+    const size_t bytes = channel_item_bytes (t);
+    if (m_sent_items >= m_granted_items || m_sent_bytes >= m_granted_bytes) {
+      ++m_statistics.overruns;
+      m_statistics_changed = true;
+    }
+    ++m_sent_items;
+    m_sent_bytes += bytes;
+
+    m_queue.push (t);
+    m_bytes += bytes;
+    if (m_queue.size () > m_statistics.max_items) {
+      m_statistics.max_items = m_queue.size ();
+      m_statistics_changed = true;
+    }
+    if (m_bytes > m_statistics.max_bytes) {
+      m_statistics.max_bytes = m_bytes;
+      m_statistics_changed = true;
+    }
+  }
+
+  bool empty () const {
+    return m_queue.empty ();
+  }
+
+  T pop () {
+    T retval = m_queue.front ();
+    m_queue.pop ();
+    const size_t bytes = channel_item_bytes (retval);
+    m_bytes -= bytes;
+    ++m_credit.items;
+    m_credit.bytes += bytes;
+    return retval;
+  }
+
+  bool has_credit () const {
+    return m_credit.items != 0 || m_credit.bytes != 0;
+  }
+
+  channel_credit_t take_credit () {
+    const channel_credit_t retval = m_credit;
+    m_granted_items += retval.items;
+    m_granted_bytes += retval.bytes;
+    m_credit = channel_credit_t ();
+    return retval;
+  }
+
+  bool statistics_changed () const {
+    return m_statistics_changed;
+  }
+
+  const channel_statistics_t& take_statistics () {
+    m_statistics_changed = false;
+    return m_statistics;
+  }
+
+  size_t size () const {
+    return m_queue.size ();
+  }
+
+  size_t bytes () const {
+    return m_bytes;
+  }
+};
+
+template <class T>
+class bounded_channel_automaton :
+  public ioa::automaton
+{
+private:
+  bounded_queue<T> m_queue;
+
+  void send_effect (const T& t) {
+    m_queue.push (t);
+  }
+
+  bool receive_precondition () const {
+    return !m_queue.empty () && ioa::binding_count (&bounded_channel_automaton::receive) != 0;
+  }
+
+  T receive_effect () {
+    return m_queue.pop ();
+  }
+
+  bool credit_precondition () const {
+    return m_queue.has_credit () && ioa::binding_count (&bounded_channel_automaton::credit) != 0;
+  }
+
+  channel_credit_t credit_effect () {
+    return m_queue.take_credit ();
+  }
+
+  bool statistics_precondition () const {
+    return m_queue.statistics_changed () && ioa::binding_count (&bounded_channel_automaton::statistics) != 0;
+  }
+
+  channel_statistics_t statistics_effect () {
+    return m_queue.take_statistics ();
+  }
+
+  void schedule () const {
+    if (receive_precondition ()) {
+      ioa::schedule (&bounded_channel_automaton::receive);
+    }
+    if (credit_precondition ()) {
+      ioa::schedule (&bounded_channel_automaton::credit);
+    }
+    if (statistics_precondition ()) {
+      ioa::schedule (&bounded_channel_automaton::statistics);
+    }
+  }
+
+public:
+
+  bounded_channel_automaton (const size_t max_items,
+			     const size_t max_bytes) :
+    m_queue (max_items, max_bytes)
+  {
+    schedule ();
+  }
+
+  V_UP_INPUT (bounded_channel_automaton, send, T);
+  V_UP_OUTPUT (bounded_channel_automaton, receive, T);
+  V_UP_OUTPUT (bounded_channel_automaton, credit, channel_credit_t);
+  V_UP_OUTPUT (bounded_channel_automaton, statistics, channel_statistics_t);
+
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __channel_item_bytes_hpp__
+#define __channel_item_bytes_hpp__
+
+#include <ioa/buffer.hpp>
+#include <ioa/shared_ptr.hpp>
+
+// The size of an item for channels with byte limits.  Only buffers have one.  Other items count as zero.
+template <class T>
+size_t channel_item_bytes (const T&) {
+  return 0;
+}
+
+inline size_t channel_item_bytes (const ioa::const_shared_ptr<ioa::buffer_interface>& buf) {
+  return buf.get () != 0 ? buf->size () : 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __checksum_presenter_hpp__
+#define __checksum_presenter_hpp__
+
+#include "rfb_client.hpp"
+
+/*
+  Presents nothing but counts what it is told and hashes the framebuffer on demand.
+  Two clients that decoded the same stream have the same checksum.
+*/
+
+class checksum_presenter :
+  public rfb_client::presenter
+{
+private:
+  uint16_t m_width;
+  uint16_t m_height;
+  const uint32_t* m_data;
+  size_t m_updates;
+  uint64_t m_pixels;
+
+public:
+  checksum_presenter () :
+    m_width (0),
+    m_height (0),
+    m_data (0),
+    m_updates (0),
+    m_pixels (0)
+  { }
+
+  void resized (const uint16_t width,
+		const uint16_t height,
+		uint32_t* data) {
+    m_width = width;
+    m_height = height;
+    m_data = data;
+  }
+
+  void region_updated (const uint16_t x,
+		       const uint16_t y,
+		       const uint16_t width,
+		       const uint16_t height) {
+    m_pixels += uint32_t (width) * height;
+  }
+
+  void update_done () {
+    ++m_updates;
+  }
+
+  // Number of FramebufferUpdates.
+  size_t updates () const {
+    return m_updates;
+  }
+
+  // Number of pixels written, counting a pixel once per write.
+  uint64_t pixels () const {
+    return m_pixels;
+  }
+
+  uint64_t checksum () const {
+    return m_data != 0 ? rfb::content_hash (m_data, m_width, m_width, m_height) : 0;
+  }
+};
+
+#endif
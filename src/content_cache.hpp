@@ -0,0 +1,195 @@
+#ifndef __content_cache_hpp__
+#define __content_cache_hpp__
+
+#include <list>
+#include <map>
+#include <vector>
+#include <cstring>
+
+#include <stdint.h>
+
+/*
+  Content-addressed tile cache shared by a server and a client.
+
+  While the client has offered CACHED_TILE, every RAW or ZRLE rectangle of at most CONTENT_CACHE_MAX_PIXELS pixels is stored in a slot on both sides.
+  The server stops using the cache for good if the client drops CACHED_TILE or changes its pixel format after the first update.
+  The server remembers the content hash of each slot (content_cache_index) and the client remembers the pixels (content_cache_store).
+  When the server is about to send a tile the client already holds, it sends a CACHED_TILE rectangle naming the slot instead.
+
+  Both sides pick slots with lru_slots and perform the same operations in the same order (insert for each stored rectangle, touch for each CACHED_TILE rectangle) so the slots agree without any extra messages.
+*/
+
+namespace rfb {
+
+  const size_t CONTENT_CACHE_SLOTS = 1024;
+  const size_t CONTENT_CACHE_MAX_PIXELS = 64 * 64;
+  const uint64_t CONTENT_HASH_SEED = 0xCBF29CE484222325ULL;
+
+  // Hash of the pixels and dimensions of a rectangle.
+  inline uint64_t content_hash (const uint32_t* pixels,
+				const size_t stride,
+				const uint16_t width,
+				const uint16_t height) {
+    uint64_t h = CONTENT_HASH_SEED;
+    h = (h ^ ((uint32_t (width) << 16) | height)) * 0x100000001B3ULL;
+    for (uint16_t y = 0; y != height; ++y) {
+      const uint32_t* p = pixels + y * stride;
+      for (uint16_t x = 0; x != width; ++x) {
+	h = (h ^ p[x]) * 0x100000001B3ULL;
+      }
+    }
+    return h;
+  }
+
+  // Deterministic least-recently-used slot allocation.
+  class lru_slots
+  {
+  private:
+    const size_t m_capacity;
+    // Most recently used first.
+    std::list<size_t> m_order;
+    std::vector<std::list<size_t>::iterator> m_position;
+
+  public:
+    lru_slots (const size_t capacity) :
+      m_capacity (capacity)
+    { }
+
+    // Return the slot to fill, reusing the least recently used slot when full.
+    size_t insert (bool& evicted) {
+      if (m_order.size () < m_capacity) {
+	evicted = false;
+	m_order.push_front (m_order.size ());
+	m_position.push_back (m_order.begin ());
+	return m_order.front ();
+      }
+      evicted = true;
+      m_order.splice (m_order.begin (), m_order, --m_order.end ());
+      return m_order.front ();
+    }
+
+    void touch (const size_t slot) {
+      m_order.splice (m_order.begin (), m_order, m_position[slot]);
+    }
+
+    size_t size () const {
+      return m_order.size ();
+    }
+
+    void clear () {
+      m_order.clear ();
+      m_position.clear ();
+    }
+  };
+
+  // The server's record of what the client holds.
+  class content_cache_index
+  {
+  private:
+    lru_slots m_lru;
+    std::map<uint64_t, size_t> m_slots;
+    std::vector<uint64_t> m_hashes;
+
+  public:
+    content_cache_index (const size_t capacity = CONTENT_CACHE_SLOTS) :
+      m_lru (capacity)
+    { }
+
+    // Find the slot holding the content and mark it used.
+    bool lookup (const uint64_t hash,
+		 size_t& slot) {
+      std::map<uint64_t, size_t>::const_iterator pos = m_slots.find (hash);
+      if (pos == m_slots.end ()) {
+	return false;
+      }
+      slot = pos->second;
+      m_lru.touch (slot);
+      return true;
+    }
+
+    // Record that the client is storing the content.
+    size_t insert (const uint64_t hash) {
+      bool evicted;
+      const size_t slot = m_lru.insert (evicted);
+      if (evicted) {
+	m_slots.erase (m_hashes[slot]);
+	m_hashes[slot] = hash;
+      }
+      else {
+	m_hashes.push_back (hash);
+      }
+      m_slots[hash] = slot;
+      return slot;
+    }
+
+    void clear () {
+      m_lru.clear ();
+      m_slots.clear ();
+      m_hashes.clear ();
+    }
+  };
+
+  // The client's cached pixels.
+  class content_cache_store
+  {
+  private:
+    struct entry_t
+    {
+      uint16_t width;
+      uint16_t height;
+      std::vector<uint32_t> pixels;
+    };
+
+    lru_slots m_lru;
+    std::vector<entry_t> m_entries;
+
+  public:
+    content_cache_store (const size_t capacity = CONTENT_CACHE_SLOTS) :
+      m_lru (capacity)
+    { }
+
+    size_t insert (const uint32_t* pixels,
+		   const size_t stride,
+		   const uint16_t width,
+		   const uint16_t height) {
+      bool evicted;
+      const size_t slot = m_lru.insert (evicted);
+      if (!evicted) {
+	m_entries.push_back (entry_t ());
+      }
+      entry_t& e = m_entries[slot];
+      e.width = width;
+      e.height = height;
+      e.pixels.resize (width * height);
+      for (uint16_t y = 0; y != height; ++y) {
+	memcpy (&e.pixels[y * width], pixels + y * stride, width * sizeof (uint32_t));
+      }
+      return slot;
+    }
+
+    // Paint the slot and mark it used.  Returns false if the slot does not hold a rectangle of that size.
+    bool paint (const size_t slot,
+		uint32_t* pixels,
+		const size_t stride,
+		const uint16_t width,
+		const uint16_t height) {
+      if (slot >= m_entries.size () || m_entries[slot].width != width || m_entries[slot].height != height) {
+	return false;
+      }
+      m_lru.touch (slot);
+      const entry_t& e = m_entries[slot];
+      for (uint16_t y = 0; y != height; ++y) {
+	memcpy (pixels + y * stride, &e.pixels[y * width], width * sizeof (uint32_t));
+      }
+      return true;
+    }
+
+    void clear () {
+      m_lru.clear ();
+      m_entries.clear ();
+    }
+  };
+
+}
+
+#endif
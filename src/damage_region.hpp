@@ -0,0 +1,143 @@
+#ifndef __damage_region_hpp__
+#define __damage_region_hpp__
+
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+
+/*
+  The parts of a framebuffer that changed, as a few rectangles.
+
+  A rectangle is merged with any rectangle whose bounding box covers no pixels outside the two (touching rows of tiles, for example).
+  When there are more than the maximum number of rectangles, the two whose bounding box adds the fewest pixels are merged.
+*/
+
+namespace rfb {
+
+  struct damage_rect_t
+  {
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+
+    damage_rect_t (const uint16_t xpos,
+		   const uint16_t ypos,
+		   const uint16_t w,
+		   const uint16_t h) :
+      x_position (xpos),
+      y_position (ypos),
+      width (w),
+      height (h)
+    { }
+
+    uint32_t area () const {
+      return uint32_t (width) * height;
+    }
+
+    uint32_t intersection_area (const damage_rect_t& other) const {
+      const int x0 = std::max (x_position, other.x_position);
+      const int y0 = std::max (y_position, other.y_position);
+      const int x1 = std::min (x_position + width, other.x_position + other.width);
+      const int y1 = std::min (y_position + height, other.y_position + other.height);
+      return x0 < x1 && y0 < y1 ? uint32_t (x1 - x0) * (y1 - y0) : 0;
+    }
+
+    damage_rect_t bounding_box (const damage_rect_t& other) const {
+      const uint16_t x0 = std::min (x_position, other.x_position);
+      const uint16_t y0 = std::min (y_position, other.y_position);
+      const uint16_t x1 = std::max (x_position + width, other.x_position + other.width);
+      const uint16_t y1 = std::max (y_position + height, other.y_position + other.height);
+      return damage_rect_t (x0, y0, x1 - x0, y1 - y0);
+    }
+
+    bool empty () const {
+      return width == 0 || height == 0;
+    }
+
+    // The part inside a framebuffer of the given size.  Empty if there is none.
+    damage_rect_t clip (const uint16_t fb_width,
+			const uint16_t fb_height) const {
+      const uint32_t x1 = std::min (uint32_t (fb_width), uint32_t (x_position) + width);
+      const uint32_t y1 = std::min (uint32_t (fb_height), uint32_t (y_position) + height);
+      if (x_position >= x1 || y_position >= y1) {
+	return damage_rect_t (0, 0, 0, 0);
+      }
+      return damage_rect_t (x_position, y_position, x1 - x_position, y1 - y_position);
+    }
+
+    // Pixels in the bounding box that are in neither rectangle.
+    uint32_t waste (const damage_rect_t& other) const {
+      return bounding_box (other).area () + intersection_area (other) - area () - other.area ();
+    }
+  };
+
+  class damage_region
+  {
+  private:
+    const size_t m_max_rects;
+    std::vector<damage_rect_t> m_rects;
+
+  public:
+    damage_region (const size_t max_rects = 8) :
+      m_max_rects (std::max (max_rects, size_t (1)))
+    { }
+
+    void add (const uint16_t x,
+	      const uint16_t y,
+	      const uint16_t width,
+	      const uint16_t height) {
+      if (width == 0 || height == 0) {
+	return;
+      }
+
+      // Absorb every rectangle that merges for free.  The result may absorb more.
+      damage_rect_t r (x, y, width, height);
+      for (size_t i = 0; i != m_rects.size ();) {
+	if (r.waste (m_rects[i]) == 0) {
+	  r = r.bounding_box (m_rects[i]);
+	  m_rects.erase (m_rects.begin () + i);
+	  i = 0;
+	}
+	else {
+	  ++i;
+	}
+      }
+      m_rects.push_back (r);
+
+      if (m_rects.size () > m_max_rects) {
+	size_t best_i = 0;
+	size_t best_j = 1;
+	uint32_t best_waste = m_rects[0].waste (m_rects[1]);
+	for (size_t i = 0; i != m_rects.size (); ++i) {
+	  for (size_t j = i + 1; j != m_rects.size (); ++j) {
+	    const uint32_t w = m_rects[i].waste (m_rects[j]);
+	    if (w < best_waste) {
+	      best_i = i;
+	      best_j = j;
+	      best_waste = w;
+	    }
+	  }
+	}
+	m_rects[best_i] = m_rects[best_i].bounding_box (m_rects[best_j]);
+	m_rects.erase (m_rects.begin () + best_j);
+      }
+    }
+
+    const std::vector<damage_rect_t>& rects () const {
+      return m_rects;
+    }
+
+    bool empty () const {
+      return m_rects.empty ();
+    }
+
+    void clear () {
+      m_rects.clear ();
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,451 @@
+#ifndef __decode_pipeline_hpp__
+#define __decode_pipeline_hpp__
+
+#include "rfb_client.hpp"
+#include "damage_region.hpp"
+#include "page_buffer.hpp"
+
+#include <deque>
+#include <queue>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+  Decodes on a worker thread while the caller presents the previous frame.
+
+  The worker runs an rfb_client that decodes into the back buffer.
+  At the end of each FramebufferUpdate the worker copies the rectangles that changed into the front buffer and hands them to the caller.
+  The copy waits while the caller is presenting so the front buffer only ever holds whole updates.
+  Updates decoded while the caller is busy are merged into the next handoff.
+
+  fd () becomes readable when poll () has something to do.
+  poll () runs the front presenter's callbacks on the caller's thread so the presenter need not be thread-safe.
+*/
+
+class decode_pipeline :
+  private rfb_client::presenter
+{
+private:
+  typedef ioa::const_shared_ptr<ioa::buffer_interface> message_type;
+
+  rfb_client::presenter& m_front_presenter;
+  // Try to put the front buffer in huge pages.
+  const bool m_huge_pages;
+  // Used unless the front presenter supplies the memory.
+  page_buffer m_front_buffer;
+  // Input events built on the caller's thread.
+  std::queue<message_type> m_input_sendq;
+  // Buffers given to the worker.  Reference counts are not atomic so the caller holds them until the worker is done.
+  std::deque<message_type> m_received;
+  // The caller's view of the size.
+  uint16_t m_width;
+  uint16_t m_height;
+  // Readable end and writable end.
+  int m_pipe[2];
+  pthread_t m_thread;
+  bool m_joined;
+
+  // Protects everything below.
+  mutable pthread_mutex_t m_mutex;
+  // Signalled when there is input for the worker.
+  pthread_cond_t m_work_cond;
+  // Signalled when the caller finishes presenting or resizing.
+  pthread_cond_t m_front_cond;
+  bool m_stop;
+  std::deque<const ioa::buffer_interface*> m_recvq;
+  // Buffers the worker is done with.
+  size_t m_consumed;
+  std::queue<message_type> m_sendq;
+  // The front buffer.
+  uint32_t* m_front;
+  bool m_presenting;
+  // Rectangles copied to the front buffer but not yet presented.
+  rfb::damage_region m_frame;
+  bool m_frame_ready;
+  bool m_resize_pending;
+  uint16_t m_resize_width;
+  uint16_t m_resize_height;
+  bool m_cursor_pending;
+  uint16_t m_cursor_hotspot_x;
+  uint16_t m_cursor_hotspot_y;
+  uint16_t m_cursor_width;
+  uint16_t m_cursor_height;
+  std::vector<uint8_t> m_cursor_image;
+  std::vector<uint8_t> m_cursor_mask;
+
+  // Used only by the worker.
+  rfb_client m_client;
+  // Rectangles decoded since the last handoff.
+  rfb::damage_region m_damage;
+
+  // Wake the caller.  Called with m_mutex held.
+  void notify () {
+    const char c = 0;
+    // A full pipe already wakes the caller.
+    if (write (m_pipe[1], &c, 1) == -1 && errno != EAGAIN) {
+      perror ("write");
+    }
+  }
+
+  static void* thread_func (void* arg) {
+    static_cast<decode_pipeline*> (arg)->work ();
+    return 0;
+  }
+
+  void work () {
+    pthread_mutex_lock (&m_mutex);
+    for (;;) {
+      while (!m_stop && m_recvq.empty ()) {
+	pthread_cond_wait (&m_work_cond, &m_mutex);
+      }
+      if (m_stop) {
+	break;
+      }
+      const ioa::buffer_interface* buf = m_recvq.front ();
+      m_recvq.pop_front ();
+      pthread_mutex_unlock (&m_mutex);
+
+      m_client.receive (*buf);
+
+      pthread_mutex_lock (&m_mutex);
+      ++m_consumed;
+      if (m_client.has_message ()) {
+	while (m_client.has_message ()) {
+	  m_sendq.push (m_client.next_message ());
+	}
+	notify ();
+      }
+    }
+    pthread_mutex_unlock (&m_mutex);
+  }
+
+  // Worker.  The front buffer must be resized by the caller so wait for it.
+  void resized (const uint16_t width,
+		const uint16_t height,
+		uint32_t*) {
+    m_damage.clear ();
+    pthread_mutex_lock (&m_mutex);
+    m_resize_pending = true;
+    m_resize_width = width;
+    m_resize_height = height;
+    notify ();
+    while (!m_stop && m_resize_pending) {
+      pthread_cond_wait (&m_front_cond, &m_mutex);
+    }
+    pthread_mutex_unlock (&m_mutex);
+  }
+
+  // Worker.
+  void region_updated (const uint16_t x,
+		       const uint16_t y,
+		       const uint16_t width,
+		       const uint16_t height) {
+    m_damage.add (x, y, width, height);
+  }
+
+  // Worker.  Hand the update to the caller.
+  void update_done () {
+    pthread_mutex_lock (&m_mutex);
+    while (!m_stop && m_presenting) {
+      pthread_cond_wait (&m_front_cond, &m_mutex);
+    }
+    if (m_stop) {
+      // The front buffer may not match the back buffer.
+      pthread_mutex_unlock (&m_mutex);
+      m_damage.clear ();
+      return;
+    }
+    const uint32_t* back = m_client.data ();
+    const uint16_t stride = m_client.width ();
+    for (std::vector<rfb::damage_rect_t>::const_iterator pos = m_damage.rects ().begin ();
+	 pos != m_damage.rects ().end ();
+	 ++pos) {
+      for (uint16_t row = 0; row != pos->height; ++row) {
+	const size_t offset = (pos->y_position + row) * stride + pos->x_position;
+	memcpy (m_front + offset, back + offset, pos->width * sizeof (uint32_t));
+      }
+      m_frame.add (pos->x_position, pos->y_position, pos->width, pos->height);
+    }
+    m_frame_ready = true;
+    notify ();
+    pthread_mutex_unlock (&m_mutex);
+    m_damage.clear ();
+  }
+
+  // Worker.
+  void cursor_changed (const uint16_t hotspot_x,
+		       const uint16_t hotspot_y,
+		       const uint16_t width,
+		       const uint16_t height,
+		       const uint8_t* image,
+		       const uint8_t* mask) {
+    const size_t image_bytes = size_t (width) * height * (m_client.pixel_format ().bits_per_pixel / 8);
+    const size_t mask_bytes = size_t ((width + 7) / 8) * height;
+    pthread_mutex_lock (&m_mutex);
+    m_cursor_pending = true;
+    m_cursor_hotspot_x = hotspot_x;
+    m_cursor_hotspot_y = hotspot_y;
+    m_cursor_width = width;
+    m_cursor_height = height;
+    m_cursor_image.assign (image, image + image_bytes);
+    m_cursor_mask.assign (mask, mask + mask_bytes);
+    notify ();
+    pthread_mutex_unlock (&m_mutex);
+  }
+
+  // Caller.  Called with m_mutex held while the worker waits.
+  void resize_front (const uint16_t width,
+		     const uint16_t height) {
+    m_front_buffer.release ();
+    m_front = 0;
+    m_width = width;
+    m_height = height;
+    if (m_width != 0 && m_height != 0) {
+      m_front = m_front_presenter.allocate (m_width, m_height);
+      if (m_front == 0) {
+	m_front_buffer.allocate (size_t (m_width) * m_height * sizeof (uint32_t), m_huge_pages);
+	m_front = static_cast<uint32_t*> (m_front_buffer.data ());
+      }
+    }
+    m_front_presenter.resized (m_width, m_height, m_front);
+  }
+
+  // Caller.  Called with m_mutex held.
+  void release_consumed () {
+    for (; m_consumed != 0; --m_consumed) {
+      m_received.pop_front ();
+    }
+  }
+
+public:
+  decode_pipeline (rfb_client::presenter& front,
+		   const size_t request_window = 1,
+		   const bool huge_pages = false) :
+    m_front_presenter (front),
+    m_huge_pages (huge_pages),
+    m_width (0),
+    m_height (0),
+    m_joined (false),
+    m_stop (false),
+    m_consumed (0),
+    m_front (0),
+    m_presenting (false),
+    m_frame_ready (false),
+    m_resize_pending (false),
+    m_cursor_pending (false),
+    m_client (*this, request_window, huge_pages)
+  {
+    if (pipe (m_pipe) == -1) {
+      perror ("pipe");
+      exit (EXIT_FAILURE);
+    }
+    for (size_t i = 0; i != 2; ++i) {
+      if (fcntl (m_pipe[i], F_SETFL, fcntl (m_pipe[i], F_GETFL, 0) | O_NONBLOCK) == -1) {
+	perror ("fcntl");
+	exit (EXIT_FAILURE);
+      }
+    }
+
+    pthread_mutex_init (&m_mutex, 0);
+    pthread_cond_init (&m_work_cond, 0);
+    pthread_cond_init (&m_front_cond, 0);
+
+    if (pthread_create (&m_thread, 0, thread_func, this) != 0) {
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  ~decode_pipeline () {
+    stop ();
+    pthread_cond_destroy (&m_front_cond);
+    pthread_cond_destroy (&m_work_cond);
+    pthread_mutex_destroy (&m_mutex);
+    close (m_pipe[0]);
+    close (m_pipe[1]);
+  }
+
+  // Stop the worker.  Call before destroying memory the front presenter supplied.
+  void stop () {
+    if (m_joined) {
+      return;
+    }
+    pthread_mutex_lock (&m_mutex);
+    m_stop = true;
+    pthread_cond_broadcast (&m_work_cond);
+    pthread_cond_broadcast (&m_front_cond);
+    pthread_mutex_unlock (&m_mutex);
+    pthread_join (m_thread, 0);
+    m_joined = true;
+  }
+
+  // Call before receiving anything.
+  void set_pixel_format (const rfb::pixel_format_t& format) {
+    m_client.set_pixel_format (format);
+  }
+
+  // Fixed once set so either thread may read it.
+  const rfb::pixel_format_t& pixel_format () const {
+    return m_client.pixel_format ();
+  }
+
+  uint16_t width () const {
+    return m_width;
+  }
+
+  uint16_t height () const {
+    return m_height;
+  }
+
+  // The front buffer.
+  const uint32_t* data () const {
+    return m_front;
+  }
+
+  int fd () const {
+    return m_pipe[0];
+  }
+
+  // Queue bytes from the server for the worker.
+  void receive (const message_type& buf) {
+    if (buf.get () == 0) {
+      return;
+    }
+    m_received.push_back (buf);
+    pthread_mutex_lock (&m_mutex);
+    m_recvq.push_back (buf.get ());
+    pthread_cond_signal (&m_work_cond);
+    release_consumed ();
+    pthread_mutex_unlock (&m_mutex);
+  }
+
+  // Queue several buffers at once.
+  void receive (const rgram::buffer_chain& chain) {
+    pthread_mutex_lock (&m_mutex);
+    for (rgram::buffer_chain::const_iterator pos = chain.begin ();
+	 pos != chain.end ();
+	 ++pos) {
+      if (pos->get () != 0) {
+	m_received.push_back (*pos);
+	m_recvq.push_back (pos->get ());
+      }
+    }
+    pthread_cond_signal (&m_work_cond);
+    release_consumed ();
+    pthread_mutex_unlock (&m_mutex);
+  }
+
+  // Apply what the worker has handed over.
+  void poll () {
+    char buf[64];
+    while (read (m_pipe[0], buf, sizeof (buf)) > 0) ;
+
+    pthread_mutex_lock (&m_mutex);
+    release_consumed ();
+    if (m_resize_pending) {
+      resize_front (m_resize_width, m_resize_height);
+      // The old frame does not fit and the worker decodes the new size from scratch.
+      m_frame.clear ();
+      m_frame_ready = false;
+      m_resize_pending = false;
+      pthread_cond_broadcast (&m_front_cond);
+    }
+    const bool cursor = m_cursor_pending;
+    std::vector<uint8_t> cursor_image;
+    std::vector<uint8_t> cursor_mask;
+    const uint16_t cursor_hotspot_x = m_cursor_hotspot_x;
+    const uint16_t cursor_hotspot_y = m_cursor_hotspot_y;
+    const uint16_t cursor_width = m_cursor_width;
+    const uint16_t cursor_height = m_cursor_height;
+    if (cursor) {
+      cursor_image.swap (m_cursor_image);
+      cursor_mask.swap (m_cursor_mask);
+      m_cursor_pending = false;
+    }
+    const bool frame = m_frame_ready;
+    const std::vector<rfb::damage_rect_t> rects (m_frame.rects ());
+    m_frame.clear ();
+    m_frame_ready = false;
+    m_presenting = frame;
+    pthread_mutex_unlock (&m_mutex);
+
+    if (cursor) {
+      m_front_presenter.cursor_changed (cursor_hotspot_x, cursor_hotspot_y, cursor_width, cursor_height,
+					cursor_image.empty () ? 0 : &cursor_image[0],
+					cursor_mask.empty () ? 0 : &cursor_mask[0]);
+    }
+
+    if (frame) {
+      // The worker keeps decoding into the back buffer meanwhile.
+      for (std::vector<rfb::damage_rect_t>::const_iterator pos = rects.begin ();
+	   pos != rects.end ();
+	   ++pos) {
+	m_front_presenter.region_updated (pos->x_position, pos->y_position, pos->width, pos->height);
+      }
+      m_front_presenter.update_done ();
+      end_present ();
+    }
+  }
+
+  // Keep the worker out of the front buffer, for example to repaint an exposed window.
+  void begin_present () {
+    pthread_mutex_lock (&m_mutex);
+    m_presenting = true;
+    pthread_mutex_unlock (&m_mutex);
+  }
+
+  void end_present () {
+    pthread_mutex_lock (&m_mutex);
+    m_presenting = false;
+    pthread_cond_broadcast (&m_front_cond);
+    pthread_mutex_unlock (&m_mutex);
+  }
+
+  bool has_message () const {
+    pthread_mutex_lock (&m_mutex);
+    const bool retval = !m_input_sendq.empty () || !m_sendq.empty ();
+    pthread_mutex_unlock (&m_mutex);
+    return retval;
+  }
+
+  // The next message for the server.  Input first.
+  message_type next_message () {
+    if (!m_input_sendq.empty ()) {
+      message_type retval = m_input_sendq.front ();
+      m_input_sendq.pop ();
+      return retval;
+    }
+    pthread_mutex_lock (&m_mutex);
+    message_type retval = m_sendq.front ();
+    m_sendq.pop ();
+    pthread_mutex_unlock (&m_mutex);
+    return retval;
+  }
+
+  // Input is queued on the caller's thread so it never waits for the decoder.
+  void send_key_event (const bool down,
+		       const uint32_t key) {
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::key_event_t msg (down, key);
+    msg.write_to_buffer (*buf);
+    m_input_sendq.push (message_type (buf));
+  }
+
+  // The position is clamped to the framebuffer.
+  void send_pointer_event (const uint8_t button_mask,
+			   const int x,
+			   const int y) {
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::pointer_event_t msg (button_mask, std::max (0, std::min (x, m_width - 1)), std::max (0, std::min (y, m_height - 1)));
+    msg.write_to_buffer (*buf);
+    m_input_sendq.push (message_type (buf));
+  }
+};
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef __encoder_pool_hpp__
+#define __encoder_pool_hpp__
+
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+  Work-stealing thread pool for encoding tiles.
+
+  run () distributes tasks in contiguous blocks over one deque per thread (including the calling thread) and returns when all tasks are finished.
+  Each thread takes work from the back of its own deque and steals from the front of the others when its own is empty.
+*/
+
+class encoder_pool
+{
+public:
+  class task
+  {
+  public:
+    virtual ~task () { }
+    virtual void run () = 0;
+  };
+
+private:
+  struct queue_t
+  {
+    pthread_mutex_t mutex;
+    std::deque<task*> tasks;
+
+    queue_t () {
+      pthread_mutex_init (&mutex, 0);
+    }
+
+    ~queue_t () {
+      pthread_mutex_destroy (&mutex);
+    }
+  };
+
+  struct worker_t
+  {
+    encoder_pool* pool;
+    size_t index;
+    pthread_t thread;
+  };
+
+  // Queue 0 belongs to the thread calling run ().
+  std::vector<queue_t*> m_queues;
+  std::vector<worker_t> m_workers;
+
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_work_cond;
+  pthread_cond_t m_done_cond;
+  size_t m_generation;
+  bool m_stop;
+  // Tasks not yet finished.
+  size_t m_pending;
+
+  task* take (const size_t self) {
+    // Own work first.
+    queue_t* q = m_queues[self];
+    pthread_mutex_lock (&q->mutex);
+    if (!q->tasks.empty ()) {
+      task* t = q->tasks.back ();
+      q->tasks.pop_back ();
+      pthread_mutex_unlock (&q->mutex);
+      return t;
+    }
+    pthread_mutex_unlock (&q->mutex);
+
+    // Steal.
+    for (size_t i = 1; i != m_queues.size (); ++i) {
+      q = m_queues[(self + i) % m_queues.size ()];
+      pthread_mutex_lock (&q->mutex);
+      if (!q->tasks.empty ()) {
+	task* t = q->tasks.front ();
+	q->tasks.pop_front ();
+	pthread_mutex_unlock (&q->mutex);
+	return t;
+      }
+      pthread_mutex_unlock (&q->mutex);
+    }
+
+    return 0;
+  }
+
+  void work (const size_t self) {
+    for (task* t = take (self); t != 0; t = take (self)) {
+      t->run ();
+      if (__sync_sub_and_fetch (&m_pending, 1) == 0) {
+	pthread_mutex_lock (&m_mutex);
+	pthread_cond_signal (&m_done_cond);
+	pthread_mutex_unlock (&m_mutex);
+      }
+    }
+  }
+
+  static void* thread_func (void* arg) {
+    worker_t* worker = static_cast<worker_t*> (arg);
+    encoder_pool& pool = *worker->pool;
+    size_t generation = 0;
+
+    pthread_mutex_lock (&pool.m_mutex);
+    for (;;) {
+      while (!pool.m_stop && pool.m_generation == generation) {
+	pthread_cond_wait (&pool.m_work_cond, &pool.m_mutex);
+      }
+      if (pool.m_stop) {
+	break;
+      }
+      generation = pool.m_generation;
+      pthread_mutex_unlock (&pool.m_mutex);
+      pool.work (worker->index);
+      pthread_mutex_lock (&pool.m_mutex);
+    }
+    pthread_mutex_unlock (&pool.m_mutex);
+
+    return 0;
+  }
+
+public:
+  // One less than the number of processors since the calling thread also works.
+  static size_t default_threads () {
+    const long n = sysconf (_SC_NPROCESSORS_ONLN);
+    return n > 1 ? n - 1 : 0;
+  }
+
+  encoder_pool (const size_t threads = default_threads ()) :
+    m_queues (threads + 1),
+    m_workers (threads),
+    m_generation (0),
+    m_stop (false),
+    m_pending (0)
+  {
+    pthread_mutex_init (&m_mutex, 0);
+    pthread_cond_init (&m_work_cond, 0);
+    pthread_cond_init (&m_done_cond, 0);
+
+    for (size_t i = 0; i != m_queues.size (); ++i) {
+      m_queues[i] = new queue_t ();
+    }
+
+    for (size_t i = 0; i != m_workers.size (); ++i) {
+      m_workers[i].pool = this;
+      m_workers[i].index = i + 1;
+      if (pthread_create (&m_workers[i].thread, 0, thread_func, &m_workers[i]) != 0) {
+	perror ("pthread_create");
+	exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  ~encoder_pool () {
+    pthread_mutex_lock (&m_mutex);
+    m_stop = true;
+    pthread_cond_broadcast (&m_work_cond);
+    pthread_mutex_unlock (&m_mutex);
+
+    for (size_t i = 0; i != m_workers.size (); ++i) {
+      pthread_join (m_workers[i].thread, 0);
+    }
+
+    for (size_t i = 0; i != m_queues.size (); ++i) {
+      delete m_queues[i];
+    }
+
+    pthread_cond_destroy (&m_done_cond);
+    pthread_cond_destroy (&m_work_cond);
+    pthread_mutex_destroy (&m_mutex);
+  }
+
+  size_t threads () const {
+    return m_queues.size ();
+  }
+
+  // Run the tasks and wait for them to finish.
+  void run (const std::vector<task*>& tasks) {
+    if (tasks.empty ()) {
+      return;
+    }
+
+    if (m_workers.empty () || tasks.size () == 1) {
+      for (std::vector<task*>::const_iterator pos = tasks.begin ();
+	   pos != tasks.end ();
+	   ++pos) {
+	(*pos)->run ();
+      }
+      return;
+    }
+
+    __sync_add_and_fetch (&m_pending, tasks.size ());
+
+    for (size_t i = 0; i != tasks.size (); ++i) {
+      queue_t* q = m_queues[i * m_queues.size () / tasks.size ()];
+      pthread_mutex_lock (&q->mutex);
+      q->tasks.push_back (tasks[i]);
+      pthread_mutex_unlock (&q->mutex);
+    }
+
+    pthread_mutex_lock (&m_mutex);
+    ++m_generation;
+    pthread_cond_broadcast (&m_work_cond);
+    pthread_mutex_unlock (&m_mutex);
+
+    work (0);
+
+    pthread_mutex_lock (&m_mutex);
+    while (__sync_add_and_fetch (&m_pending, 0) != 0) {
+      pthread_cond_wait (&m_done_cond, &m_mutex);
+    }
+    pthread_mutex_unlock (&m_mutex);
+  }
+};
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef __encoder_selector_hpp__
+#define __encoder_selector_hpp__
+
+#include "rfb.hpp"
+#include "zrle.hpp"
+
+#include <map>
+#include <vector>
+#include <ostream>
+
+#include <stdint.h>
+
+/*
+  Per-tile encoding selection.
+
+  The cost of sending a tile with an encoding is the estimated time to encode it plus the estimated time to transmit it.
+  Sizes are estimated from cheap statistics (colour count, run count) and corrected by the ratio of actual to estimated size.
+  Encode times are estimated from the measured nanoseconds per pixel.
+  Transmit times use the measured throughput of the connection, taken from when updates leave and when the client acknowledges them.
+  When an update left before the previous acknowledgement, the link was busy between the two so its bytes took that long to drain.
+  Otherwise the round trip is mostly latency, estimated by the shortest round trip seen, and only the remainder is spent on the bytes.
+  All measurements are exponentially weighted moving averages so the selection adapts as content and links change.
+*/
+
+namespace rfb {
+
+  // Weight given to new measurements.
+  const double SELECTOR_ALPHA = 0.1;
+
+  struct tile_statistics_t
+  {
+    uint16_t width;
+    uint16_t height;
+    // Number of distinct colours, saturating at ZRLE_MAX_PALETTE + 1.
+    uint32_t colors;
+    uint32_t runs;
+    // Content hash for the client's tile cache.
+    uint64_t hash;
+
+    tile_statistics_t () :
+      width (0),
+      height (0),
+      colors (0),
+      runs (0),
+      hash (0)
+    { }
+
+    uint32_t pixels () const {
+      return uint32_t (width) * height;
+    }
+  };
+
+  struct encoding_counters_t
+  {
+    uint64_t rectangles;
+    uint64_t pixels;
+    uint64_t bytes;
+    uint64_t encode_ns;
+
+    encoding_counters_t () :
+      rectangles (0),
+      pixels (0),
+      bytes (0),
+      encode_ns (0)
+    { }
+  };
+
+  class encoder_selector
+  {
+  private:
+    struct model_t
+    {
+      // Actual size divided by estimated size.
+      double size_ratio;
+      double ns_per_pixel;
+
+      model_t (const double ratio = 1.0,
+	       const double ns = 1.0) :
+	size_ratio (ratio),
+	ns_per_pixel (ns)
+      { }
+    };
+
+    // Bytes per rectangle header.
+    static const size_t RECTANGLE_HEADER = 12;
+
+    typedef std::map<int32_t, model_t> model_map;
+    typedef std::map<int32_t, encoding_counters_t> counters_map;
+    model_map m_models;
+    counters_map m_counters;
+    double m_bytes_per_ns;
+    // Shortest time from sending an update to its acknowledgement.  Zero until measured.
+    uint64_t m_min_rtt_ns;
+    uint64_t m_last_ack_ns;
+
+    // Size before correction.
+    static size_t estimate_size (const int32_t encoding,
+				 const tile_statistics_t& stats,
+				 const pixel_format_t& format) {
+      const size_t bpp = format.bits_per_pixel / 8;
+      if (encoding == ZRLE) {
+	const size_t cp = cpixel_format_t (format).bytes;
+	size_t size = stats.pixels () * cp;
+	if (stats.colors == 1) {
+	  size = cp;
+	}
+	else if (stats.colors <= 16) {
+	  size = std::min (size, stats.colors * cp + stats.pixels () * zrle_packed_bits (stats.colors) / 8);
+	}
+	if (stats.colors <= ZRLE_MAX_PALETTE) {
+	  size = std::min (size, stats.colors * cp + 2 * stats.runs);
+	}
+	size = std::min (size, stats.runs * (cp + 1));
+	// Length, subencoding, and flush.
+	return 4 + 1 + 6 + size;
+      }
+      return stats.pixels () * bpp;
+    }
+
+    static bool can_encode (const int32_t encoding) {
+      return encoding == RAW || encoding == ZRLE;
+    }
+
+  public:
+    encoder_selector () :
+      // 10 MB/s until measured.
+      m_bytes_per_ns (0.01),
+      m_min_rtt_ns (0),
+      m_last_ack_ns (0)
+    {
+      m_models[RAW] = model_t (1.0, 1.0);
+      // Guess that zlib halves the data.
+      m_models[ZRLE] = model_t (0.5, 20.0);
+    }
+
+    // Gather statistics for the tile at curr.  Safe to call from multiple threads.
+    static tile_statistics_t analyze (const uint32_t* curr,
+				      const size_t stride,
+				      const uint16_t width,
+				      const uint16_t height) {
+      tile_statistics_t stats;
+      stats.width = width;
+      stats.height = height;
+      zrle_palette palette;
+      uint32_t last = curr[0];
+      for (uint16_t y = 0; y != height; ++y) {
+	const uint32_t* c = curr + y * stride;
+	for (uint16_t x = 0; x != width; ++x) {
+	  if (c[x] != last) {
+	    if (!palette.overflow ()) {
+	      palette.insert (last);
+	    }
+	    ++stats.runs;
+	    last = c[x];
+	  }
+	}
+      }
+      palette.insert (last);
+      ++stats.runs;
+      stats.colors = palette.size () + palette.overflow ();
+      return stats;
+    }
+
+    // Pick the cheapest encoding in the client's list.  Ties go to the client's preference.
+    int32_t select (const std::vector<int32_t>& encodings,
+		    const tile_statistics_t& stats,
+		    const pixel_format_t& format) const {
+      int32_t best = RAW;
+      double best_cost = 0;
+      bool found = false;
+      for (std::vector<int32_t>::const_iterator pos = encodings.begin ();
+	   pos != encodings.end ();
+	   ++pos) {
+	if (!can_encode (*pos)) {
+	  continue;
+	}
+	const model_t& model = m_models.find (*pos)->second;
+	const double bytes = RECTANGLE_HEADER + model.size_ratio * estimate_size (*pos, stats, format);
+	const double cost = bytes / m_bytes_per_ns + model.ns_per_pixel * stats.pixels ();
+	if (!found || cost < best_cost) {
+	  best = *pos;
+	  best_cost = cost;
+	  found = true;
+	}
+      }
+      return best;
+    }
+
+    // Update the model with the outcome of encoding a tile.  ns is zero if the tile was not encoded (a cache hit).
+    void record_encoding (const int32_t encoding,
+			  const tile_statistics_t& stats,
+			  const pixel_format_t& format,
+			  const size_t bytes,
+			  const uint64_t ns) {
+      model_t& model = m_models[encoding];
+      const size_t estimate = estimate_size (encoding, stats, format);
+      if (estimate != 0) {
+	model.size_ratio += SELECTOR_ALPHA * (double (bytes) / estimate - model.size_ratio);
+      }
+      if (ns != 0 && stats.pixels () != 0) {
+	model.ns_per_pixel += SELECTOR_ALPHA * (double (ns) / stats.pixels () - model.ns_per_pixel);
+      }
+
+      encoding_counters_t& counters = m_counters[encoding];
+      ++counters.rectangles;
+      counters.pixels += stats.pixels ();
+      counters.bytes += bytes;
+      counters.encode_ns += ns;
+    }
+
+    // Update the throughput with an update of bytes that left at sent_ns and was acknowledged at ack_ns.
+    void record_transmission (const size_t bytes,
+			      const uint64_t sent_ns,
+			      const uint64_t ack_ns) {
+      if (ack_ns <= sent_ns) {
+	return;
+      }
+      const uint64_t rtt = ack_ns - sent_ns;
+      if (m_min_rtt_ns == 0 || rtt < m_min_rtt_ns) {
+	m_min_rtt_ns = rtt;
+      }
+
+      uint64_t ns;
+      if (m_last_ack_ns != 0 && sent_ns < m_last_ack_ns) {
+	// Queued behind the last update so it drained in the time between the acknowledgements.
+	ns = ack_ns - m_last_ack_ns;
+      }
+      else {
+	ns = rtt - m_min_rtt_ns;
+	// Less than this is lost in the variation of the latency.
+	if (ns < m_min_rtt_ns / 4) {
+	  ns = 0;
+	}
+      }
+      m_last_ack_ns = ack_ns;
+
+      if (ns != 0) {
+	m_bytes_per_ns += SELECTOR_ALPHA * (double (bytes) / ns - m_bytes_per_ns);
+      }
+    }
+
+    const encoding_counters_t& counters (const int32_t encoding) {
+      return m_counters[encoding];
+    }
+
+    double bytes_per_ns () const {
+      return m_bytes_per_ns;
+    }
+
+    uint64_t min_rtt_ns () const {
+      return m_min_rtt_ns;
+    }
+
+    void print (std::ostream& out) const {
+      out << "throughput = " << m_bytes_per_ns * 1000.0 << " MB/s" << std::endl;
+      for (counters_map::const_iterator pos = m_counters.begin ();
+	   pos != m_counters.end ();
+	   ++pos) {
+	const encoding_counters_t& c = pos->second;
+	out << "encoding " << pos->first
+	    << ": rectangles = " << c.rectangles
+	    << " pixels = " << c.pixels
+	    << " bytes = " << c.bytes
+	    << " encode_ns = " << c.encode_ns;
+	if (c.pixels != 0) {
+	  out << " bytes/pixel = " << double (c.bytes) / c.pixels
+	      << " ns/pixel = " << double (c.encode_ns) / c.pixels;
+	}
+	out << std::endl;
+      }
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef __frame_source_hpp__
+#define __frame_source_hpp__
+
+#include "damage_region.hpp"
+
+#include <cstdlib>
+
+#include <stdint.h>
+
+/*
+  Produces the server's image.
+
+  The server asks for a frame when a client is waiting for one and the frame interval has passed.
+  A source draws into the framebuffer and adds what it changed to the damage region.
+  The server only compares the damaged tiles with the previous frame and sends nothing if the region is empty.
+*/
+
+namespace rfb {
+
+  class frame_source
+  {
+  public:
+    virtual ~frame_source () { }
+
+    // Draw the next frame over the current one.  Pixels are in the server's pixel format in rows of width pixels.
+    virtual void produce (uint32_t* pixels,
+			  const uint16_t width,
+			  const uint16_t height,
+			  damage_region& damage) = 0;
+  };
+
+  // Every pixel random every frame.  The worst case for the encoders.
+  class noise_frame_source :
+    public frame_source
+  {
+  public:
+    void produce (uint32_t* pixels,
+		  const uint16_t width,
+		  const uint16_t height,
+		  damage_region& damage) {
+      for (size_t i = 0; i != size_t (width) * height; ++i) {
+	pixels[i] = rand ();
+      }
+      damage.add (0, 0, width, height);
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __monotonic_clock_hpp__
+#define __monotonic_clock_hpp__
+
+#include <time.h>
+#include <stdint.h>
+
+// Nanoseconds from an arbitrary but fixed point.  Suitable for measuring intervals.
+inline uint64_t monotonic_ns () {
+  timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return uint64_t (ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
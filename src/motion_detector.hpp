@@ -0,0 +1,208 @@
+#ifndef __motion_detector_hpp__
+#define __motion_detector_hpp__
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+
+#include <stdint.h>
+
+/*
+  Scroll and move detection for CopyRect.
+
+  Rows (or columns) of the previous and current frames are hashed.
+  Every row of the current frame whose hash appears exactly once in the previous frame votes for an offset.
+  The winning offset is verified with a pixel comparison and the longest contiguous band of matching rows is reported.
+*/
+
+namespace rfb {
+
+  const uint64_t MOTION_HASH_SEED = 0xCBF29CE484222325ULL;
+
+  struct motion_t
+  {
+    // Destination of the moved band.
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+    // Source of the moved band.
+    uint16_t src_x_position;
+    uint16_t src_y_position;
+
+    motion_t () :
+      x_position (0),
+      y_position (0),
+      width (0),
+      height (0),
+      src_x_position (0),
+      src_y_position (0)
+    { }
+
+    uint32_t area () const {
+      return uint32_t (width) * height;
+    }
+  };
+
+  class motion_detector
+  {
+  private:
+    // Minimum number of rows or columns in a band.
+    const uint16_t m_min_band;
+    std::vector<uint64_t> m_prev_hash;
+    std::vector<uint64_t> m_curr_hash;
+    std::map<uint64_t, int> m_index;
+    std::map<int, size_t> m_votes;
+
+    static uint64_t mix (uint64_t h,
+			 const uint32_t v) {
+      return (h ^ v) * 0x100000001B3ULL;
+    }
+
+    // Find the most popular offset between prev and curr.  Returns false if there is no candidate.
+    bool vote (int& offset) {
+      const int size = m_curr_hash.size ();
+
+      // Index the unique hashes of the previous frame.
+      m_index.clear ();
+      for (int i = 0; i != size; ++i) {
+	std::pair<std::map<uint64_t, int>::iterator, bool> r = m_index.insert (std::make_pair (m_prev_hash[i], i));
+	if (!r.second) {
+	  r.first->second = -1;
+	}
+      }
+
+      m_votes.clear ();
+      for (int i = 0; i != size; ++i) {
+	if (m_curr_hash[i] == m_prev_hash[i]) {
+	  // Unchanged.
+	  continue;
+	}
+	std::map<uint64_t, int>::const_iterator pos = m_index.find (m_curr_hash[i]);
+	if (pos != m_index.end () && pos->second != -1) {
+	  ++m_votes[i - pos->second];
+	}
+      }
+
+      size_t best = 0;
+      for (std::map<int, size_t>::const_iterator pos = m_votes.begin ();
+	   pos != m_votes.end ();
+	   ++pos) {
+	if (pos->second > best) {
+	  best = pos->second;
+	  offset = pos->first;
+	}
+      }
+
+      return best != 0;
+    }
+
+  public:
+    motion_detector (const uint16_t min_band = 8) :
+      m_min_band (min_band)
+    { }
+
+    // Detect a vertical or horizontal move inside the rectangle (x, y, width, height).
+    // prev and curr point to the upper-left pixel of their frames and stride is the frame width.
+    bool detect (const uint32_t* prev,
+		 const uint32_t* curr,
+		 const size_t stride,
+		 const uint16_t x,
+		 const uint16_t y,
+		 const uint16_t width,
+		 const uint16_t height,
+		 motion_t& motion) {
+      motion = motion_t ();
+      if (width < m_min_band || height < m_min_band) {
+	return false;
+      }
+
+      const uint32_t* p = prev + y * stride + x;
+      const uint32_t* c = curr + y * stride + x;
+      int offset;
+
+      // Vertical.
+      m_prev_hash.assign (height, MOTION_HASH_SEED);
+      m_curr_hash.assign (height, MOTION_HASH_SEED);
+      for (uint16_t r = 0; r != height; ++r) {
+	for (uint16_t col = 0; col != width; ++col) {
+	  m_prev_hash[r] = mix (m_prev_hash[r], p[r * stride + col]);
+	  m_curr_hash[r] = mix (m_curr_hash[r], c[r * stride + col]);
+	}
+      }
+      if (vote (offset)) {
+	// Find the longest band of rows that moved by offset.
+	int start = 0;
+	int length = 0;
+	for (int r = std::max (0, offset); r < std::min (int (height), height + offset); ++r) {
+	  if (memcmp (c + r * stride, p + (r - offset) * stride, width * sizeof (uint32_t)) == 0) {
+	    ++length;
+	    if (length > motion.height) {
+	      motion.height = length;
+	      start = r - length + 1;
+	    }
+	  }
+	  else {
+	    length = 0;
+	  }
+	}
+	if (motion.height >= m_min_band) {
+	  motion.x_position = x;
+	  motion.y_position = y + start;
+	  motion.width = width;
+	  motion.src_x_position = x;
+	  motion.src_y_position = y + start - offset;
+	}
+	else {
+	  motion = motion_t ();
+	}
+      }
+
+      // Horizontal.
+      m_prev_hash.assign (width, MOTION_HASH_SEED);
+      m_curr_hash.assign (width, MOTION_HASH_SEED);
+      for (uint16_t r = 0; r != height; ++r) {
+	for (uint16_t col = 0; col != width; ++col) {
+	  m_prev_hash[col] = mix (m_prev_hash[col], p[r * stride + col]);
+	  m_curr_hash[col] = mix (m_curr_hash[col], c[r * stride + col]);
+	}
+      }
+      if (vote (offset)) {
+	// Find the longest band of columns that moved by offset.
+	int start = 0;
+	int length = 0;
+	int best = 0;
+	for (int col = std::max (0, offset); col < std::min (int (width), width + offset); ++col) {
+	  bool match = true;
+	  for (uint16_t r = 0; match && r != height; ++r) {
+	    match = c[r * stride + col] == p[r * stride + col - offset];
+	  }
+	  if (match) {
+	    ++length;
+	    if (length > best) {
+	      best = length;
+	      start = col - length + 1;
+	    }
+	  }
+	  else {
+	    length = 0;
+	  }
+	}
+	if (best >= m_min_band && uint32_t (best) * height > motion.area ()) {
+	  motion.x_position = x + start;
+	  motion.y_position = y;
+	  motion.width = best;
+	  motion.height = height;
+	  motion.src_x_position = x + start - offset;
+	  motion.src_y_position = y;
+	}
+      }
+
+      return motion.area () != 0;
+    }
+  };
+
+}
+
+#endif
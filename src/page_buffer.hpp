@@ -0,0 +1,109 @@
+#ifndef __page_buffer_hpp__
+#define __page_buffer_hpp__
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+  Zeroed, page-aligned memory for framebuffers.
+
+  The memory is mapped directly so a framebuffer of any size starts on a page boundary and is returned to the system when released.
+  With huge pages, buffers of at least HUGE_PAGE_SIZE bytes are first mapped from the huge page pool and then, if the pool is empty, advised to use transparent huge pages.
+*/
+
+class page_buffer
+{
+public:
+  static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+private:
+  void* m_data;
+  // The size of the mapping.
+  size_t m_mapped;
+  size_t m_size;
+  bool m_huge_pages;
+
+  page_buffer (const page_buffer&);
+  page_buffer& operator= (const page_buffer&);
+
+  static size_t round_up (const size_t bytes,
+			  const size_t page) {
+    return (bytes + page - 1) / page * page;
+  }
+
+public:
+  page_buffer () :
+    m_data (0),
+    m_mapped (0),
+    m_size (0),
+    m_huge_pages (false)
+  { }
+
+  ~page_buffer () {
+    release ();
+  }
+
+  // Replace the buffer with bytes of zeros.
+  void allocate (const size_t bytes,
+		 const bool huge_pages) {
+    release ();
+    if (bytes == 0) {
+      return;
+    }
+
+#ifdef MAP_HUGETLB
+    if (huge_pages && bytes >= HUGE_PAGE_SIZE) {
+      m_mapped = round_up (bytes, HUGE_PAGE_SIZE);
+      m_data = mmap (0, m_mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (m_data != MAP_FAILED) {
+	m_size = bytes;
+	m_huge_pages = true;
+	return;
+      }
+    }
+#endif
+
+    m_mapped = round_up (bytes, sysconf (_SC_PAGESIZE));
+    m_data = mmap (0, m_mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_data == MAP_FAILED) {
+      perror ("mmap");
+      exit (EXIT_FAILURE);
+    }
+    m_size = bytes;
+
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && bytes >= HUGE_PAGE_SIZE) {
+      // Only a hint.
+      madvise (m_data, m_mapped, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  void release () {
+    if (m_data != 0) {
+      munmap (m_data, m_mapped);
+      m_data = 0;
+      m_mapped = 0;
+      m_size = 0;
+      m_huge_pages = false;
+    }
+  }
+
+  void* data () const {
+    return m_data;
+  }
+
+  size_t size () const {
+    return m_size;
+  }
+
+  // True if the buffer came from the huge page pool.
+  bool huge_pages () const {
+    return m_huge_pages;
+  }
+};
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef __pixel_translator_hpp__
+#define __pixel_translator_hpp__
+
+#include <substrate/rgram.hpp>
+#include "rfb.hpp"
+
+#include <vector>
+#include <cstring>
+
+#include <stdint.h>
+
+/*
+  Translation from the server's pixel format to a client's pixel format.
+
+  The server format must be true colour with 8-bit channels.
+  The client format may be 8, 16, or 32 bits per pixel, either byte order, true colour with arbitrary maxes and shifts, or colour-mapped 8-bit.
+  Colour-mapped clients are given a 6x6x6 colour cube (see colour_map ()).
+
+  A kernel is chosen when the format is set:
+  IDENTITY copies pixels.
+  SHIFT handles true colour formats whose maxes are 2^n - 1 by truncating each channel with shifts and masks, four pixels at a time.
+  TABLE handles everything else with a lookup table per channel.
+*/
+
+namespace rfb {
+
+  const size_t COLOUR_CUBE_SIZE = 6;
+
+  class pixel_translator
+  {
+  public:
+    enum kernel_t {
+      IDENTITY,
+      SHIFT,
+      TABLE,
+    };
+
+  private:
+    pixel_format_t m_server;
+    pixel_format_t m_client;
+    kernel_t m_kernel;
+
+    // Server channel shifts.
+    unsigned int m_src_shift[3];
+    // SHIFT: bits to drop from each 8-bit channel.
+    unsigned int m_drop[3];
+    // TABLE: contribution of each channel value to the client pixel.
+    uint32_t m_table[3][256];
+
+    static bool is_power_of_two_minus_one (const uint16_t max) {
+      return max != 0 && (max & (max + 1)) == 0;
+    }
+
+    static unsigned int bits (uint16_t max) {
+      unsigned int n = 0;
+      for (; max != 0; max >>= 1) {
+	++n;
+      }
+      return n;
+    }
+
+    static bool equal (const pixel_format_t& a,
+		       const pixel_format_t& b) {
+      return a.bits_per_pixel == b.bits_per_pixel &&
+	a.depth == b.depth &&
+	a.big_endian_flag == b.big_endian_flag &&
+	a.true_colour_flag == b.true_colour_flag &&
+	a.red_max == b.red_max &&
+	a.green_max == b.green_max &&
+	a.blue_max == b.blue_max &&
+	a.red_shift == b.red_shift &&
+	a.green_shift == b.green_shift &&
+	a.blue_shift == b.blue_shift;
+    }
+
+    void translate_shift (const uint32_t* src,
+			  uint32_t* dst,
+			  const size_t count) const {
+      const uint32_t rs = m_src_shift[0] + m_drop[0];
+      const uint32_t gs = m_src_shift[1] + m_drop[1];
+      const uint32_t bs = m_src_shift[2] + m_drop[2];
+      const uint32_t rm = m_client.red_max;
+      const uint32_t gm = m_client.green_max;
+      const uint32_t bm = m_client.blue_max;
+      const uint32_t rd = m_client.red_shift;
+      const uint32_t gd = m_client.green_shift;
+      const uint32_t bd = m_client.blue_shift;
+
+      size_t i = 0;
+#ifdef __GNUC__
+      typedef uint32_t v4u32 __attribute__ ((vector_size (16)));
+      for (; i + 4 <= count; i += 4) {
+	v4u32 p;
+	memcpy (&p, src + i, sizeof (p));
+	const v4u32 r = ((p >> rs) & rm) << rd;
+	const v4u32 g = ((p >> gs) & gm) << gd;
+	const v4u32 b = ((p >> bs) & bm) << bd;
+	const v4u32 v = r | g | b;
+	memcpy (dst + i, &v, sizeof (v));
+      }
+#endif
+      for (; i != count; ++i) {
+	const uint32_t p = src[i];
+	dst[i] = (((p >> rs) & rm) << rd) | (((p >> gs) & gm) << gd) | (((p >> bs) & bm) << bd);
+      }
+    }
+
+    void translate_table (const uint32_t* src,
+			  uint32_t* dst,
+			  const size_t count) const {
+      const unsigned int rs = m_src_shift[0];
+      const unsigned int gs = m_src_shift[1];
+      const unsigned int bs = m_src_shift[2];
+      for (size_t i = 0; i != count; ++i) {
+	const uint32_t p = src[i];
+	// Addition rather than or so colour cube indices combine.
+	dst[i] = m_table[0][(p >> rs) & 0xFF] + m_table[1][(p >> gs) & 0xFF] + m_table[2][(p >> bs) & 0xFF];
+      }
+    }
+
+  public:
+    pixel_translator (const pixel_format_t& server) :
+      m_server (server),
+      m_client (server),
+      m_kernel (IDENTITY)
+    {
+      assert (server.true_colour_flag);
+      assert (server.red_max == 255 && server.green_max == 255 && server.blue_max == 255);
+      m_src_shift[0] = server.red_shift;
+      m_src_shift[1] = server.green_shift;
+      m_src_shift[2] = server.blue_shift;
+    }
+
+    // Returns false if the client format is not supported.
+    static bool valid (const pixel_format_t& client) {
+      if (client.bits_per_pixel != 8 && client.bits_per_pixel != 16 && client.bits_per_pixel != 32) {
+	return false;
+      }
+      if (!client.true_colour_flag) {
+	return client.bits_per_pixel == 8;
+      }
+      const uint16_t maxes[3] = { client.red_max, client.green_max, client.blue_max };
+      const uint8_t shifts[3] = { client.red_shift, client.green_shift, client.blue_shift };
+      for (size_t c = 0; c != 3; ++c) {
+	if (maxes[c] == 0 || bits (maxes[c]) + shifts[c] > client.bits_per_pixel) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+    void set_client_format (const pixel_format_t& client) {
+      assert (valid (client));
+      m_client = client;
+
+      if (!client.true_colour_flag) {
+	// Index into the colour cube.
+	for (size_t c = 0; c != 3; ++c) {
+	  const uint32_t scale = c == 0 ? COLOUR_CUBE_SIZE * COLOUR_CUBE_SIZE : (c == 1 ? COLOUR_CUBE_SIZE : 1);
+	  for (uint32_t v = 0; v != 256; ++v) {
+	    m_table[c][v] = ((v * (COLOUR_CUBE_SIZE - 1) + 127) / 255) * scale;
+	  }
+	}
+	m_kernel = TABLE;
+	return;
+      }
+
+      // The byte order is applied by pack () so it does not prevent the identity kernel.
+      pixel_format_t f = client;
+      f.big_endian_flag = m_server.big_endian_flag;
+      f.depth = m_server.depth;
+      if (equal (f, m_server)) {
+	m_kernel = IDENTITY;
+	return;
+      }
+
+      const uint16_t maxes[3] = { client.red_max, client.green_max, client.blue_max };
+      const uint8_t shifts[3] = { client.red_shift, client.green_shift, client.blue_shift };
+      m_kernel = SHIFT;
+      for (size_t c = 0; c != 3; ++c) {
+	if (!is_power_of_two_minus_one (maxes[c]) || maxes[c] > 255) {
+	  m_kernel = TABLE;
+	}
+	else {
+	  m_drop[c] = 8 - bits (maxes[c]);
+	}
+	for (uint32_t v = 0; v != 256; ++v) {
+	  m_table[c][v] = ((v * maxes[c] + 127) / 255) << shifts[c];
+	}
+      }
+    }
+
+    const pixel_format_t& client_format () const {
+      return m_client;
+    }
+
+    kernel_t kernel () const {
+      return m_kernel;
+    }
+
+    bool identity () const {
+      return m_kernel == IDENTITY;
+    }
+
+    size_t bytes_per_pixel () const {
+      return m_client.bits_per_pixel / 8;
+    }
+
+    // Convert server pixel values to client pixel values.
+    void translate (const uint32_t* src,
+		    uint32_t* dst,
+		    const size_t count) const {
+      switch (m_kernel) {
+      case IDENTITY:
+	memcpy (dst, src, count * sizeof (uint32_t));
+	break;
+      case SHIFT:
+	translate_shift (src, dst, count);
+	break;
+      case TABLE:
+	translate_table (src, dst, count);
+	break;
+      }
+    }
+
+    // Write client pixel values as bytes in the client's size and byte order.
+    void pack (const uint32_t* src,
+	       uint8_t* dst,
+	       const size_t count) const {
+      const bool native_big_endian = htonl (1) == 1;
+      switch (m_client.bits_per_pixel) {
+      case 32:
+	if (bool (m_client.big_endian_flag) == native_big_endian) {
+	  memcpy (dst, src, count * sizeof (uint32_t));
+	}
+	else {
+	  for (size_t i = 0; i != count; ++i) {
+	    const uint32_t v = src[i];
+	    if (m_client.big_endian_flag) {
+	      dst[4 * i] = v >> 24;
+	      dst[4 * i + 1] = v >> 16;
+	      dst[4 * i + 2] = v >> 8;
+	      dst[4 * i + 3] = v;
+	    }
+	    else {
+	      dst[4 * i] = v;
+	      dst[4 * i + 1] = v >> 8;
+	      dst[4 * i + 2] = v >> 16;
+	      dst[4 * i + 3] = v >> 24;
+	    }
+	  }
+	}
+	break;
+      case 16:
+	for (size_t i = 0; i != count; ++i) {
+	  const uint32_t v = src[i];
+	  if (m_client.big_endian_flag) {
+	    dst[2 * i] = v >> 8;
+	    dst[2 * i + 1] = v;
+	  }
+	  else {
+	    dst[2 * i] = v;
+	    dst[2 * i + 1] = v >> 8;
+	  }
+	}
+	break;
+      case 8:
+	for (size_t i = 0; i != count; ++i) {
+	  dst[i] = src[i];
+	}
+	break;
+      }
+    }
+
+    // The colour map for colour-mapped clients as (red, green, blue) triples with 16-bit intensities.
+    static std::vector<uint16_t> colour_map () {
+      std::vector<uint16_t> map;
+      for (size_t r = 0; r != COLOUR_CUBE_SIZE; ++r) {
+	for (size_t g = 0; g != COLOUR_CUBE_SIZE; ++g) {
+	  for (size_t b = 0; b != COLOUR_CUBE_SIZE; ++b) {
+	    map.push_back (r * 65535 / (COLOUR_CUBE_SIZE - 1));
+	    map.push_back (g * 65535 / (COLOUR_CUBE_SIZE - 1));
+	    map.push_back (b * 65535 / (COLOUR_CUBE_SIZE - 1));
+	  }
+	}
+      }
+      return map;
+    }
+  };
+
+}
+
+#endif
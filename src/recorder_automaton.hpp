@@ -0,0 +1,44 @@
+#ifndef __recorder_automaton_hpp__
+#define __recorder_automaton_hpp__
+
+#include "session_recording.hpp"
+
+#include <ioa/ioa.hpp>
+
+/*
+  Records an RFB session.
+
+  Bind the server's send to server_to_client and the client's send to client_to_server next to the channels that carry them.
+  Every buffer is appended to the recording with the time it was sent.
+*/
+
+class recorder_automaton :
+  public ioa::automaton
+{
+private:
+  rfb::recording_writer m_writer;
+
+  void schedule () const { }
+
+  void server_to_client_effect (const ioa::const_shared_ptr<ioa::buffer_interface>& val) {
+    if (val.get () != 0) {
+      m_writer.write (rfb::SERVER_TO_CLIENT, *val.get ());
+    }
+  }
+
+  void client_to_server_effect (const ioa::const_shared_ptr<ioa::buffer_interface>& val) {
+    if (val.get () != 0) {
+      m_writer.write (rfb::CLIENT_TO_SERVER, *val.get ());
+    }
+  }
+
+public:
+  recorder_automaton (const std::string& path) :
+    m_writer (path)
+  { }
+
+  V_UP_INPUT (recorder_automaton, server_to_client, ioa::const_shared_ptr<ioa::buffer_interface>);
+  V_UP_INPUT (recorder_automaton, client_to_server, ioa::const_shared_ptr<ioa::buffer_interface>);
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef __replay_automaton_hpp__
+#define __replay_automaton_hpp__
+
+#include "session_recording.hpp"
+#include "monotonic_clock.hpp"
+
+#include <substrate/rgram.hpp>
+
+#include <ioa/ioa.hpp>
+
+/*
+  Plays one direction of a recorded RFB session.
+
+  Bind send to a client's receive to replay a server, or to a server's receive to replay a client.
+  Whatever the other side sends should be bound to receive, which discards it, so it does not queue up.
+  Messages are sent at their recorded times relative to the first, or as fast as they are taken if original_timing is false.
+  The buffers sent point into the mapped recording so replay costs no reads or copies.
+*/
+
+class replay_automaton :
+  public ioa::automaton
+{
+private:
+  rfb::recording_reader m_reader;
+  const rfb::recording_direction_t m_direction;
+  const bool m_original_timing;
+  // The message to send next.  Null at the end of the recording.
+  rfb::recorded_message_t m_next;
+  // When the first message was sent and when it was recorded.
+  uint64_t m_start_ns;
+  uint64_t m_first_ns;
+  bool m_started;
+  // The next message may be sent.
+  bool m_due;
+
+  // Read ahead to the next message in our direction and wait for its time.
+  void load_next () {
+    while (m_reader.next (m_next)) {
+      if (m_next.direction != m_direction) {
+	continue;
+      }
+      if (!m_original_timing) {
+	return;
+      }
+      const uint64_t now = monotonic_ns ();
+      if (!m_started) {
+	m_started = true;
+	m_start_ns = now;
+	m_first_ns = m_next.ns;
+      }
+      const uint64_t due = m_start_ns + (m_next.ns - m_first_ns);
+      if (due > now) {
+	const uint64_t delay = due - now;
+	m_due = false;
+	ioa::schedule_after (&replay_automaton::timer, ioa::time (delay / 1000000000ULL, (delay / 1000) % 1000000));
+      }
+      return;
+    }
+    m_next.buffer = ioa::const_shared_ptr<ioa::buffer_interface> ();
+  }
+
+  void schedule () const {
+    if (send_precondition ()) {
+      ioa::schedule (&replay_automaton::send);
+    }
+  }
+
+  bool send_precondition () const {
+    return m_next.buffer.get () != 0 && m_due && ioa::binding_count (&replay_automaton::send) != 0;
+  }
+
+  ioa::const_shared_ptr<ioa::buffer_interface> send_effect () {
+    ioa::const_shared_ptr<ioa::buffer_interface> retval = m_next.buffer;
+    load_next ();
+    return retval;
+  }
+
+  bool timer_precondition () const {
+    return !m_due;
+  }
+
+  void timer_effect () {
+    m_due = true;
+  }
+
+  void receive_effect (const ioa::const_shared_ptr<ioa::buffer_interface>&) { }
+
+  void receive_batch_effect (const ioa::const_shared_ptr<rgram::buffer_chain>&) { }
+
+public:
+  replay_automaton (const std::string& path,
+		    const rfb::recording_direction_t direction,
+		    const bool original_timing) :
+    m_reader (path),
+    m_direction (direction),
+    m_original_timing (original_timing),
+    m_start_ns (0),
+    m_first_ns (0),
+    m_started (false),
+    m_due (true)
+  {
+    load_next ();
+    schedule ();
+  }
+
+  V_UP_OUTPUT (replay_automaton, send, ioa::const_shared_ptr<ioa::buffer_interface>);
+  V_UP_INPUT (replay_automaton, receive, ioa::const_shared_ptr<ioa::buffer_interface>);
+  V_UP_INPUT (replay_automaton, receive_batch, ioa::const_shared_ptr<rgram::buffer_chain>);
+
+private:
+  UP_INTERNAL (replay_automaton, timer);
+};
+
+#endif
@@ -421,6 +421,14 @@ namespace rfb {
   const int32_t RRE = 2;
   const int32_t HEXTILE = 5;
   const int32_t ZRLE = 16;
+  // Private pseudo-encoding for the content cache (see content_cache.hpp).  The pixel data is the slot as a U32.
+  const int32_t CACHED_TILE = -0x43540001;
+  // The rectangle is the hotspot and size of the pointer.  The pixel data is the image followed by a bitmask of opaque pixels.
+  const int32_t CURSOR = -239;
+  // The width and height of the rectangle are the new size of the framebuffer.  There is no pixel data.
+  const int32_t DESKTOP_SIZE = -223;
+  const int32_t FENCE = -312;
+  const int32_t CONTINUOUS_UPDATES = -313;
 
   struct set_encodings_t {
     uint8_t padding;
@@ -567,18 +575,305 @@ namespace rfb {
     }
   };
 
+  const uint8_t KEY_EVENT_TYPE = 4;
+
+  struct key_event_t
+  {
+    uint8_t down_flag;
+    // An X keysym.
+    uint32_t key;
+
+    key_event_t () { }
+
+    key_event_t (const bool down,
+		 const uint32_t k) :
+      down_flag (down),
+      key (k)
+    { }
+
+    void write_to_buffer (ioa::buffer& buf) const {
+      buf.append (&KEY_EVENT_TYPE, sizeof (KEY_EVENT_TYPE));
+      buf.append (&down_flag, sizeof (down_flag));
+      // Padding.
+      buf.resize (buf.size () + 2);
+      uint32_t x = htonl (key);
+      buf.append (&x, sizeof (x));
+    }
+  };
+
+  struct key_event_gramel :
+    public rgram::gramel
+  {
+    rgram::uint8_gramel m_down_flag;
+    rgram::fixed_array_gramel<rgram::uint8_gramel, 2> m_padding;
+    rgram::uint32_gramel m_key;
+    rgram::sequence_gramel m_sequence;
+
+    key_event_gramel () {
+      m_sequence.append (&m_down_flag);
+      m_sequence.append (&m_padding);
+      m_sequence.append (&m_key);
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_sequence.put (buf);
+    }
+
+    bool done () const {
+      return m_sequence.done ();
+    }
+
+    void reset () {
+      m_sequence.reset ();
+    }
+
+    key_event_t get () const {
+      return key_event_t (m_down_flag.get (), m_key.get ());
+    }
+  };
+
+  const uint8_t POINTER_EVENT_TYPE = 5;
+
+  struct pointer_event_t
+  {
+    // Bit n is set if button n + 1 is down.
+    uint8_t button_mask;
+    uint16_t x_position;
+    uint16_t y_position;
+
+    pointer_event_t () { }
+
+    pointer_event_t (const uint8_t mask,
+		     const uint16_t xpos,
+		     const uint16_t ypos) :
+      button_mask (mask),
+      x_position (xpos),
+      y_position (ypos)
+    { }
+
+    void write_to_buffer (ioa::buffer& buf) const {
+      buf.append (&POINTER_EVENT_TYPE, sizeof (POINTER_EVENT_TYPE));
+      buf.append (&button_mask, sizeof (button_mask));
+      uint16_t x;
+      x = htons (x_position);
+      buf.append (&x, sizeof (x));
+      x = htons (y_position);
+      buf.append (&x, sizeof (x));
+    }
+  };
+
+  struct pointer_event_gramel :
+    public rgram::gramel
+  {
+    rgram::uint8_gramel m_button_mask;
+    rgram::uint16_gramel m_x_position;
+    rgram::uint16_gramel m_y_position;
+    rgram::sequence_gramel m_sequence;
+
+    pointer_event_gramel () {
+      m_sequence.append (&m_button_mask);
+      m_sequence.append (&m_x_position);
+      m_sequence.append (&m_y_position);
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_sequence.put (buf);
+    }
+
+    bool done () const {
+      return m_sequence.done ();
+    }
+
+    void reset () {
+      m_sequence.reset ();
+    }
+
+    pointer_event_t get () const {
+      return pointer_event_t (m_button_mask.get (), m_x_position.get (), m_y_position.get ());
+    }
+  };
+
+  const uint8_t ENABLE_CONTINUOUS_UPDATES_TYPE = 150;
+
+  struct enable_continuous_updates_t
+  {
+    uint8_t enable;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+
+    enable_continuous_updates_t () { }
+
+    enable_continuous_updates_t (const bool e,
+				 const uint16_t xpos,
+				 const uint16_t ypos,
+				 const uint16_t w,
+				 const uint16_t h) :
+      enable (e),
+      x_position (xpos),
+      y_position (ypos),
+      width (w),
+      height (h)
+    { }
+
+    void write_to_buffer (ioa::buffer& buf) const {
+      buf.append (&ENABLE_CONTINUOUS_UPDATES_TYPE, sizeof (ENABLE_CONTINUOUS_UPDATES_TYPE));
+      buf.append (&enable, sizeof (enable));
+      uint16_t x;
+      x = htons (x_position);
+      buf.append (&x, sizeof (x));
+      x = htons (y_position);
+      buf.append (&x, sizeof (x));
+      x = htons (width);
+      buf.append (&x, sizeof (x));
+      x = htons (height);
+      buf.append (&x, sizeof (x));
+    }
+  };
+
+  struct enable_continuous_updates_gramel :
+    public rgram::gramel
+  {
+    rgram::uint8_gramel m_enable;
+    rgram::uint16_gramel m_x_position;
+    rgram::uint16_gramel m_y_position;
+    rgram::uint16_gramel m_width;
+    rgram::uint16_gramel m_height;
+    rgram::sequence_gramel m_sequence;
+
+    enable_continuous_updates_gramel () {
+      m_sequence.append (&m_enable);
+      m_sequence.append (&m_x_position);
+      m_sequence.append (&m_y_position);
+      m_sequence.append (&m_width);
+      m_sequence.append (&m_height);
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_sequence.put (buf);
+    }
+
+    bool done () const {
+      return m_sequence.done ();
+    }
+
+    void reset () {
+      m_sequence.reset ();
+    }
+
+    enable_continuous_updates_t get () const {
+      return enable_continuous_updates_t (m_enable.get (),
+					  m_x_position.get (),
+					  m_y_position.get (),
+					  m_width.get (),
+					  m_height.get ());
+    }
+  };
+
+  // Fences have the same type and layout in both directions.
+  const uint8_t FENCE_TYPE = 248;
+
+  const uint32_t FENCE_BLOCK_BEFORE = 1 << 0;
+  const uint32_t FENCE_BLOCK_AFTER = 1 << 1;
+  const uint32_t FENCE_SYNC_NEXT = 1 << 2;
+  const uint32_t FENCE_REQUEST = 1U << 31;
+  const size_t FENCE_MAX_PAYLOAD = 64;
+
+  struct fence_t
+  {
+    uint32_t flags;
+    std::vector<uint8_t> payload;
+
+    fence_t () { }
+
+    fence_t (const uint32_t f,
+	     const std::vector<uint8_t>& p) :
+      flags (f),
+      payload (p)
+    { }
+
+    void write_to_buffer (ioa::buffer& buf) const {
+      assert (payload.size () <= FENCE_MAX_PAYLOAD);
+      buf.append (&FENCE_TYPE, sizeof (FENCE_TYPE));
+      // Padding.
+      buf.resize (buf.size () + 3);
+      uint32_t f = htonl (flags);
+      buf.append (&f, sizeof (f));
+      uint8_t length = payload.size ();
+      buf.append (&length, sizeof (length));
+      if (!payload.empty ()) {
+	buf.append (&payload[0], payload.size ());
+      }
+    }
+  };
+
+  struct fence_gramel :
+    public rgram::gramel
+  {
+    rgram::fixed_array_gramel<rgram::uint8_gramel, 3> m_padding;
+    rgram::uint32_gramel m_flags;
+    rgram::uint8_gramel m_length;
+    rgram::sequence_gramel m_sequence;
+    rgram::dynamic_array_gramel<rgram::uint8_gramel> m_payload;
+
+    fence_gramel () {
+      m_sequence.append (&m_padding);
+      m_sequence.append (&m_flags);
+      m_sequence.append (&m_length);
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      if (!m_sequence.done ()) {
+	m_sequence.put (buf);
+      }
+      if (m_sequence.done ()) {
+	m_payload.set_size (m_length.get ());
+	// The payload may be empty.
+	if (!m_payload.done ()) {
+	  m_payload.put (buf);
+	}
+      }
+    }
+
+    bool done () const {
+      return m_payload.done ();
+    }
+
+    void reset () {
+      m_sequence.reset ();
+      m_payload.reset ();
+    }
+
+    fence_t get () const {
+      return fence_t (m_flags.get (), m_payload.get ());
+    }
+  };
+
   struct client_message_gramel :
     public rgram::gramel
   {
     set_pixel_format_gramel m_set_pixel_format;
     set_encodings_gramel m_set_encodings;
     framebuffer_update_request_gramel m_framebuffer_update_request;
+    key_event_gramel m_key_event;
+    pointer_event_gramel m_pointer_event;
+    enable_continuous_updates_gramel m_enable_continuous_updates;
+    fence_gramel m_fence;
     rgram::choice_gramel<rgram::uint8_gramel> m_choice;
 
     client_message_gramel () {
       m_choice.choices.insert (std::make_pair (SET_PIXEL_FORMAT_TYPE, &m_set_pixel_format));
       m_choice.choices.insert (std::make_pair (SET_ENCODINGS_TYPE, &m_set_encodings));
       m_choice.choices.insert (std::make_pair (FRAMEBUFFER_UPDATE_REQUEST_TYPE, &m_framebuffer_update_request));
+      m_choice.choices.insert (std::make_pair (KEY_EVENT_TYPE, &m_key_event));
+      m_choice.choices.insert (std::make_pair (POINTER_EVENT_TYPE, &m_pointer_event));
+      m_choice.choices.insert (std::make_pair (ENABLE_CONTINUOUS_UPDATES_TYPE, &m_enable_continuous_updates));
+      m_choice.choices.insert (std::make_pair (FENCE_TYPE, &m_fence));
     }
 
     void put (rgram::buffer& buf) {
@@ -596,6 +891,45 @@ namespace rfb {
   };
 
   const uint8_t FRAMEBUFFER_UPDATE_TYPE = 0;
+  const uint8_t SET_COLOUR_MAP_ENTRIES_TYPE = 1;
+  const uint8_t END_OF_CONTINUOUS_UPDATES_TYPE = 150;
+
+  struct end_of_continuous_updates_t
+  {
+    void write_to_buffer (ioa::buffer& buf) const {
+      buf.append (&END_OF_CONTINUOUS_UPDATES_TYPE, sizeof (END_OF_CONTINUOUS_UPDATES_TYPE));
+    }
+  };
+
+  struct set_colour_map_entries_t
+  {
+    uint16_t first_colour;
+    // Red, green, and blue for each colour.
+    std::vector<uint16_t> colours;
+
+    set_colour_map_entries_t (const uint16_t first,
+			      const std::vector<uint16_t>& c) :
+      first_colour (first),
+      colours (c)
+    { }
+
+    void write_to_buffer (ioa::buffer& buf) const {
+      buf.append (&SET_COLOUR_MAP_ENTRIES_TYPE, sizeof (SET_COLOUR_MAP_ENTRIES_TYPE));
+      // Padding.
+      buf.resize (buf.size () + 1);
+      uint16_t x;
+      x = htons (first_colour);
+      buf.append (&x, sizeof (x));
+      x = htons (colours.size () / 3);
+      buf.append (&x, sizeof (x));
+      for (std::vector<uint16_t>::const_iterator pos = colours.begin ();
+	   pos != colours.end ();
+	   ++pos) {
+	x = htons (*pos);
+	buf.append (&x, sizeof (x));
+      }
+    }
+  };
 
   struct pixel_data_t {
     virtual ~pixel_data_t () { }
@@ -648,6 +982,65 @@ namespace rfb {
     }
   };
 
+  struct copy_rect_t :
+    public pixel_data_t
+  {
+    const uint16_t src_x_position;
+    const uint16_t src_y_position;
+
+    copy_rect_t (const uint16_t src_xpos,
+		 const uint16_t src_ypos) :
+      src_x_position (src_xpos),
+      src_y_position (src_ypos)
+    { }
+
+    void write_to_buffer (ioa::buffer& buf) const {
+      int32_t e = htonl (COPY_RECT);
+      buf.append (&e, sizeof (e));
+      uint16_t x;
+      x = htons (src_x_position);
+      buf.append (&x, sizeof (x));
+      x = htons (src_y_position);
+      buf.append (&x, sizeof (x));
+    }
+  };
+
+  // Pixel data that has already been encoded.
+  struct encoded_pixel_data_t :
+    public pixel_data_t
+  {
+    const int32_t encoding;
+    // Shared so the same bytes can go to several clients.
+    const ioa::const_shared_ptr<std::vector<uint8_t> > data;
+
+    // Takes the contents of d.
+    encoded_pixel_data_t (const int32_t e,
+			  std::vector<uint8_t>& d) :
+      encoding (e),
+      data (take (d))
+    { }
+
+    encoded_pixel_data_t (const int32_t e,
+			  const ioa::const_shared_ptr<std::vector<uint8_t> >& d) :
+      encoding (e),
+      data (d)
+    { }
+
+    static ioa::const_shared_ptr<std::vector<uint8_t> > take (std::vector<uint8_t>& d) {
+      std::vector<uint8_t>* v = new std::vector<uint8_t> ();
+      v->swap (d);
+      return ioa::const_shared_ptr<std::vector<uint8_t> > (v);
+    }
+
+    void write_to_buffer (ioa::buffer& buf) const {
+      int32_t e = htonl (encoding);
+      buf.append (&e, sizeof (e));
+      if (!data->empty ()) {
+	buf.append (&(*data)[0], data->size ());
+      }
+    }
+  };
+
   struct rectangle_t
   {
     uint16_t x_position;
@@ -706,12 +1099,15 @@ namespace rfb {
       assert (!done ());
       if (!m_sequence.done ()) {
 	m_sequence.put (buf);
+	if (m_sequence.done ()) {
+	  // Once per rectangle since the pixel data may arrive over several puts.
+	  m_encoding_choice.set_dimensions (m_x_position.get (),
+					    m_y_position.get (),
+					    m_width.get (),
+					    m_height.get ());
+	}
       }
       if (m_sequence.done ()) {
-	m_encoding_choice.set_dimensions (m_x_position.get (),
-					  m_y_position.get (),
-					  m_width.get (),
-					  m_height.get ());
 	m_encoding_choice.put (buf);
       }
     }
@@ -850,11 +1246,15 @@ namespace rfb {
     public rgram::gramel
   {
     framebuffer_update_gramel m_framebuffer_update;
+    rgram::empty_gramel m_end_of_continuous_updates;
+    fence_gramel m_fence;
     rgram::choice_gramel<rgram::uint8_gramel> m_choice;
 
     server_message_gramel ()
     {
       m_choice.choices.insert (std::make_pair (FRAMEBUFFER_UPDATE_TYPE, &m_framebuffer_update));
+      m_choice.choices.insert (std::make_pair (END_OF_CONTINUOUS_UPDATES_TYPE, &m_end_of_continuous_updates));
+      m_choice.choices.insert (std::make_pair (FENCE_TYPE, &m_fence));
     }
 
     void put (rgram::buffer& buf) {
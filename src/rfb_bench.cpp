@@ -0,0 +1,640 @@
+#include "rfb_server_automaton.hpp"
+#include "rfb_client.hpp"
+#include "channel_automaton.hpp"
+#include "batched_channel_automaton.hpp"
+#include "bounded_channel_automaton.hpp"
+#include "recorder_automaton.hpp"
+#include "replay_automaton.hpp"
+#include "shaped_channel_automaton.hpp"
+#include "synthetic_frame_sources.hpp"
+#include "monotonic_clock.hpp"
+
+#include <ioa/global_fifo_scheduler.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+/*
+  End-to-end benchmark.
+
+  The server, a channel each way, and a client with no display run in one process under the global FIFO scheduler.
+  The workload, encodings, resolution, frame rate, and duration come from the command line.
+  The result is one line of JSON on standard output.
+
+  The channels can be given the delay, jitter, bandwidth, and MTU of a real network.
+  Or they can deliver everything queued in one action so that each receive parses a batch of buffers.
+  Or they can be bounded so that the server sends only what the channel to the client has room for.
+  The session can be recorded.  A recorded server stream can be replayed into the client in place of the server to measure decoding alone.
+
+  Measurement starts when the client has decoded the first update so the handshake and the initial full image are not counted.
+  The latency of a frame is the time from when the source drew it to when the client finished decoding the next update.
+  An update is encoded after the frames before it so this is exact when one request is outstanding.
+  With more requests or continuous updates a frame drawn while an update is in flight is charged to that update and the latency is understated.
+
+  Allocations are counted by replacing operator new and include the encoder threads.
+*/
+
+static size_t allocations = 0;
+
+// Not inlined so the compiler does not see free paired with new.
+void* operator new (size_t size) __attribute__ ((noinline));
+void operator delete (void* p) throw () __attribute__ ((noinline));
+
+void* operator new (size_t size) {
+  __sync_fetch_and_add (&allocations, 1);
+  void* p = malloc (size != 0 ? size : 1);
+  if (p == 0) {
+    throw std::bad_alloc ();
+  }
+  return p;
+}
+
+void operator delete (void* p) throw () {
+  free (p);
+}
+
+struct encoding_name_t
+{
+  const char* name;
+  int32_t encoding;
+};
+
+static const encoding_name_t ENCODING_NAMES[] = {
+  { "raw", rfb::RAW },
+  { "copyrect", rfb::COPY_RECT },
+  { "zrle", rfb::ZRLE },
+  { "cached", rfb::CACHED_TILE },
+  { "cursor", rfb::CURSOR },
+  { "desktopsize", rfb::DESKTOP_SIZE },
+  { "fence", rfb::FENCE },
+  { "continuous", rfb::CONTINUOUS_UPDATES },
+};
+
+// What the interactive client offers.
+static const char* DEFAULT_ENCODINGS = "desktopsize,cursor,continuous,fence,cached,copyrect,zrle,raw";
+
+struct bench_options_t
+{
+  std::string workload;
+  std::string encoding_names;
+  std::vector<int32_t> encodings;
+  uint16_t width;
+  uint16_t height;
+  unsigned int frames_per_second;
+  unsigned int seconds;
+  size_t request_window;
+  // Record the session to this file if not empty.
+  std::string record;
+  // Replay the server's side of this recording instead of running a server if not empty.
+  std::string replay;
+  bool original_timing;
+  // Use shaped channels.
+  bool shaped;
+  channel_shape_t shape;
+  // Use batched channels that deliver up to this many buffers at once if not zero.
+  size_t batch;
+  // Use bounded channels with room for this many buffers holding this many bytes if not zero.
+  size_t queue_items;
+  size_t queue_bytes;
+
+  bench_options_t () :
+    workload ("terminal"),
+    width (1280),
+    height (720),
+    frames_per_second (0),
+    seconds (10),
+    request_window (1),
+    original_timing (false),
+    shaped (false),
+    batch (0),
+    queue_items (0),
+    queue_bytes (1024 * 1024)
+  { }
+};
+
+// Shared by the automata.  They all run on the scheduler's thread.
+class bench_record
+{
+private:
+  bool m_started;
+  uint64_t m_start_ns;
+  size_t m_start_allocations;
+  // When each frame not yet seen by the client was drawn.
+  std::deque<uint64_t> m_pending;
+  std::vector<uint64_t> m_latencies;
+  size_t m_updates;
+  uint64_t m_bytes;
+  // Receive actions performed by the client.
+  size_t m_receives;
+  channel_statistics_t m_channel;
+  uint64_t m_last_ns;
+
+  static double percentile (const std::vector<uint64_t>& sorted,
+			    const double p) {
+    if (sorted.empty ()) {
+      return 0;
+    }
+    return sorted[std::min (sorted.size () - 1, size_t (p * sorted.size ()))] / 1000000.0;
+  }
+
+public:
+  // Where the report goes.  Everything else written to std::cout is discarded.
+  std::streambuf* output;
+
+  bench_record () :
+    m_started (false),
+    m_start_ns (0),
+    m_start_allocations (0),
+    m_updates (0),
+    m_bytes (0),
+    m_receives (0),
+    m_last_ns (0),
+    output (0)
+  { }
+
+  void frame_drawn () {
+    if (m_started) {
+      m_pending.push_back (monotonic_ns ());
+    }
+  }
+
+  void received (const size_t bytes) {
+    if (m_started) {
+      m_bytes += bytes;
+    }
+  }
+
+  void receive_done () {
+    if (m_started) {
+      ++m_receives;
+    }
+  }
+
+  // The channel to the client.  Counted from the start so the initial full image is included.
+  void channel_statistics (const channel_statistics_t& statistics) {
+    m_channel = statistics;
+  }
+
+  void update_done () {
+    const uint64_t now = monotonic_ns ();
+    if (!m_started) {
+      m_started = true;
+      m_start_ns = now;
+      m_start_allocations = allocations;
+      return;
+    }
+    ++m_updates;
+    m_last_ns = now;
+    for (std::deque<uint64_t>::const_iterator pos = m_pending.begin ();
+	 pos != m_pending.end ();
+	 ++pos) {
+      m_latencies.push_back (now - *pos);
+    }
+    m_pending.clear ();
+  }
+
+  void report (std::ostream& out,
+	       const bench_options_t& options) const {
+    // A replay may finish early.
+    const uint64_t end_ns = options.replay.empty () ? monotonic_ns () : m_last_ns;
+    const double seconds = m_started && end_ns > m_start_ns ? (end_ns - m_start_ns) / 1000000000.0 : 0;
+    const size_t frames = m_latencies.size ();
+    std::vector<uint64_t> sorted (m_latencies);
+    std::sort (sorted.begin (), sorted.end ());
+
+    out << "{\"workload\":\"" << options.workload << "\""
+	<< ",\"replay\":\"" << options.replay << "\""
+	<< ",\"encodings\":\"" << options.encoding_names << "\""
+	<< ",\"width\":" << options.width
+	<< ",\"height\":" << options.height
+	<< ",\"frame_limit\":" << options.frames_per_second
+	<< ",\"request_window\":" << options.request_window
+	<< ",\"delay_ms\":" << options.shape.delay_ns / 1000000.0
+	<< ",\"jitter_ms\":" << options.shape.jitter_ns / 1000000.0
+	<< ",\"link_megabits_per_second\":" << options.shape.bytes_per_second * 8 / 1000000.0
+	<< ",\"mtu\":" << options.shape.mtu
+	<< ",\"batch\":" << options.batch
+	<< ",\"queue_items\":" << options.queue_items
+	<< ",\"queue_bytes\":" << (options.queue_items != 0 ? options.queue_bytes : 0)
+	<< ",\"seconds\":" << seconds
+	<< ",\"frames\":" << frames
+	<< ",\"updates\":" << m_updates
+	<< ",\"bytes\":" << m_bytes
+	<< ",\"receives\":" << m_receives
+	<< ",\"queue_high_water_items\":" << m_channel.max_items
+	<< ",\"queue_high_water_bytes\":" << m_channel.max_bytes
+	<< ",\"queue_overruns\":" << m_channel.overruns
+	<< ",\"frames_per_second\":" << (seconds != 0 ? frames / seconds : 0)
+	<< ",\"updates_per_second\":" << (seconds != 0 ? m_updates / seconds : 0)
+	<< ",\"megabytes_per_second\":" << (seconds != 0 ? m_bytes / seconds / 1000000 : 0)
+	<< ",\"latency_ms\":{\"p50\":" << percentile (sorted, 0.50)
+	<< ",\"p90\":" << percentile (sorted, 0.90)
+	<< ",\"p99\":" << percentile (sorted, 0.99)
+	<< ",\"max\":" << percentile (sorted, 1)
+	<< "},\"allocations_per_frame\":" << (frames != 0 ? double (allocations - m_start_allocations) / frames : 0)
+	<< ",\"allocations_per_update\":" << (m_updates != 0 ? double (allocations - m_start_allocations) / m_updates : 0)
+	<< "}" << std::endl;
+  }
+};
+
+static bench_record record;
+
+// Tells the record when the workload draws something.
+class timed_frame_source :
+  public rfb::frame_source
+{
+private:
+  rfb::frame_source* m_source;
+
+public:
+  // Takes ownership of source.
+  timed_frame_source (rfb::frame_source* source) :
+    m_source (source)
+  { }
+
+  ~timed_frame_source () {
+    delete m_source;
+  }
+
+  void produce (uint32_t* pixels,
+		const uint16_t width,
+		const uint16_t height,
+		rfb::damage_region& damage) {
+    m_source->produce (pixels, width, height, damage);
+    if (!damage.empty ()) {
+      record.frame_drawn ();
+    }
+  }
+};
+
+// A client that decodes into memory and reports to the record.
+class bench_client_automaton :
+  public ioa::automaton,
+  private rfb_client::presenter
+{
+private:
+  rfb_client m_client;
+
+  void update_done () {
+    record.update_done ();
+  }
+
+public:
+  bench_client_automaton (const std::vector<int32_t>& encodings,
+			  const size_t request_window) :
+    m_client (*this, request_window)
+  {
+    m_client.set_encodings (encodings);
+    schedule ();
+  }
+
+private:
+  void schedule () const {
+    if (send_precondition ()) {
+      ioa::schedule (&bench_client_automaton::send);
+    }
+  }
+
+  bool send_precondition () const {
+    return m_client.has_message () && ioa::binding_count (&bench_client_automaton::send) != 0;
+  }
+
+  ioa::const_shared_ptr<ioa::buffer_interface> send_effect () {
+    return m_client.next_message ();
+  }
+
+public:
+  V_UP_OUTPUT (bench_client_automaton, send, ioa::const_shared_ptr<ioa::buffer_interface>);
+
+private:
+  void receive_effect (const ioa::const_shared_ptr<ioa::buffer_interface>& val) {
+    if (val.get () != 0) {
+      record.received (val->size ());
+      record.receive_done ();
+      m_client.receive (*val.get ());
+    }
+  }
+
+public:
+  V_UP_INPUT (bench_client_automaton, receive, ioa::const_shared_ptr<ioa::buffer_interface>);
+
+private:
+  void receive_batch_effect (const ioa::const_shared_ptr<rgram::buffer_chain>& val) {
+    if (val.get () != 0) {
+      for (rgram::buffer_chain::const_iterator pos = val->begin ();
+	   pos != val->end ();
+	   ++pos) {
+	record.received (channel_item_bytes (*pos));
+      }
+      record.receive_done ();
+      m_client.receive (*val.get ());
+    }
+  }
+
+public:
+  V_UP_INPUT (bench_client_automaton, receive_batch, ioa::const_shared_ptr<rgram::buffer_chain>);
+
+private:
+  void channel_statistics_effect (const channel_statistics_t& val) {
+    record.channel_statistics (val);
+  }
+
+public:
+  // The statistics of the channel to the client.  Only here because the bench cannot bind to itself.
+  V_UP_INPUT (bench_client_automaton, channel_statistics, channel_statistics_t);
+};
+
+class rfb_bench_automaton :
+  public ioa::automaton
+{
+private:
+  typedef ioa::const_shared_ptr<ioa::buffer_interface> message_type;
+
+  const bench_options_t m_options;
+
+  // Bounded channels give credit to the server and statistics to the record.  Other channels have nothing to bind.
+  template <class Channel>
+  void bind_flow_control (ioa::automaton_manager<Channel>*,
+			  ioa::automaton_manager<rfb_server_automaton>*,
+			  ioa::automaton_manager<bench_client_automaton>*) { }
+
+  void bind_flow_control (ioa::automaton_manager<bounded_channel_automaton<message_type> >* server_to_client,
+			  ioa::automaton_manager<rfb_server_automaton>* server,
+			  ioa::automaton_manager<bench_client_automaton>* client) {
+    if (server != 0) {
+      ioa::make_binding_manager (this,
+				 server_to_client, &bounded_channel_automaton<message_type>::credit,
+				 server, &rfb_server_automaton::credit, 0);
+    }
+    ioa::make_binding_manager (this,
+			       server_to_client, &bounded_channel_automaton<message_type>::statistics,
+			       client, &bench_client_automaton::channel_statistics);
+  }
+
+  // Wire everything together with channels made by channel_generator.
+  // The receive arguments are the inputs that take what a Channel delivers.
+  template <class Channel, class Generator, class ClientReceive, class ServerReceive, class ReplayReceive>
+  void compose (const Generator& channel_generator,
+		ClientReceive client_receive,
+		ServerReceive server_receive,
+		ReplayReceive replay_receive) {
+    ioa::automaton_manager<bench_client_automaton>* client = new ioa::automaton_manager<bench_client_automaton> (this, ioa::make_generator<bench_client_automaton> (m_options.encodings, m_options.request_window));
+
+    ioa::automaton_manager<Channel>* server_to_client = new ioa::automaton_manager<Channel> (this, channel_generator);
+    ioa::automaton_manager<Channel>* client_to_server = new ioa::automaton_manager<Channel> (this, channel_generator);
+
+    ioa::automaton_manager<rfb_server_automaton>* server = 0;
+    ioa::automaton_manager<recorder_automaton>* recorder = 0;
+    if (!m_options.record.empty ()) {
+      recorder = new ioa::automaton_manager<recorder_automaton> (this, ioa::make_generator<recorder_automaton> (m_options.record));
+      ioa::make_binding_manager (this,
+				 client, &bench_client_automaton::send,
+				 recorder, &recorder_automaton::client_to_server);
+    }
+
+    if (m_options.replay.empty ()) {
+      server = new ioa::automaton_manager<rfb_server_automaton> (this, ioa::make_generator<rfb_server_automaton> (size_t (1), m_options.frames_per_second, static_cast<rfb::frame_source*> (new timed_frame_source (rfb::make_frame_source (m_options.workload))), m_options.width, m_options.height));
+
+      ioa::make_binding_manager (this,
+				 server, &rfb_server_automaton::send, 0,
+				 server_to_client, &Channel::send);
+
+      ioa::make_binding_manager (this,
+				 client_to_server, &Channel::receive,
+				 server, server_receive, 0);
+
+      if (recorder != 0) {
+	ioa::make_binding_manager (this,
+				   server, &rfb_server_automaton::send, 0,
+				   recorder, &recorder_automaton::server_to_client);
+      }
+    }
+    else {
+      ioa::automaton_manager<replay_automaton>* replay = new ioa::automaton_manager<replay_automaton> (this, ioa::make_generator<replay_automaton> (m_options.replay, rfb::SERVER_TO_CLIENT, m_options.original_timing));
+
+      ioa::make_binding_manager (this,
+				 replay, &replay_automaton::send,
+				 server_to_client, &Channel::send);
+
+      ioa::make_binding_manager (this,
+				 client_to_server, &Channel::receive,
+				 replay, replay_receive);
+
+      if (recorder != 0) {
+	ioa::make_binding_manager (this,
+				   replay, &replay_automaton::send,
+				   recorder, &recorder_automaton::server_to_client);
+      }
+    }
+
+    ioa::make_binding_manager (this,
+			       server_to_client, &Channel::receive,
+			       client, client_receive);
+
+    ioa::make_binding_manager (this,
+			       client, &bench_client_automaton::send,
+			       client_to_server, &Channel::send);
+
+    bind_flow_control (server_to_client, server, client);
+  }
+
+public:
+  rfb_bench_automaton (const bench_options_t& options) :
+    m_options (options)
+  {
+    if (m_options.shaped) {
+      compose<shaped_channel_automaton> (ioa::make_generator<shaped_channel_automaton> (m_options.shape),
+					 &bench_client_automaton::receive, &rfb_server_automaton::receive, &replay_automaton::receive);
+    }
+    else if (m_options.batch != 0) {
+      compose<batched_channel_automaton<message_type> > (ioa::make_generator<batched_channel_automaton<message_type> > (m_options.batch, size_t (0)),
+							 &bench_client_automaton::receive_batch, &rfb_server_automaton::receive_batch, &replay_automaton::receive_batch);
+    }
+    else if (m_options.queue_items != 0) {
+      compose<bounded_channel_automaton<message_type> > (ioa::make_generator<bounded_channel_automaton<message_type> > (m_options.queue_items, m_options.queue_bytes),
+							 &bench_client_automaton::receive, &rfb_server_automaton::receive, &replay_automaton::receive);
+    }
+    else {
+      compose<channel_automaton<message_type> > (ioa::make_generator<channel_automaton<message_type> > (),
+						 &bench_client_automaton::receive, &rfb_server_automaton::receive, &replay_automaton::receive);
+    }
+
+    ioa::schedule_after (&rfb_bench_automaton::finish, ioa::time (m_options.seconds, 0));
+  }
+
+private:
+  void schedule () const { }
+
+  bool finish_precondition () const {
+    return true;
+  }
+
+  // The scheduler runs until there is nothing left to do and the server never runs out so stop the process.
+  void finish_effect () {
+    std::cout.rdbuf (record.output);
+    record.report (std::cout, m_options);
+    exit (EXIT_SUCCESS);
+  }
+
+  UP_INTERNAL (rfb_bench_automaton, finish);
+};
+
+static void usage (const char* name) {
+  std::cerr << "Usage: " << name << " [-w WORKLOAD] [-e ENCODING,...] [-s WIDTHxHEIGHT] [-r FRAMES_PER_SECOND] [-n REQUESTS] [-t SECONDS] [-d MS] [-j MS] [-b MBITS] [-m MTU] [-B BUFFERS] [-q BUFFERS[,BYTES]] [-o RECORDING] [-i RECORDING [-T]]" << std::endl;
+  std::cerr << "  -w  workload (terminal):";
+  const std::vector<std::string> names = rfb::frame_source_names ();
+  for (std::vector<std::string>::const_iterator pos = names.begin ();
+       pos != names.end ();
+       ++pos) {
+    std::cerr << " " << *pos;
+  }
+  std::cerr << std::endl;
+  std::cerr << "  -e  encodings in order of preference (" << DEFAULT_ENCODINGS << "):";
+  for (size_t i = 0; i != sizeof (ENCODING_NAMES) / sizeof (ENCODING_NAMES[0]); ++i) {
+    std::cerr << " " << ENCODING_NAMES[i].name;
+  }
+  std::cerr << std::endl;
+  std::cerr << "  -s  resolution (1280x720)" << std::endl;
+  std::cerr << "  -r  frame rate limit, 0 for none (0)" << std::endl;
+  std::cerr << "  -n  update requests kept outstanding (1)" << std::endl;
+  std::cerr << "  -t  duration in seconds (10)" << std::endl;
+  std::cerr << "  -d  one-way delay in milliseconds (0)" << std::endl;
+  std::cerr << "  -j  jitter in milliseconds (0)" << std::endl;
+  std::cerr << "  -b  bandwidth in megabits per second, 0 for none (0)" << std::endl;
+  std::cerr << "  -m  segment size in bytes, 0 for none (0)" << std::endl;
+  std::cerr << "  -B  deliver up to this many queued buffers per receive, not with -d -j -b -m (1)" << std::endl;
+  std::cerr << "  -q  bound the channels to this many buffers and bytes (1048576) with credit to the server, not with -d -j -b -m -B" << std::endl;
+  std::cerr << "  -o  record the session" << std::endl;
+  std::cerr << "  -i  replay the server's side of a recording instead of running a server" << std::endl;
+  std::cerr << "  -T  replay at the recorded times instead of as fast as possible" << std::endl;
+  exit (EXIT_FAILURE);
+}
+
+// Parse a comma-separated list of encoding names.  False if a name is unknown.
+static bool parse_encodings (const std::string& names,
+			     std::vector<int32_t>& encodings) {
+  encodings.clear ();
+  std::istringstream in (names);
+  std::string name;
+  while (std::getline (in, name, ',')) {
+    size_t i = 0;
+    while (i != sizeof (ENCODING_NAMES) / sizeof (ENCODING_NAMES[0]) && name != ENCODING_NAMES[i].name) {
+      ++i;
+    }
+    if (i == sizeof (ENCODING_NAMES) / sizeof (ENCODING_NAMES[0])) {
+      return false;
+    }
+    encodings.push_back (ENCODING_NAMES[i].encoding);
+  }
+  return !encodings.empty ();
+}
+
+int main (int argc, char* argv[]) {
+  bench_options_t options;
+  options.encoding_names = DEFAULT_ENCODINGS;
+
+  int c;
+  while ((c = getopt (argc, argv, "w:e:s:r:n:t:d:j:b:m:B:q:o:i:T")) != -1) {
+    switch (c) {
+    case 'w':
+      options.workload = optarg;
+      break;
+    case 'e':
+      options.encoding_names = optarg;
+      break;
+    case 's':
+      {
+	unsigned int width;
+	unsigned int height;
+	if (sscanf (optarg, "%ux%u", &width, &height) != 2 || width == 0 || height == 0 || width > 0xFFFF || height > 0xFFFF) {
+	  usage (argv[0]);
+	}
+	options.width = width;
+	options.height = height;
+      }
+      break;
+    case 'r':
+      options.frames_per_second = strtoul (optarg, 0, 10);
+      break;
+    case 'n':
+      options.request_window = std::max (strtoul (optarg, 0, 10), 1UL);
+      break;
+    case 't':
+      options.seconds = strtoul (optarg, 0, 10);
+      break;
+    case 'd':
+      options.shape.delay_ns = uint64_t (strtod (optarg, 0) * 1000000);
+      options.shaped = true;
+      break;
+    case 'j':
+      options.shape.jitter_ns = uint64_t (strtod (optarg, 0) * 1000000);
+      options.shaped = true;
+      break;
+    case 'b':
+      options.shape.bytes_per_second = uint64_t (strtod (optarg, 0) * 1000000 / 8);
+      options.shaped = true;
+      break;
+    case 'm':
+      options.shape.mtu = strtoul (optarg, 0, 10);
+      options.shaped = true;
+      break;
+    case 'B':
+      {
+	// One at a time is the plain channel.
+	const size_t batch = strtoul (optarg, 0, 10);
+	options.batch = batch > 1 ? batch : 0;
+      }
+      break;
+    case 'q':
+      {
+	unsigned int items;
+	unsigned int bytes;
+	const int n = sscanf (optarg, "%u,%u", &items, &bytes);
+	if (n < 1 || items == 0 || (n == 2 && bytes == 0)) {
+	  usage (argv[0]);
+	}
+	options.queue_items = items;
+	if (n == 2) {
+	  options.queue_bytes = bytes;
+	}
+      }
+      break;
+    case 'o':
+      options.record = optarg;
+      break;
+    case 'i':
+      options.replay = optarg;
+      break;
+    case 'T':
+      options.original_timing = true;
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+
+  if (optind != argc || !parse_encodings (options.encoding_names, options.encodings) || int (options.shaped) + int (options.batch != 0) + int (options.queue_items != 0) > 1) {
+    usage (argv[0]);
+  }
+  rfb::frame_source* source = rfb::make_frame_source (options.workload);
+  if (source == 0) {
+    usage (argv[0]);
+  }
+  delete source;
+
+  // The server and client log every message.
+  record.output = std::cout.rdbuf (0);
+
+  ioa::global_fifo_scheduler sched;
+  ioa::run (sched, ioa::make_generator<rfb_bench_automaton> (options));
+  return 0;
+}
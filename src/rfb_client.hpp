@@ -0,0 +1,1040 @@
+#ifndef __rfb_client_hpp__
+#define __rfb_client_hpp__
+
+#include <substrate/rgram.hpp>
+#include "rfb.hpp"
+#include "zrle.hpp"
+#include "content_cache.hpp"
+#include "page_buffer.hpp"
+
+#include <ioa/buffer.hpp>
+#include <ioa/shared_ptr.hpp>
+#include <ioa/time.hpp>
+
+#include <iostream>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+/*
+  The protocol side of an RFB client.
+
+  rfb_client parses messages from the server, decodes rectangles into its framebuffer, and queues the messages it sends.
+  It does no I/O.  An automaton passes it what it receives and sends what it queues.
+  What happens to the pixels is up to a presenter, which is told about every rectangle that changes and the end of every update.
+  The presenter may also supply the framebuffer's memory, for example memory shared with a display server.
+*/
+
+class rfb_client
+{
+public:
+  // Presents the framebuffer.  This one does nothing.
+  class presenter
+  {
+  public:
+    virtual ~presenter () { }
+
+    // The framebuffer is about to be replaced.  Return memory for width * height pixels in rows of width pixels or 0 to let the client allocate it.
+    // Memory returned by an earlier call is no longer used.
+    virtual uint32_t* allocate (const uint16_t width,
+				const uint16_t height) {
+      return 0;
+    }
+
+    // The framebuffer has been replaced.  data is 0 if the framebuffer is empty.
+    virtual void resized (const uint16_t width,
+			  const uint16_t height,
+			  uint32_t* data) { }
+
+    // Pixels in the rectangle have changed.
+    virtual void region_updated (const uint16_t x,
+				 const uint16_t y,
+				 const uint16_t width,
+				 const uint16_t height) { }
+
+    // A FramebufferUpdate has been decoded.
+    virtual void update_done () { }
+
+    // The server sent the cursor.  The image is in the client's pixel format and the mask has one bit per pixel, most significant bit first.
+    virtual void cursor_changed (const uint16_t hotspot_x,
+				 const uint16_t hotspot_y,
+				 const uint16_t width,
+				 const uint16_t height,
+				 const uint8_t* image,
+				 const uint8_t* mask) { }
+  };
+
+private:
+  struct recv_protocol_version_gramel :
+    public rgram::gramel
+  {
+    rfb_client& m_client;
+    rfb::protocol_version_gramel m_protocol_version;
+
+    recv_protocol_version_gramel (rfb_client& client) :
+      m_client (client)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_protocol_version.put (buf);
+      if (done ()) {
+	m_client.recv_protocol_version (m_protocol_version.get ());
+      }
+    }
+
+    bool done () const {
+      return m_protocol_version.done ();
+    }
+
+    void reset () {
+      m_protocol_version.reset ();
+    }
+  };
+
+  struct recv_security_type_gramel :
+    public rgram::gramel
+  {
+    rfb_client& m_client;
+    rfb::security_type_gramel m_security_type;
+
+    recv_security_type_gramel (rfb_client& client) :
+      m_client (client)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_security_type.put (buf);
+      if (done ()) {
+	m_client.recv_security_type (m_security_type.get ());
+      }
+    }
+
+    bool done () const {
+      return m_security_type.done ();
+    }
+
+    void reset () {
+      m_security_type.reset ();
+    }
+  };
+
+  struct recv_server_init_gramel :
+    public rgram::gramel
+  {
+    rfb_client& m_client;
+    rfb::server_init_gramel m_init;
+
+    recv_server_init_gramel (rfb_client& client) :
+      m_client (client)
+    {
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_init.put (buf);
+      if (done ()) {
+	m_client.recv_server_init (m_init.get ());
+      }
+    }
+
+    bool done () const {
+      return m_init.done ();
+    }
+
+    void reset () {
+      m_init.reset ();
+    }
+  };
+
+  struct recv_server_message_gramel :
+    public rgram::gramel
+  {
+    rfb_client& m_client;
+    rfb::server_message_gramel m_message;
+
+    recv_server_message_gramel (rfb_client& client) :
+      m_client (client)
+    {
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_message.put (buf);
+      if (done ()) {
+	switch (m_message.m_choice.get ()) {
+	case rfb::FRAMEBUFFER_UPDATE_TYPE:
+	  m_client.recv_framebuffer_update ();
+	  break;
+	case rfb::END_OF_CONTINUOUS_UPDATES_TYPE:
+	  m_client.recv_end_of_continuous_updates ();
+	  break;
+	case rfb::FENCE_TYPE:
+	  m_client.recv_fence (m_message.m_fence.get ());
+	  break;
+	default:
+	  std::cerr << "Unknown server message.  Type = " << int (m_message.m_choice.get ()) << std::endl;
+	  abort ();
+	}
+	// Reset to start over.
+	m_message.reset ();
+      }
+    }
+
+    bool done () const {
+      return m_message.done ();
+    }
+
+    void reset () {
+      m_message.reset ();
+    }
+
+    void add_encoding (const int32_t type,
+		       rfb::pixel_data_gramel* gramel) {
+      m_message.add_encoding (type, gramel);
+    }
+  };
+
+  struct protocol_gramel :
+    public rgram::gramel
+  {
+    recv_protocol_version_gramel m_recv_protocol;
+    recv_security_type_gramel m_recv_security;
+    recv_server_init_gramel m_recv_init;
+    recv_server_message_gramel m_recv_server;
+    rgram::sequence_gramel m_sequence;
+
+    protocol_gramel (rfb_client& client) :
+      m_recv_protocol (client),
+      m_recv_security (client),
+      m_recv_init (client),
+      m_recv_server (client)
+    {
+      m_sequence.append (&m_recv_protocol);
+      m_sequence.append (&m_recv_security);
+      m_sequence.append (&m_recv_init);
+      m_sequence.append (&m_recv_server);
+    }
+    
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_sequence.put (buf);
+    }
+
+    bool done () const {
+      return m_sequence.done ();
+    }
+
+    void reset () {
+      m_sequence.reset ();
+    }
+
+    void add_encoding (const int32_t type,
+		       rfb::pixel_data_gramel* gramel) {
+      m_recv_server.add_encoding (type, gramel);
+    }
+  };
+
+  class pixel_gramel :
+    public rgram::gramel
+  {
+  private:
+    uint32_t m_uint;
+    uint8_t m_count;
+
+  public:
+    typedef uint32_t value_type;
+
+    pixel_gramel () :
+      m_count (0)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_count += buf.consume (reinterpret_cast<unsigned char*> (&m_uint) + m_count, sizeof (m_uint) - m_count);
+    }
+
+    bool done () const {
+      return m_count == sizeof (m_uint);
+    }
+
+    uint32_t get () const {
+      return m_uint;
+    }
+
+    void reset () {
+      m_count = 0;
+    }
+  };
+
+  struct raw_pixel_data_gramel :
+    public rfb::pixel_data_gramel
+  {
+    rfb_client& m_client;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+    uint16_t x_off;
+    uint16_t y_off;
+    pixel_gramel pixel;
+    // The rectangle is not in the framebuffer.
+    bool m_discard;
+    bool dimensions_set;
+
+    raw_pixel_data_gramel (rfb_client& client) :
+      m_client (client),
+      x_off (0),
+      y_off (0),
+      m_discard (false),
+      dimensions_set (false)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+
+      while (!done () && !buf.empty ()) {
+	pixel.put (buf);
+	if (pixel.done ()) {
+	  if (!m_discard) {
+	    m_client.m_data[(y_position + y_off) * m_client.m_width + (x_position + x_off)] = pixel.get ();
+	  }
+	  ++x_off;
+	  if (x_off == width) {
+	    x_off = 0;
+	    ++y_off;
+	  }
+	  pixel.reset ();
+	}
+      }
+
+      if (done ()) {
+	if (m_discard) {
+	  std::cerr << "RAW rectangle out of bounds" << std::endl;
+	}
+	else {
+	  m_client.decoded (x_position, y_position, width, height);
+	}
+      }
+    }
+
+    bool done () const {
+      return dimensions_set && y_off == height;
+    }
+
+    void reset () {
+      x_off = 0;
+      y_off = 0;
+      pixel.reset ();
+      dimensions_set = false;
+    }
+
+    void set_dimensions (const uint16_t xpos,
+			 const uint16_t ypos,
+			 const uint16_t w,
+			 const uint16_t h) {
+      x_position = xpos;
+      y_position = ypos;
+      width = w;
+      height = h;
+      // The pixels are still read so the next message is found.
+      m_discard = !m_client.contains (xpos, ypos, w, h);
+      dimensions_set = true;
+    }
+  };
+
+  struct zrle_pixel_data_gramel :
+    public rfb::pixel_data_gramel
+  {
+    rfb_client& m_client;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+    rgram::uint32_gramel m_length;
+    uint32_t m_remaining;
+    // The zlib stream persists across rectangles.
+    rfb::zrle_decoder m_decoder;
+    // The rectangle is not in the framebuffer.
+    bool m_discard;
+    bool dimensions_set;
+
+    zrle_pixel_data_gramel (rfb_client& client) :
+      m_client (client),
+      m_remaining (0),
+      m_discard (false),
+      dimensions_set (false)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+
+      if (!m_length.done ()) {
+	m_length.put (buf);
+	if (m_length.done ()) {
+	  m_remaining = m_length.get ();
+	}
+      }
+
+      // Inflate the zlib data in place one buffer of a chain at a time.
+      while (m_length.done () && m_remaining != 0 && !buf.empty ()) {
+	const size_t size = std::min (size_t (m_remaining), buf.size ());
+	m_decoder.put (buf.data (), size);
+	buf.skip (size);
+	m_remaining -= size;
+	if (m_remaining == 0 && !m_decoder.done ()) {
+	  // The zlib stream cannot be resynchronized.
+	  std::cerr << "ZRLE data ends before the rectangle" << std::endl;
+	  abort ();
+	}
+      }
+
+      if (done ()) {
+	if (m_discard) {
+	  std::cerr << "ZRLE rectangle out of bounds" << std::endl;
+	}
+	else {
+	  m_client.decoded (x_position, y_position, width, height);
+	}
+      }
+    }
+
+    bool done () const {
+      return dimensions_set && m_length.done () && m_remaining == 0;
+    }
+
+    void reset () {
+      m_length.reset ();
+      m_remaining = 0;
+      dimensions_set = false;
+    }
+
+    void set_dimensions (const uint16_t xpos,
+			 const uint16_t ypos,
+			 const uint16_t w,
+			 const uint16_t h) {
+      x_position = xpos;
+      y_position = ypos;
+      width = w;
+      height = h;
+      m_discard = !m_client.contains (xpos, ypos, w, h);
+      if (m_discard) {
+	// Still inflate it since the zlib stream continues into the next rectangle.
+	m_decoder.set_rectangle (0, 0, w, h, m_client.m_pixel_format);
+      }
+      else {
+	m_decoder.set_rectangle (&m_client.m_data[ypos * m_client.m_width + xpos], m_client.m_width, w, h, m_client.m_pixel_format);
+      }
+      dimensions_set = true;
+    }
+  };
+
+  struct copy_rect_pixel_data_gramel :
+    public rfb::pixel_data_gramel
+  {
+    rfb_client& m_client;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+    rgram::uint16_gramel m_src_x_position;
+    rgram::uint16_gramel m_src_y_position;
+    rgram::sequence_gramel m_sequence;
+    bool dimensions_set;
+
+    copy_rect_pixel_data_gramel (rfb_client& client) :
+      m_client (client),
+      dimensions_set (false)
+    {
+      m_sequence.append (&m_src_x_position);
+      m_sequence.append (&m_src_y_position);
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_sequence.put (buf);
+      if (m_sequence.done ()) {
+	m_client.copy_rect (m_src_x_position.get (), m_src_y_position.get (), x_position, y_position, width, height);
+      }
+    }
+
+    bool done () const {
+      return dimensions_set && m_sequence.done ();
+    }
+
+    void reset () {
+      m_sequence.reset ();
+      dimensions_set = false;
+    }
+
+    void set_dimensions (const uint16_t xpos,
+			 const uint16_t ypos,
+			 const uint16_t w,
+			 const uint16_t h) {
+      x_position = xpos;
+      y_position = ypos;
+      width = w;
+      height = h;
+      dimensions_set = true;
+    }
+  };
+
+  struct cached_tile_pixel_data_gramel :
+    public rfb::pixel_data_gramel
+  {
+    rfb_client& m_client;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+    rgram::uint32_gramel m_slot;
+    bool dimensions_set;
+
+    cached_tile_pixel_data_gramel (rfb_client& client) :
+      m_client (client),
+      dimensions_set (false)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_slot.put (buf);
+      if (m_slot.done ()) {
+	m_client.paint_cached_tile (m_slot.get (), x_position, y_position, width, height);
+      }
+    }
+
+    bool done () const {
+      return dimensions_set && m_slot.done ();
+    }
+
+    void reset () {
+      m_slot.reset ();
+      dimensions_set = false;
+    }
+
+    void set_dimensions (const uint16_t xpos,
+			 const uint16_t ypos,
+			 const uint16_t w,
+			 const uint16_t h) {
+      x_position = xpos;
+      y_position = ypos;
+      width = w;
+      height = h;
+      dimensions_set = true;
+    }
+  };
+
+  struct cursor_pixel_data_gramel :
+    public rfb::pixel_data_gramel
+  {
+    rfb_client& m_client;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+    // The image followed by the mask.
+    std::vector<uint8_t> m_data;
+    size_t m_count;
+    bool dimensions_set;
+    bool m_applied;
+
+    cursor_pixel_data_gramel (rfb_client& client) :
+      m_client (client),
+      m_count (0),
+      dimensions_set (false),
+      m_applied (false)
+    { }
+
+    size_t size () const {
+      return width * height * (m_client.m_pixel_format.bits_per_pixel / 8) + ((width + 7) / 8) * height;
+    }
+
+    void put (rgram::buffer& buf) {
+      // An empty cursor is done before it is put.
+      if (!done ()) {
+	m_data.resize (size ());
+	m_count += buf.consume (&m_data[m_count], m_data.size () - m_count);
+      }
+      if (done () && !m_applied) {
+	const size_t image_bytes = m_data.size () - ((width + 7) / 8) * height;
+	m_client.set_cursor (x_position, y_position, width, height, m_data.empty () ? 0 : &m_data[0], m_data.empty () ? 0 : &m_data[image_bytes]);
+	m_applied = true;
+      }
+    }
+
+    bool done () const {
+      return dimensions_set && m_count == size ();
+    }
+
+    void reset () {
+      m_data.clear ();
+      m_count = 0;
+      dimensions_set = false;
+      m_applied = false;
+    }
+
+    void set_dimensions (const uint16_t xpos,
+			 const uint16_t ypos,
+			 const uint16_t w,
+			 const uint16_t h) {
+      x_position = xpos;
+      y_position = ypos;
+      width = w;
+      height = h;
+      dimensions_set = true;
+    }
+  };
+
+  // A resize.  There is no pixel data.
+  struct desktop_size_pixel_data_gramel :
+    public rfb::pixel_data_gramel
+  {
+    rfb_client& m_client;
+    uint16_t width;
+    uint16_t height;
+    bool dimensions_set;
+    bool m_applied;
+
+    desktop_size_pixel_data_gramel (rfb_client& client) :
+      m_client (client),
+      dimensions_set (false),
+      m_applied (false)
+    { }
+
+    void put (rgram::buffer& buf) {
+      // Done before it is put.
+      if (!m_applied) {
+	m_client.recv_desktop_size (width, height);
+	m_applied = true;
+      }
+    }
+
+    bool done () const {
+      return dimensions_set;
+    }
+
+    void reset () {
+      dimensions_set = false;
+      m_applied = false;
+    }
+
+    void set_dimensions (const uint16_t xpos,
+			 const uint16_t ypos,
+			 const uint16_t w,
+			 const uint16_t h) {
+      width = w;
+      height = h;
+      dimensions_set = true;
+    }
+  };
+
+
+  presenter& m_presenter;
+  raw_pixel_data_gramel m_raw_pixel_data;
+  copy_rect_pixel_data_gramel m_copy_rect_pixel_data;
+  zrle_pixel_data_gramel m_zrle_pixel_data;
+  cached_tile_pixel_data_gramel m_cached_tile_pixel_data;
+  cursor_pixel_data_gramel m_cursor_pixel_data;
+  desktop_size_pixel_data_gramel m_desktop_size_pixel_data;
+  protocol_gramel m_protocol;
+  std::queue<ioa::const_shared_ptr<ioa::buffer_interface> > m_sendq;
+  // Input events.  Sent ahead of everything in m_sendq so they do not wait behind bulk messages.
+  std::queue<ioa::const_shared_ptr<ioa::buffer_interface> > m_input_sendq;
+  const rfb::protocol_version_t HIGHEST_VERSION;
+  rfb::protocol_version_t m_protocol_version;
+  rfb::pixel_format_t m_pixel_format;
+  std::vector<int32_t> m_encodings;
+  bool m_incremental;
+  // Number of requests to keep outstanding so the server always has one.
+  const size_t m_request_window;
+  size_t m_outstanding_requests;
+  // Whether the server has said it supports continuous updates.
+  bool m_continuous_supported;
+  // Whether the server is pushing updates without requests.
+  bool m_continuous;
+  // The size of the server's framebuffer and ours.
+  uint16_t m_width;
+  uint16_t m_height;
+  // Try to put the framebuffer in huge pages.
+  const bool m_huge_pages;
+  // Used unless the presenter supplies the memory.
+  page_buffer m_framebuffer;
+  uint32_t* m_data;
+  // Kept in step with the server's index of what we hold.
+  rfb::content_cache_store m_content_cache;
+  // Whether we offered CACHED_TILE.  The server only keeps an index if we did.
+  bool m_cached_tiles;
+  size_t m_update_count;
+
+public:
+  rfb_client (presenter& p,
+	      const size_t request_window = 1,
+	      const bool huge_pages = false) :
+    m_presenter (p),
+    m_raw_pixel_data (*this),
+    m_copy_rect_pixel_data (*this),
+    m_zrle_pixel_data (*this),
+    m_cached_tile_pixel_data (*this),
+    m_cursor_pixel_data (*this),
+    m_desktop_size_pixel_data (*this),
+    m_protocol (*this),
+    HIGHEST_VERSION (rfb::PROTOCOL_VERSION_3_3),
+    m_pixel_format (default_pixel_format ()),
+    m_incremental (false), // Request entire screen first time.
+    m_request_window (std::max (request_window, size_t (1))),
+    m_outstanding_requests (0),
+    m_continuous_supported (false),
+    m_continuous (false),
+    m_width (0),
+    m_height (0),
+    m_huge_pages (huge_pages),
+    m_data (0),
+    m_cached_tiles (false),
+    m_update_count (0)
+  {
+    m_protocol.add_encoding (rfb::RAW, &m_raw_pixel_data);
+    m_protocol.add_encoding (rfb::COPY_RECT, &m_copy_rect_pixel_data);
+    m_protocol.add_encoding (rfb::ZRLE, &m_zrle_pixel_data);
+    m_protocol.add_encoding (rfb::CACHED_TILE, &m_cached_tile_pixel_data);
+    m_protocol.add_encoding (rfb::CURSOR, &m_cursor_pixel_data);
+    m_protocol.add_encoding (rfb::DESKTOP_SIZE, &m_desktop_size_pixel_data);
+    // Pseudo-encodings.
+    m_encodings.push_back (rfb::DESKTOP_SIZE);
+    m_encodings.push_back (rfb::CURSOR);
+    m_encodings.push_back (rfb::CONTINUOUS_UPDATES);
+    m_encodings.push_back (rfb::FENCE);
+    // In order of preference.
+    m_encodings.push_back (rfb::CACHED_TILE);
+    m_encodings.push_back (rfb::COPY_RECT);
+    m_encodings.push_back (rfb::ZRLE);
+    // m_encodings.push_back (rfb::RRE);
+    // m_encodings.push_back (rfb::HEXTILE);
+    m_encodings.push_back (rfb::RAW);
+  }
+
+  // 32-bit pixels in host byte order with red, green, and blue in the low 24 bits.
+  static rfb::pixel_format_t default_pixel_format () {
+    return rfb::pixel_format_t (32, 24, htonl (1) == 1, true, 255, 255, 255, 16, 8, 0);
+  }
+
+  // The pixel format to ask the server for.  Must be 32 bits per pixel and set before ServerInit arrives.
+  void set_pixel_format (const rfb::pixel_format_t& format) {
+    assert (format.bits_per_pixel == 32);
+    m_pixel_format = format;
+  }
+
+  const rfb::pixel_format_t& pixel_format () const {
+    return m_pixel_format;
+  }
+
+  // The encodings and pseudo-encodings to offer, in order of preference.  Must be set before ServerInit arrives.
+  void set_encodings (const std::vector<int32_t>& encodings) {
+    m_encodings = encodings;
+  }
+
+  const std::vector<int32_t>& encodings () const {
+    return m_encodings;
+  }
+
+  uint16_t width () const {
+    return m_width;
+  }
+
+  uint16_t height () const {
+    return m_height;
+  }
+
+  // Rows of width () pixels.
+  const uint32_t* data () const {
+    return m_data;
+  }
+
+  size_t update_count () const {
+    return m_update_count;
+  }
+
+  // Parse bytes from the server.
+  void receive (const ioa::buffer_interface& buf) {
+    rgram::buffer rbuf (buf);
+    m_protocol.put (rbuf);
+  }
+
+  // Parse several buffers from the server in one pass.
+  void receive (const rgram::buffer_chain& chain) {
+    rgram::buffer rbuf (chain);
+    m_protocol.put (rbuf);
+  }
+
+  bool has_message () const {
+    return !m_input_sendq.empty () || !m_sendq.empty ();
+  }
+
+  // The next message for the server.
+  ioa::const_shared_ptr<ioa::buffer_interface> next_message () {
+    // Messages are whole buffers so input can go between any two of them.
+    std::queue<ioa::const_shared_ptr<ioa::buffer_interface> >& q = !m_input_sendq.empty () ? m_input_sendq : m_sendq;
+    ioa::const_shared_ptr<ioa::buffer_interface> retval = q.front ();
+    q.pop ();
+    return retval;
+  }
+
+  void send_key_event (const bool down,
+		       const uint32_t key) {
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::key_event_t msg (down, key);
+    msg.write_to_buffer (*buf);
+    m_input_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  }
+
+  // The position is clamped to the framebuffer.
+  void send_pointer_event (const uint8_t button_mask,
+			   const int x,
+			   const int y) {
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::pointer_event_t msg (button_mask, std::max (0, std::min (x, m_width - 1)), std::max (0, std::min (y, m_height - 1)));
+    msg.write_to_buffer (*buf);
+    m_input_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  }
+
+private:
+  void recv_protocol_version (const rfb::protocol_version_t& version) {
+    std::cout << "client: " << __func__ << std::endl;
+
+    if (version == rfb::PROTOCOL_VERSION_3_3) {
+      // The server send us a version we can understand.
+      // Use the lowest version mutually supported.
+      m_protocol_version = std::min (version, HIGHEST_VERSION);
+    }
+    else {
+      // The version is either too high, too low, or garbage.
+      // Use our own and let the server disconnect if not supported.
+      m_protocol_version = HIGHEST_VERSION;
+    }
+
+    send_protocol_version ();
+  }
+
+  void send_protocol_version () {
+    std::cout << "client: " << __func__ << std::endl;
+    ioa::buffer* buf = new ioa::buffer ();
+    m_protocol_version.write_to_buffer (*buf);
+    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  }
+
+  void recv_security_type (const rfb::security_type_t& msg) {
+    std::cout << "client: " << __func__ << std::endl;
+    assert (msg.security == rfb::NONE);
+
+    send_client_init ();
+  }
+
+  void send_client_init () {
+    std::cout << "client: " << __func__ << std::endl;
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::client_init_t msg (true);
+    msg.write_to_buffer (*buf);
+    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  }
+
+  void recv_server_init (const rfb::server_init_t& msg) {
+    std::cout << "client: " << __func__ << std::endl;
+    resize (msg.framebuffer_width, msg.framebuffer_height);
+    // We are going to ignore the server pixel format and send our own.
+
+    send_set_pixel_format ();
+    send_set_encodings ();
+    // The first request is for the entire screen and the rest are incremental.
+    fill_request_window ();
+  }
+
+  // Size the framebuffer to the server's framebuffer.
+  // The framebuffer is allocated rather than fixed so any size works.
+  void resize (const uint16_t width,
+	       const uint16_t height) {
+    std::cout << "client: " << __func__ << " " << width << "x" << height << std::endl;
+    m_framebuffer.release ();
+    m_data = 0;
+    m_width = width;
+    m_height = height;
+    if (m_width != 0 && m_height != 0) {
+      m_data = m_presenter.allocate (m_width, m_height);
+      if (m_data == 0) {
+	m_framebuffer.allocate (size_t (m_width) * m_height * sizeof (uint32_t), m_huge_pages);
+	m_data = static_cast<uint32_t*> (m_framebuffer.data ());
+      }
+    }
+    m_presenter.resized (m_width, m_height, m_data);
+  }
+
+  // The server changed the size of its framebuffer.
+  void recv_desktop_size (const uint16_t width,
+			  const uint16_t height) {
+    resize (width, height);
+    // The contents are gone so ask for everything.
+    m_incremental = false;
+    if (m_continuous) {
+      // Nothing else asks for the unchanged parts of the new framebuffer.
+      send_enable_continuous_updates ();
+      send_framebuffer_update_request ();
+    }
+  }
+
+  void send_set_pixel_format () {
+    std::cout << "client: " << __func__ << std::endl;
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::set_pixel_format_t msg (m_pixel_format);
+    msg.write_to_buffer (*buf);
+    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  }
+
+  void send_set_encodings () {
+    std::cout << "client: " << __func__ << std::endl;
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::set_encodings_t msg (m_encodings);
+    msg.write_to_buffer (*buf);
+    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+    m_cached_tiles = std::find (m_encodings.begin (), m_encodings.end (), rfb::CACHED_TILE) != m_encodings.end ();
+  }
+
+  void send_framebuffer_update_request () {
+    std::cout << "client: " << __func__ << std::endl;
+    ioa::buffer* buf = new ioa::buffer ();
+    // We want the whole image.
+    rfb::framebuffer_update_request_t msg (m_incremental, 0, 0, m_width, m_height);
+    // Can switch to incremental.
+    m_incremental = true;
+    msg.write_to_buffer (*buf);
+    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+    ++m_outstanding_requests;
+  }
+
+  void fill_request_window () {
+    while (m_outstanding_requests < m_request_window) {
+      send_framebuffer_update_request ();
+    }
+  }
+
+  // Whether the rectangle lies within the framebuffer.
+  bool contains (const uint16_t x,
+		 const uint16_t y,
+		 const uint16_t width,
+		 const uint16_t height) const {
+    return m_data != 0 && x + width <= m_width && y + height <= m_height;
+  }
+
+  // Copy a rectangle within the framebuffer.  Source and destination may overlap.
+  void copy_rect (const uint16_t src_x,
+		  const uint16_t src_y,
+		  const uint16_t x,
+		  const uint16_t y,
+		  const uint16_t width,
+		  const uint16_t height) {
+    if (src_x + width > m_width || src_y + height > m_height || x + width > m_width || y + height > m_height) {
+      std::cerr << "CopyRect out of bounds" << std::endl;
+      return;
+    }
+
+    const size_t bytes = width * sizeof (uint32_t);
+    if (y > src_y) {
+      // Moving down.  Copy from the bottom so source rows are not overwritten.
+      for (uint16_t row = height; row != 0; --row) {
+	memmove (&m_data[(y + row - 1) * m_width + x], &m_data[(src_y + row - 1) * m_width + src_x], bytes);
+      }
+    }
+    else {
+      for (uint16_t row = 0; row != height; ++row) {
+	memmove (&m_data[(y + row) * m_width + x], &m_data[(src_y + row) * m_width + src_x], bytes);
+      }
+    }
+    m_presenter.region_updated (x, y, width, height);
+  }
+
+  // A RAW or ZRLE rectangle has been decoded.
+  void decoded (const uint16_t x,
+		const uint16_t y,
+		const uint16_t width,
+		const uint16_t height) {
+    m_presenter.region_updated (x, y, width, height);
+    if (m_cached_tiles && uint32_t (width) * height <= rfb::CONTENT_CACHE_MAX_PIXELS) {
+      m_content_cache.insert (&m_data[y * m_width + x], m_width, width, height);
+    }
+  }
+
+  void paint_cached_tile (const uint32_t slot,
+			  const uint16_t x,
+			  const uint16_t y,
+			  const uint16_t width,
+			  const uint16_t height) {
+    if (x + width > m_width || y + height > m_height ||
+	!m_content_cache.paint (slot, &m_data[y * m_width + x], m_width, width, height)) {
+      std::cerr << "Bad cached tile " << slot << std::endl;
+      return;
+    }
+    m_presenter.region_updated (x, y, width, height);
+  }
+
+  void set_cursor (const uint16_t hotspot_x,
+		   const uint16_t hotspot_y,
+		   const uint16_t width,
+		   const uint16_t height,
+		   const uint8_t* image,
+		   const uint8_t* mask) {
+    m_presenter.cursor_changed (hotspot_x, hotspot_y, width, height, image, mask);
+  }
+
+  void recv_framebuffer_update () {
+    std::cout << "client: " << __func__ << std::endl;
+
+    ioa::time now = ioa::time::now ();
+    std::cout << "@(" << now.sec () << "," << now.usec () << ")" << std::endl;
+
+    ++m_update_count;
+    m_presenter.update_done ();
+
+    // A server that merges requests answers fewer than we send so this is only an estimate.
+    // It never exceeds the window so there is always room for at least one new request.
+    if (m_outstanding_requests != 0) {
+      --m_outstanding_requests;
+    }
+
+    if (!m_continuous) {
+      // Request.
+      fill_request_window ();
+    }
+  }
+
+  void recv_end_of_continuous_updates () {
+    std::cout << "client: " << __func__ << std::endl;
+    if (!m_continuous_supported) {
+      // The first one means the server supports continuous updates.
+      m_continuous_supported = true;
+      send_enable_continuous_updates ();
+    }
+    else if (m_continuous) {
+      // The server stopped.  Go back to requesting.
+      m_continuous = false;
+      fill_request_window ();
+    }
+  }
+
+  void send_enable_continuous_updates () {
+    std::cout << "client: " << __func__ << std::endl;
+    ioa::buffer* buf = new ioa::buffer ();
+    rfb::enable_continuous_updates_t msg (true, 0, 0, m_width, m_height);
+    msg.write_to_buffer (*buf);
+    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+    m_continuous = true;
+  }
+
+  void recv_fence (const rfb::fence_t& msg) {
+    if (msg.flags & rfb::FENCE_REQUEST) {
+      // Messages are handled in order so every flag we know is already satisfied.
+      ioa::buffer* buf = new ioa::buffer ();
+      rfb::fence_t response (msg.flags & (rfb::FENCE_BLOCK_BEFORE | rfb::FENCE_BLOCK_AFTER | rfb::FENCE_SYNC_NEXT), msg.payload);
+      response.write_to_buffer (*buf);
+      m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef __rfb_client_automaton_hpp__
+#define __rfb_client_automaton_hpp__
+
+#include "rfb_client.hpp"
+
+#include <ioa/ioa.hpp>
+
+/*
+  An RFB client with no display.
+
+  The framebuffer is kept in memory and handed to a Presenter, which defaults to one that does nothing.
+  Useful for benchmarks and for loading a server with many clients in one process.
+*/
+
+template <class Presenter = rfb_client::presenter>
+class rfb_client_automaton :
+  public ioa::automaton
+{
+private:
+  Presenter m_presenter;
+  rfb_client m_client;
+
+public:
+  rfb_client_automaton (const size_t request_window = 1) :
+    m_client (m_presenter, request_window)
+  {
+    schedule ();
+  }
+
+  const Presenter& presenter () const {
+    return m_presenter;
+  }
+
+  const rfb_client& client () const {
+    return m_client;
+  }
+
+private:
+  void schedule () const {
+    if (send_precondition ()) {
+      ioa::schedule (&rfb_client_automaton::send);
+    }
+  }
+
+  bool send_precondition () const {
+    return m_client.has_message () && ioa::binding_count (&rfb_client_automaton::send) != 0;
+  }
+
+  ioa::const_shared_ptr<ioa::buffer_interface> send_effect () {
+    return m_client.next_message ();
+  }
+
+public:
+  V_UP_OUTPUT (rfb_client_automaton, send, ioa::const_shared_ptr<ioa::buffer_interface>);
+
+private:
+  void receive_effect (const ioa::const_shared_ptr<ioa::buffer_interface>& val) {
+    if (val.get () != 0) {
+      m_client.receive (*val.get ());
+    }
+  }
+
+public:
+  V_UP_INPUT (rfb_client_automaton, receive, ioa::const_shared_ptr<ioa::buffer_interface>);
+
+private:
+  void receive_batch_effect (const ioa::const_shared_ptr<rgram::buffer_chain>& val) {
+    if (val.get () != 0) {
+      m_client.receive (*val.get ());
+    }
+  }
+
+public:
+  V_UP_INPUT (rfb_client_automaton, receive_batch, ioa::const_shared_ptr<rgram::buffer_chain>);
+};
+
+#endif
@@ -0,0 +1,1520 @@
+#ifndef __rfb_server_automaton_hpp__
+#define __rfb_server_automaton_hpp__
+
+#include <substrate/rgram.hpp>
+#include "rfb.hpp"
+#include "zrle.hpp"
+#include "motion_detector.hpp"
+#include "encoder_selector.hpp"
+#include "monotonic_clock.hpp"
+#include "encoder_pool.hpp"
+#include "pixel_translator.hpp"
+#include "tile_cache.hpp"
+#include "content_cache.hpp"
+#include "frame_source.hpp"
+#include "damage_region.hpp"
+#include "bounded_channel_automaton.hpp"
+
+#include <ioa/ioa.hpp>
+
+#include <deque>
+#include <queue>
+#include <set>
+#include <vector>
+#include <iostream>
+
+/*
+  RFB server for any number of clients.
+
+  The server owns the framebuffer and tracks damage.
+  Each client has a session with its own pixel format, encodings, outstanding request, and send queue.
+  When the image changes, the server compares it to the previous frame once, detects moves once, and ORs the damaged tiles into every session.
+  Sessions encode directly from the shared framebuffer so nothing is copied per client.
+  Encoded tiles are cached for the current frame so clients with the same pixel format and encoding share the encoding work.
+  Clients that accept CACHED_TILE are sent the slot of a tile they already hold instead of its pixels.
+  Clients that accept ContinuousUpdates and Fence may ask for updates to be pushed as damage occurs.
+  A fence follows every update and at most CONTINUOUS_WINDOW updates are sent ahead of the fence responses.
+
+  The image comes from a frame source at no more than the target frame rate.
+  A frame is produced only when a client is waiting for one, so an idle server does no work.
+  The source reports what it damaged and only those tiles are compared with the previous frame.
+
+  The cursor is kept out of the framebuffer.  Clients that accept the Cursor pseudo-encoding are sent its shape and draw it themselves.
+  For other clients it is drawn into the tiles it covers when they are encoded.
+
+  A session whose send is bound to a bounded channel should have the channel's credit bound to credit.
+  Then the session sends only what the channel has room for.
+  It encodes no update while the last one is still waiting for room, so damage keeps merging instead of queuing as frames.
+
+  Sessions are numbered from 0 and the number is the parameter of send, receive, and credit.
+*/
+
+class rfb_server_automaton :
+  public ioa::automaton
+{
+private:
+  class session_t;
+
+  struct recv_protocol_version_gramel :
+    public rgram::gramel
+  {
+    session_t& m_session;
+    rfb::protocol_version_gramel m_protocol_version;
+
+    recv_protocol_version_gramel (session_t& session) :
+      m_session (session)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_protocol_version.put (buf);
+      if (done ()) {
+	m_session.recv_protocol_version (m_protocol_version.get ());
+      }
+    }
+
+    bool done () const {
+      return m_protocol_version.done ();
+    }
+
+    void reset () {
+      m_protocol_version.reset ();
+    }
+  };
+
+  struct recv_client_init_gramel :
+    public rgram::gramel
+  {
+    session_t& m_session;
+    rfb::client_init_gramel m_init;
+
+    recv_client_init_gramel (session_t& session) :
+      m_session (session)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_init.put (buf);
+      if (done ()) {
+	m_session.recv_client_init (m_init.get ());
+      }
+    }
+
+    bool done () const {
+      return m_init.done ();
+    }
+
+    void reset () {
+      m_init.reset ();
+    }
+  };
+
+  struct recv_client_message_gramel :
+    public rgram::gramel
+  {
+    session_t& m_session;
+    rfb::client_message_gramel m_message;
+
+    recv_client_message_gramel (session_t& session) :
+      m_session (session)
+    { }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+
+      m_message.put (buf);
+      if (done ()) {
+	switch (m_message.m_choice.get ()) {
+	case rfb::SET_PIXEL_FORMAT_TYPE:
+	  m_session.recv_set_pixel_format (m_message.m_set_pixel_format.get ());
+	  break;
+	case rfb::SET_ENCODINGS_TYPE:
+	  m_session.recv_set_encodings (m_message.m_set_encodings.get ());
+	  break;
+	case rfb::FRAMEBUFFER_UPDATE_REQUEST_TYPE:
+	  m_session.recv_framebuffer_update_request (m_message.m_framebuffer_update_request.get ());
+	  break;
+	case rfb::KEY_EVENT_TYPE:
+	  m_session.recv_key_event (m_message.m_key_event.get ());
+	  break;
+	case rfb::POINTER_EVENT_TYPE:
+	  m_session.recv_pointer_event (m_message.m_pointer_event.get ());
+	  break;
+	case rfb::ENABLE_CONTINUOUS_UPDATES_TYPE:
+	  m_session.recv_enable_continuous_updates (m_message.m_enable_continuous_updates.get ());
+	  break;
+	case rfb::FENCE_TYPE:
+	  m_session.recv_fence (m_message.m_fence.get ());
+	  break;
+	default:
+	  std::cerr << "Unknown client message.  Type = " << int (m_message.m_choice.get ()) << std::endl;
+	  abort ();
+	}
+	// Reset to start over.
+	m_message.reset ();
+      }
+    }
+
+    bool done () const {
+      return m_message.done ();
+    }
+
+    void reset () {
+      m_message.reset ();
+    }
+  };
+
+  struct protocol_gramel :
+    public rgram::gramel
+  {
+    recv_protocol_version_gramel m_recv_protocol;
+    recv_client_init_gramel m_recv_init;
+    recv_client_message_gramel m_recv_client;
+    rgram::sequence_gramel m_sequence;
+
+    protocol_gramel (session_t& session) :
+      m_recv_protocol (session),
+      m_recv_init (session),
+      m_recv_client (session)
+    {
+      m_sequence.append (&m_recv_protocol);
+      m_sequence.append (&m_recv_init);
+      m_sequence.append (&m_recv_client);
+    }
+
+    void put (rgram::buffer& buf) {
+      assert (!done ());
+      m_sequence.put (buf);
+    }
+
+    bool done () const {
+      return m_sequence.done ();
+    }
+
+    void reset () {
+      m_sequence.reset ();
+    }
+  };
+
+  struct rgb_t
+  {
+    union {
+      uint32_t val;
+      struct {
+	uint8_t blue;
+	uint8_t green;
+	uint8_t red;
+	uint8_t unused;
+      } little_endian;
+      struct {
+	uint8_t unused;
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+      } big_endian;
+    };
+  };
+
+  // A tile of an update.  Analyzed and then encoded by the encoder pool.
+  struct tile_t :
+    public encoder_pool::task
+  {
+    enum phase_t {
+      ANALYZE,
+      ENCODE,
+    };
+
+    const session_t& m_session;
+    const uint16_t x_position;
+    const uint16_t y_position;
+    const uint16_t width;
+    const uint16_t height;
+    phase_t phase;
+    rfb::tile_statistics_t stats;
+    int32_t encoding;
+    // The output of the encoder.  For ZRLE, the uncompressed tile.
+    std::vector<uint8_t> data;
+    // The output of the encoder after it has been cached.
+    rfb::tile_cache::data_ptr encoded;
+    // Whether encoded came from the cache without running the encoder.
+    bool cache_hit;
+    uint64_t encode_ns;
+    // For CACHED_TILE, the slot in the client's cache.
+    size_t slot;
+    // The tile with the cursor drawn over it.  Empty if the cursor is not in the tile or the client draws it.
+    std::vector<uint32_t> composited;
+
+    tile_t (const session_t& session,
+	    const uint16_t x_pos,
+	    const uint16_t y_pos,
+	    const uint16_t w,
+	    const uint16_t h) :
+      m_session (session),
+      x_position (x_pos),
+      y_position (y_pos),
+      width (w),
+      height (h),
+      phase (ANALYZE),
+      encoding (rfb::RAW),
+      cache_hit (false),
+      encode_ns (0),
+      slot (0)
+    { }
+
+    void run () {
+      const rfb_server_automaton& server = m_session.m_server;
+      const uint32_t* pixels = &server.m_data[y_position * server.WIDTH + x_position].val;
+      size_t stride = server.WIDTH;
+      if (!composited.empty ()) {
+	pixels = &composited[0];
+	stride = width;
+      }
+      if (phase == ANALYZE) {
+	stats = rfb::encoder_selector::analyze (pixels, stride, width, height);
+	stats.hash = rfb::content_hash (pixels, stride, width, height);
+      }
+      else {
+	const uint64_t start = monotonic_ns ();
+	const rfb::pixel_translator& translator = m_session.m_translator;
+	// Convert to the client's pixel format.
+	std::vector<uint32_t> translated;
+	if (!translator.identity ()) {
+	  translated.resize (width * height);
+	  for (uint16_t y = 0; y != height; ++y) {
+	    translator.translate (pixels + y * stride, &translated[y * width], width);
+	  }
+	  pixels = &translated[0];
+	  stride = width;
+	}
+
+	if (encoding == rfb::ZRLE) {
+	  rfb::zrle_tile_encoder encoder;
+	  encoder.encode (pixels, stride, width, height, translator.client_format (), data);
+	}
+	else {
+	  const size_t row_bytes = width * translator.bytes_per_pixel ();
+	  data.resize (height * row_bytes);
+	  for (uint16_t y = 0; y != height; ++y) {
+	    translator.pack (pixels + y * stride, &data[y * row_bytes], width);
+	  }
+	}
+	encode_ns = monotonic_ns () - start;
+      }
+    }
+  };
+
+  // The state of one client.
+  class session_t
+  {
+  public:
+    rfb_server_automaton& m_server;
+    const int m_id;
+    protocol_gramel m_protocol;
+    std::queue<ioa::const_shared_ptr<ioa::buffer_interface> > m_sendq;
+    rfb::protocol_version_t m_protocol_version;
+    rfb::pixel_format_t m_client_format;
+    rfb::pixel_translator m_translator;
+    std::vector<int32_t> m_client_encodings;
+    // Whether the client accepts CopyRect.
+    bool m_copy_rect;
+    // Whether the client draws the cursor.  Otherwise it is drawn into the tiles it covers.
+    bool m_cursor_shape;
+    // The client has not been sent the current cursor shape.
+    bool m_cursor_pending;
+    // Whether the client keeps a content cache.
+    bool m_cached_tiles;
+    rfb::content_cache_index m_content_cache;
+    uint64_t m_cached_tile_count;
+    rfb::encoder_selector m_encoder_selector;
+    // One zlib stream per connection.
+    rfb::zrle_encoder m_zrle_encoder;
+    size_t m_update_count;
+    // An update waiting to be acknowledged, for measuring throughput.
+    struct transmission_t
+    {
+      size_t bytes;
+      // Bytes queued up to the end of the update.
+      uint64_t end;
+      // When the update left.  Zero until then.
+      uint64_t ns;
+    };
+    // Updates sent without a fence and not yet followed by a request, oldest first.
+    std::deque<transmission_t> m_unacknowledged;
+    // Tiles that differ from what the client has.
+    std::vector<bool> m_damage;
+    size_t m_damage_count;
+    // A move to send as a CopyRect before the damaged tiles.
+    bool m_has_motion;
+    rfb::motion_t m_motion;
+    // Whether the client accepts fences.
+    bool m_fence;
+    // The update before a fence.
+    struct fence_record_t :
+      public transmission_t
+    {
+      uint32_t sequence;
+    };
+    // Fences sent and not yet answered, oldest first.
+    std::deque<fence_record_t> m_fences;
+    uint32_t m_fence_sequence;
+    // Round trip time measured by the last fence.
+    uint64_t m_rtt_ns;
+    // Whether we have told the client we support continuous updates.
+    bool m_continuous_supported;
+    bool m_continuous;
+    uint16_t m_continuous_x;
+    uint16_t m_continuous_y;
+    uint16_t m_continuous_width;
+    uint16_t m_continuous_height;
+    // Requests not yet answered.  They share one region and each update answers one.
+    size_t m_outstanding_requests;
+    bool m_request_incremental;
+    uint16_t m_request_x0;
+    uint16_t m_request_y0;
+    uint16_t m_request_x1;
+    uint16_t m_request_y1;
+    // Totals granted by a bounded channel and sent since the session started.  No limit until the first grant.
+    bool m_credited;
+    uint64_t m_granted_items;
+    uint64_t m_granted_bytes;
+    uint64_t m_sent_items;
+    uint64_t m_sent_bytes;
+    // Bytes queued since the session started.
+    uint64_t m_queued_bytes;
+
+    session_t (rfb_server_automaton& server,
+	       const int id) :
+      m_server (server),
+      m_id (id),
+      m_protocol (*this),
+      m_client_format (server.PIXEL_FORMAT),
+      m_translator (server.PIXEL_FORMAT),
+      m_copy_rect (false),
+      m_cursor_shape (false),
+      m_cursor_pending (false),
+      m_cached_tiles (false),
+      m_cached_tile_count (0),
+      m_update_count (0),
+      // The client has nothing.
+      m_damage (server.TILES_X * server.TILES_Y, true),
+      m_damage_count (server.TILES_X * server.TILES_Y),
+      m_has_motion (false),
+      m_fence (false),
+      m_fence_sequence (0),
+      m_rtt_ns (0),
+      m_continuous_supported (false),
+      m_continuous (false),
+      m_outstanding_requests (0),
+      m_credited (false),
+      m_granted_items (0),
+      m_granted_bytes (0),
+      m_sent_items (0),
+      m_sent_bytes (0),
+      m_queued_bytes (0)
+    { }
+
+    void push (ioa::buffer* buf) {
+      m_queued_bytes += buf->size ();
+      m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+    }
+
+    void send_protocol_version () {
+      std::cout << "server: " << __func__ << std::endl;
+      ioa::buffer* buf = new ioa::buffer ();
+      m_server.HIGHEST_VERSION.write_to_buffer (*buf);
+      push (buf);
+    }
+
+    void recv_protocol_version (const rfb::protocol_version_t& version) {
+      std::cout << "server: " << __func__ << std::endl;
+
+      m_protocol_version = version;
+
+      if (m_protocol_version != rfb::PROTOCOL_VERSION_3_3) {
+	// TODO:  Support other protocols.
+	assert (false);
+      }
+      else {
+	// The client sent us a version we don't understand.
+	// Ignore them.
+	m_protocol_version = m_server.HIGHEST_VERSION;
+      }
+
+      // The client wants to use a protocol we understand.
+      std::string s (m_protocol_version.version, rfb::PROTOCOL_VERSION_STRING_LENGTH - 1);
+      std::cout << "server: protocol version = " << s << std::endl;
+
+      send_security_type ();
+    }
+
+    void send_security_type () {
+      std::cout << "server: " << __func__ << std::endl;
+
+      ioa::buffer* buf = new ioa::buffer ();
+      // We only support no security.
+      rfb::security_type_t msg (rfb::NONE);
+      msg.write_to_buffer (*buf);
+      push (buf);
+    }
+
+    void recv_client_init (const rfb::client_init_t& init) {
+      std::cout << "server: " << __func__ << std::endl;
+      // We explicity ignore the share flag.  Every session shares the framebuffer.
+
+      send_server_init ();
+    }
+
+    void send_server_init () {
+      std::cout << "server: " << __func__ << std::endl;
+      ioa::buffer* buf = new ioa::buffer ();
+      m_server.SERVER_INIT.write_to_buffer (*buf);
+      push (buf);
+    }
+
+    void recv_set_pixel_format (const rfb::set_pixel_format_t& msg) {
+      std::cout << "server: " << __func__ << std::endl;
+      if (!rfb::pixel_translator::valid (msg.pixel_format)) {
+	std::cerr << "server: unsupported pixel format.  bits_per_pixel = " << int (msg.pixel_format.bits_per_pixel) << std::endl;
+	return;
+      }
+
+      m_client_format = msg.pixel_format;
+      m_translator.set_client_format (m_client_format);
+
+      if (!m_client_format.true_colour_flag) {
+	send_set_colour_map_entries ();
+      }
+
+      // Everything the client has is in the old format, including its cache.
+      // Nothing tells the client to empty its cache so stop using it once anything may be in it.
+      if (m_update_count != 0) {
+	m_cached_tiles = false;
+      }
+      m_damage.assign (m_damage.size (), true);
+      m_damage_count = m_damage.size ();
+      m_has_motion = false;
+    }
+
+    void send_set_colour_map_entries () {
+      std::cout << "server: " << __func__ << std::endl;
+      ioa::buffer* buf = new ioa::buffer ();
+      rfb::set_colour_map_entries_t msg (0, rfb::pixel_translator::colour_map ());
+      msg.write_to_buffer (*buf);
+      push (buf);
+    }
+
+    void recv_set_encodings (const rfb::set_encodings_t& msg) {
+      std::cout << "server: " << __func__ << std::endl;
+      // Make a copy.
+      std::vector<int32_t> encodings = msg.encodings;
+      // Everyone must support RAW.
+      encodings.push_back (rfb::RAW);
+
+      std::set<int32_t> s;
+
+      m_client_encodings.clear ();
+      for (std::vector<int32_t>::const_iterator pos = encodings.begin ();
+	   pos != encodings.end ();
+	   ++pos) {
+	if (m_server.m_supported_encodings.count (*pos) != 0 && s.count (*pos) == 0) {
+	  m_client_encodings.push_back (*pos);
+	  s.insert (*pos);
+	}
+      }
+
+      m_copy_rect = s.count (rfb::COPY_RECT) != 0;
+      m_fence = s.count (rfb::FENCE) != 0;
+
+      const bool cursor_shape = s.count (rfb::CURSOR) != 0;
+      if (cursor_shape != m_cursor_shape) {
+	m_cursor_shape = cursor_shape;
+	m_cursor_pending = m_cursor_shape;
+	// Remove or add the cursor in the client's framebuffer.
+	damage_cursor ();
+      }
+
+      // Continuous updates depend on fences for flow control.
+      if (!m_continuous_supported && m_fence && s.count (rfb::CONTINUOUS_UPDATES) != 0) {
+	// This tells the client we support continuous updates.
+	m_continuous_supported = true;
+	send_end_of_continuous_updates ();
+      }
+
+      // The caches must start empty on both sides so the cache can only be turned on before the first update.
+      // It can be turned off at any time.
+      const bool cached_tiles = s.count (rfb::CACHED_TILE) != 0;
+      if (m_update_count == 0) {
+	m_cached_tiles = cached_tiles;
+	m_content_cache.clear ();
+      }
+      else if (!cached_tiles) {
+	m_cached_tiles = false;
+      }
+    }
+
+    // Add a request to the outstanding requests.
+    void add_request (const bool incremental,
+		      const uint16_t x,
+		      const uint16_t y,
+		      const uint16_t width,
+		      const uint16_t height) {
+      if (x < m_server.WIDTH &&
+	  y < m_server.HEIGHT &&
+	  width > 0 &&
+	  height > 0) {
+	// Request will produce data.
+
+	// Correct out-of-bounds width and height.
+	const uint16_t new_width = std::min (m_server.WIDTH, uint16_t (x + width)) - x;
+	const uint16_t new_height = std::min (m_server.HEIGHT, uint16_t (y + height)) - y;
+
+	if (m_outstanding_requests == 0) {
+	  // If there is not outstanding request, send the bounds.
+	  m_request_x0 = x;
+	  m_request_y0 = y;
+	  m_request_x1 = x + new_width;
+	  m_request_y1 = y + new_height;
+	  m_request_incremental = incremental;
+	}
+	else {
+	  // Expand the bounds.
+	  m_request_x0 = std::min (m_request_x0, x);
+	  m_request_y0 = std::min (m_request_y0, y);
+	  m_request_x1 = std::max (m_request_x1, uint16_t (x + new_width));
+	  m_request_y1 = std::max (m_request_y1, uint16_t (y + new_height));
+	  m_request_incremental = m_request_incremental && incremental;
+	}
+	++m_outstanding_requests;
+      }
+    }
+
+    void recv_framebuffer_update_request (const rfb::framebuffer_update_request_t& request) {
+      std::cout << "server: " << __func__ << std::endl;
+
+      // Once the first window of requests is in, the client sends one for each update it receives.
+      if (!m_unacknowledged.empty () && m_unacknowledged.front ().ns != 0) {
+	const transmission_t& t = m_unacknowledged.front ();
+	m_encoder_selector.record_transmission (t.bytes, t.ns, monotonic_ns ());
+	m_unacknowledged.pop_front ();
+      }
+
+      add_request (request.incremental, request.x_position, request.y_position, request.width, request.height);
+      std::cout << "New bounds (" << m_request_x0 << "," << m_request_y0 << ") -> (" << m_request_x1 << "," << m_request_y1 << ")" << std::endl;
+    }
+
+    void recv_key_event (const rfb::key_event_t& msg) {
+      std::cout << "server: " << __func__ << " down = " << int (msg.down_flag) << " key = " << msg.key << std::endl;
+    }
+
+    void recv_pointer_event (const rfb::pointer_event_t& msg) {
+      m_server.move_cursor (msg.x_position, msg.y_position);
+    }
+
+    void recv_enable_continuous_updates (const rfb::enable_continuous_updates_t& msg) {
+      std::cout << "server: " << __func__ << " enable = " << int (msg.enable) << std::endl;
+      if (!m_continuous_supported) {
+	std::cerr << "server: continuous updates were not negotiated" << std::endl;
+	return;
+      }
+
+      // Only the part on the framebuffer can be damaged.  Nothing there is the same as disabling.
+      const rfb::damage_rect_t region = rfb::damage_rect_t (msg.x_position, msg.y_position, msg.width, msg.height).clip (m_server.WIDTH, m_server.HEIGHT);
+      if (msg.enable && !region.empty ()) {
+	m_continuous = true;
+	m_continuous_x = region.x_position;
+	m_continuous_y = region.y_position;
+	m_continuous_width = region.width;
+	m_continuous_height = region.height;
+      }
+      else {
+	m_continuous = false;
+	// Tell the client no more unrequested updates are coming.
+	send_end_of_continuous_updates ();
+      }
+    }
+
+    void send_end_of_continuous_updates () {
+      std::cout << "server: " << __func__ << std::endl;
+      ioa::buffer* buf = new ioa::buffer ();
+      rfb::end_of_continuous_updates_t msg;
+      msg.write_to_buffer (*buf);
+      push (buf);
+    }
+
+    void recv_fence (const rfb::fence_t& msg) {
+      if (msg.flags & rfb::FENCE_REQUEST) {
+	// Messages are handled in order so every flag we know is already satisfied.
+	send_fence (msg.flags & (rfb::FENCE_BLOCK_BEFORE | rfb::FENCE_BLOCK_AFTER | rfb::FENCE_SYNC_NEXT), msg.payload);
+	return;
+      }
+
+      // The response to our oldest fence.  Everything sent before it has been processed.
+      if (m_fences.empty ()) {
+	std::cerr << "server: unexpected fence response" << std::endl;
+	return;
+      }
+      const fence_record_t& record = m_fences.front ();
+      if (record.ns != 0) {
+	const uint64_t now = monotonic_ns ();
+	m_rtt_ns = now - record.ns;
+	m_encoder_selector.record_transmission (record.bytes, record.ns, now);
+      }
+      m_fences.pop_front ();
+    }
+
+    void send_fence (const uint32_t flags,
+		     const std::vector<uint8_t>& payload) {
+      ioa::buffer* buf = new ioa::buffer ();
+      rfb::fence_t msg (flags, payload);
+      msg.write_to_buffer (*buf);
+      push (buf);
+    }
+
+    void set_damage (const size_t tile) {
+      if (!m_damage[tile]) {
+	m_damage[tile] = true;
+	++m_damage_count;
+      }
+    }
+
+    void clear_damage (const size_t tile) {
+      if (m_damage[tile]) {
+	m_damage[tile] = false;
+	--m_damage_count;
+      }
+    }
+
+    // Damage every tile touching the rectangle.
+    void set_damage (const uint16_t x,
+		     const uint16_t y,
+		     const uint16_t width,
+		     const uint16_t height) {
+      if (width == 0 || height == 0) {
+	return;
+      }
+      for (uint16_t ty = y / TILE_SIZE; ty < m_server.TILES_Y && ty * TILE_SIZE < y + height; ++ty) {
+	for (uint16_t tx = x / TILE_SIZE; tx < m_server.TILES_X && tx * TILE_SIZE < x + width; ++tx) {
+	  set_damage (ty * m_server.TILES_X + tx);
+	}
+      }
+    }
+
+    // True if any tile touching the rectangle is damaged.
+    bool damaged (const uint16_t x,
+		  const uint16_t y,
+		  const uint16_t width,
+		  const uint16_t height) const {
+      if (m_damage_count == 0) {
+	return false;
+      }
+      for (uint16_t ty = y / TILE_SIZE; ty < m_server.TILES_Y && ty * TILE_SIZE < y + height; ++ty) {
+	for (uint16_t tx = x / TILE_SIZE; tx < m_server.TILES_X && tx * TILE_SIZE < x + width; ++tx) {
+	  if (m_damage[ty * m_server.TILES_X + tx]) {
+	    return true;
+	  }
+	}
+      }
+      return false;
+    }
+
+    // Merge damage from the server.
+    // If motion is not null, moved_damage is the damage assuming the move is applied first.
+    void add_damage (const std::vector<bool>& damage,
+		     const rfb::motion_t* motion,
+		     const std::vector<bool>& moved_damage) {
+      const std::vector<bool>* d = &damage;
+      // The move is only valid if the client has the source.
+      if (motion != 0 &&
+	  m_copy_rect &&
+	  !m_has_motion &&
+	  !damaged (motion->src_x_position, motion->src_y_position, motion->width, motion->height)) {
+	m_has_motion = true;
+	m_motion = *motion;
+	d = &moved_damage;
+	if (!m_cursor_shape) {
+	  // The client's copy of the source may include the cursor.  Damage where the move puts it and where it is.
+	  uint16_t x, y, width, height;
+	  m_server.cursor_rect (x, y, width, height);
+	  const int x0 = std::max (int (x), int (m_motion.src_x_position));
+	  const int y0 = std::max (int (y), int (m_motion.src_y_position));
+	  const int x1 = std::min (x + width, m_motion.src_x_position + m_motion.width);
+	  const int y1 = std::min (y + height, m_motion.src_y_position + m_motion.height);
+	  if (x0 < x1 && y0 < y1) {
+	    set_damage (x0 - m_motion.src_x_position + m_motion.x_position,
+			y0 - m_motion.src_y_position + m_motion.y_position,
+			x1 - x0,
+			y1 - y0);
+	  }
+	  damage_cursor ();
+	}
+      }
+      for (size_t tile = 0; tile != d->size (); ++tile) {
+	if ((*d)[tile]) {
+	  set_damage (tile);
+	}
+      }
+    }
+
+    // Damage what the cursor covers in the client's framebuffer.
+    void damage_cursor () {
+      uint16_t x, y, width, height;
+      m_server.cursor_rect (x, y, width, height);
+      set_damage (x, y, width, height);
+    }
+
+    // Give up on the move and send its destination as tiles.
+    void drop_motion () {
+      if (m_has_motion) {
+	m_has_motion = false;
+	set_damage (m_motion.x_position, m_motion.y_position, m_motion.width, m_motion.height);
+      }
+    }
+
+    bool has_credit () const {
+      return !m_credited || (m_granted_items > m_sent_items && m_granted_bytes > m_sent_bytes);
+    }
+
+    void sent (const ioa::buffer_interface& buf) {
+      ++m_sent_items;
+      m_sent_bytes += buf.size ();
+
+      // Time transmission from when an update leaves rather than when it was queued.
+      stamp_sent (m_unacknowledged);
+      stamp_sent (m_fences);
+    }
+
+    template <class Records>
+    void stamp_sent (Records& records) {
+      for (typename Records::iterator pos = records.begin ();
+	   pos != records.end () && pos->end <= m_sent_bytes;
+	   ++pos) {
+	if (pos->ns == 0) {
+	  pos->ns = monotonic_ns ();
+	}
+      }
+    }
+
+    void add_credit (const channel_credit_t& credit) {
+      m_credited = true;
+      m_granted_items += credit.items;
+      m_granted_bytes += credit.bytes;
+    }
+
+    // Whether an update may be encoded now.  Not while the last one waits for room in the channel.
+    bool may_queue_update () const {
+      return !m_credited || (m_sendq.empty () && has_credit ());
+    }
+
+    // The client can take an update but there is nothing to send.
+    bool wants_frame () const {
+      return (m_outstanding_requests != 0 || (m_continuous && m_fences.size () < CONTINUOUS_WINDOW)) &&
+	may_queue_update () &&
+	!send_framebuffer_update_precondition ();
+    }
+
+    bool send_framebuffer_update_precondition () const {
+      if (!may_queue_update ()) {
+	return false;
+      }
+      if (m_outstanding_requests != 0 &&
+	  (!m_request_incremental ||
+	   m_has_motion ||
+	   m_cursor_pending ||
+	   damaged (m_request_x0, m_request_y0, m_request_x1 - m_request_x0, m_request_y1 - m_request_y0))) {
+	return true;
+      }
+      // Continuous updates act like a standing incremental request while the window is open.
+      return m_continuous &&
+	m_fences.size () < CONTINUOUS_WINDOW &&
+	(m_has_motion ||
+	 m_cursor_pending ||
+	 damaged (m_continuous_x, m_continuous_y, m_continuous_width, m_continuous_height));
+    }
+
+    // Analyze and encode tiles in parallel and add them to the update in order.
+    // Tiles already analyzed or encoded by another session are taken from the cache.
+    void encode_tiles (rfb::framebuffer_update_t& update,
+		       const std::vector<tile_t*>& tiles) {
+      rfb::tile_cache& cache = m_server.m_tile_cache;
+
+      std::vector<encoder_pool::task*> tasks;
+      for (std::vector<tile_t*>::const_iterator pos = tiles.begin ();
+	   pos != tiles.end ();
+	   ++pos) {
+	tile_t* tile = *pos;
+	// Tiles with the cursor drawn in are particular to this session and are not cached.
+	if (!tile->composited.empty () ||
+	    !cache.find_statistics (tile->x_position, tile->y_position, tile->width, tile->height, tile->stats)) {
+	  tasks.push_back (tile);
+	}
+      }
+      m_server.m_encoder_pool.run (tasks);
+      for (std::vector<encoder_pool::task*>::const_iterator pos = tasks.begin ();
+	   pos != tasks.end ();
+	   ++pos) {
+	const tile_t* tile = static_cast<tile_t*> (*pos);
+	if (tile->composited.empty ()) {
+	  cache.insert_statistics (tile->x_position, tile->y_position, tile->width, tile->height, tile->stats);
+	}
+      }
+
+      // Choose encodings.
+      tasks.clear ();
+      for (std::vector<tile_t*>::const_iterator pos = tiles.begin ();
+	   pos != tiles.end ();
+	   ++pos) {
+	tile_t* tile = *pos;
+	if (m_cached_tiles && tile->stats.pixels () <= rfb::CONTENT_CACHE_MAX_PIXELS) {
+	  // The client's cache is updated in rectangle order so this must be too.
+	  if (m_content_cache.lookup (tile->stats.hash, tile->slot)) {
+	    tile->encoding = rfb::CACHED_TILE;
+	    continue;
+	  }
+	  m_content_cache.insert (tile->stats.hash);
+	}
+	tile->encoding = m_encoder_selector.select (m_client_encodings, tile->stats, m_client_format);
+	tile->phase = tile_t::ENCODE;
+	tile->cache_hit = tile->composited.empty () &&
+	  cache.find (tile->x_position, tile->y_position, tile->width, tile->height, m_client_format, tile->encoding, tile->encoded);
+	if (!tile->cache_hit) {
+	  tasks.push_back (tile);
+	}
+      }
+
+      m_server.m_encoder_pool.run (tasks);
+
+      for (std::vector<encoder_pool::task*>::const_iterator pos = tasks.begin ();
+	   pos != tasks.end ();
+	   ++pos) {
+	tile_t* tile = static_cast<tile_t*> (*pos);
+	if (tile->composited.empty ()) {
+	  tile->encoded = cache.insert (tile->x_position, tile->y_position, tile->width, tile->height, m_client_format, tile->encoding, tile->data);
+	}
+	else {
+	  tile->encoded = rfb::encoded_pixel_data_t::take (tile->data);
+	}
+      }
+
+      // The zlib stream is shared so compression happens in order.
+      for (std::vector<tile_t*>::const_iterator pos = tiles.begin ();
+	   pos != tiles.end ();
+	   ++pos) {
+	tile_t* tile = *pos;
+	if (tile->encoding == rfb::CACHED_TILE) {
+	  std::vector<uint8_t> slot (4);
+	  slot[0] = tile->slot >> 24;
+	  slot[1] = tile->slot >> 16;
+	  slot[2] = tile->slot >> 8;
+	  slot[3] = tile->slot;
+	  ++m_cached_tile_count;
+	  update.add_rectangle (rfb::rectangle_t (tile->x_position,
+						  tile->y_position,
+						  tile->width,
+						  tile->height,
+						  new rfb::encoded_pixel_data_t (tile->encoding, slot)));
+	  continue;
+	}
+	rfb::tile_cache::data_ptr data = tile->encoded;
+	if (tile->encoding == rfb::ZRLE) {
+	  const uint64_t start = monotonic_ns ();
+	  std::vector<uint8_t> compressed;
+	  m_zrle_encoder.compress (*tile->encoded, compressed);
+	  data = rfb::encoded_pixel_data_t::take (compressed);
+	  tile->encode_ns += monotonic_ns () - start;
+	}
+	// A cache hit says nothing about the cost of encoding.
+	m_encoder_selector.record_encoding (tile->encoding, tile->stats, m_client_format, data->size (), tile->cache_hit ? 0 : tile->encode_ns);
+	update.add_rectangle (rfb::rectangle_t (tile->x_position,
+						tile->y_position,
+						tile->width,
+						tile->height,
+						new rfb::encoded_pixel_data_t (tile->encoding, data)));
+      }
+    }
+
+    // Add the cursor shape to the update.  The image is in the client's pixel format and is followed by the mask.
+    void send_cursor (rfb::framebuffer_update_t& update) {
+      const size_t row_bytes = CURSOR_WIDTH * m_translator.bytes_per_pixel ();
+      std::vector<uint32_t> translated (CURSOR_WIDTH);
+      std::vector<uint8_t> data (CURSOR_HEIGHT * row_bytes);
+      for (uint16_t y = 0; y != CURSOR_HEIGHT; ++y) {
+	m_translator.translate (&m_server.m_cursor_pixels[y * CURSOR_WIDTH].val, &translated[0], CURSOR_WIDTH);
+	m_translator.pack (&translated[0], &data[y * row_bytes], CURSOR_WIDTH);
+      }
+      data.insert (data.end (), m_server.m_cursor_mask.begin (), m_server.m_cursor_mask.end ());
+      // The hotspot is the top left corner.
+      update.add_rectangle (rfb::rectangle_t (0, 0, CURSOR_WIDTH, CURSOR_HEIGHT, new rfb::encoded_pixel_data_t (rfb::CURSOR, data)));
+      m_cursor_pending = false;
+    }
+
+    void send_framebuffer_update () {
+      std::cout << "server: " << __func__ << " session = " << m_id << std::endl;
+      const size_t requested = m_outstanding_requests;
+      if (m_continuous && m_fences.size () < CONTINUOUS_WINDOW) {
+	add_request (true, m_continuous_x, m_continuous_y, m_continuous_width, m_continuous_height);
+      }
+
+      rfb::framebuffer_update_t update;
+      const uint16_t x0 = m_request_x0;
+      const uint16_t y0 = m_request_y0;
+      const uint16_t x1 = m_request_x1;
+      const uint16_t y1 = m_request_y1;
+
+      if (m_has_motion &&
+	  (!m_request_incremental ||
+	   m_motion.x_position < x0 ||
+	   m_motion.y_position < y0 ||
+	   m_motion.x_position + m_motion.width > x1 ||
+	   m_motion.y_position + m_motion.height > y1)) {
+	drop_motion ();
+      }
+
+      if (m_has_motion) {
+	// The CopyRect comes first so its source is intact.
+	update.add_rectangle (rfb::rectangle_t (m_motion.x_position,
+						m_motion.y_position,
+						m_motion.width,
+						m_motion.height,
+						new rfb::copy_rect_t (m_motion.src_x_position, m_motion.src_y_position)));
+	m_has_motion = false;
+      }
+
+      if (m_cursor_pending) {
+	send_cursor (update);
+      }
+
+      // Damaged tiles clipped to the request.
+      std::vector<tile_t*> tiles;
+      for (uint16_t ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ++ty) {
+	const uint16_t ty0 = std::max (y0, uint16_t (ty * TILE_SIZE));
+	const uint16_t ty1 = std::min (y1, std::min (m_server.HEIGHT, uint16_t ((ty + 1) * TILE_SIZE)));
+	for (uint16_t tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; ++tx) {
+	  const size_t tile = ty * m_server.TILES_X + tx;
+	  if (m_request_incremental && !m_damage[tile]) {
+	    continue;
+	  }
+	  const uint16_t tx0 = std::max (x0, uint16_t (tx * TILE_SIZE));
+	  const uint16_t tx1 = std::min (x1, std::min (m_server.WIDTH, uint16_t ((tx + 1) * TILE_SIZE)));
+	  tiles.push_back (new tile_t (*this, tx0, ty0, tx1 - tx0, ty1 - ty0));
+	  if (!m_cursor_shape) {
+	    m_server.composite_cursor (*tiles.back ());
+	  }
+	  if (tx0 == tx * TILE_SIZE && tx1 == std::min (m_server.WIDTH, uint16_t ((tx + 1) * TILE_SIZE)) &&
+	      ty0 == ty * TILE_SIZE && ty1 == std::min (m_server.HEIGHT, uint16_t ((ty + 1) * TILE_SIZE))) {
+	    // The whole tile was sent.
+	    clear_damage (tile);
+	  }
+	}
+      }
+
+      encode_tiles (update, tiles);
+      for (std::vector<tile_t*>::const_iterator pos = tiles.begin ();
+	   pos != tiles.end ();
+	   ++pos) {
+	delete *pos;
+      }
+
+      if (update.rectangles.empty ()) {
+	// Nothing in the requested region.  Keep the client's request until something is.
+	m_outstanding_requests = requested;
+	return;
+      }
+
+      ioa::buffer* buf = new ioa::buffer ();
+      update.write_to_buffer (*buf);
+      const size_t bytes = buf->size ();
+      push (buf);
+
+      if (m_fence) {
+	// The response tells us when the client has processed the update.
+	fence_record_t record;
+	record.bytes = bytes;
+	record.end = m_queued_bytes;
+	record.ns = 0;
+	record.sequence = m_fence_sequence++;
+	m_fences.push_back (record);
+	std::vector<uint8_t> payload (4);
+	payload[0] = record.sequence >> 24;
+	payload[1] = record.sequence >> 16;
+	payload[2] = record.sequence >> 8;
+	payload[3] = record.sequence;
+	send_fence (rfb::FENCE_REQUEST | rfb::FENCE_BLOCK_BEFORE, payload);
+      }
+      else {
+	// The next request tells us.
+	transmission_t t;
+	t.bytes = bytes;
+	t.end = m_queued_bytes;
+	t.ns = 0;
+	m_unacknowledged.push_back (t);
+      }
+
+      if (++m_update_count % STATISTICS_INTERVAL == 0) {
+	std::cout << "server: session " << m_id << " ";
+	m_encoder_selector.print (std::cout);
+	std::cout << "server: tile cache hits = " << m_server.m_tile_cache.hits () << " misses = " << m_server.m_tile_cache.misses () << " cached tiles sent = " << m_cached_tile_count << " rtt_ns = " << m_rtt_ns << std::endl;
+      }
+
+      // One request is answered.  The client now has everything in the region.
+      m_outstanding_requests = requested != 0 ? requested - 1 : 0;
+      m_request_incremental = true;
+    }
+  };
+
+  const rfb::protocol_version_t HIGHEST_VERSION;
+  const rfb::pixel_format_t PIXEL_FORMAT;
+  const uint16_t WIDTH;
+  const uint16_t HEIGHT;
+  // The static constants have no definition outside the class so they may only be used as values.
+  // (Cast them before passing them by reference, to std::min for example.)
+  static const uint16_t TILE_SIZE = 64;
+  const uint16_t TILES_X;
+  const uint16_t TILES_Y;
+  // Print encoder statistics every so many updates.
+  static const size_t STATISTICS_INTERVAL = 100;
+  // Continuous updates sent ahead of the client's fence responses.
+  static const size_t CONTINUOUS_WINDOW = 2;
+  static const uint16_t CURSOR_WIDTH = 8;
+  static const uint16_t CURSOR_HEIGHT = 12;
+  const rfb::server_init_t SERVER_INIT;
+  std::set<int32_t> m_supported_encodings;
+  std::vector<session_t*> m_sessions;
+  std::vector<rgb_t> m_data;
+  // The image before the last change.  Used to find damage and moves.
+  std::vector<rgb_t> m_prev_data;
+  // Incremented whenever the image changes.
+  uint64_t m_generation;
+  rfb::motion_detector m_motion_detector;
+  encoder_pool m_encoder_pool;
+  rfb::tile_cache m_tile_cache;
+  // The cursor is not part of the framebuffer so moving it does not damage clients that draw it themselves.
+  rgb_t m_cursor_pixels[CURSOR_WIDTH * CURSOR_HEIGHT];
+  // One bit per pixel, most significant bit first, set where the cursor is opaque.
+  std::vector<uint8_t> m_cursor_mask;
+  // The position of the hotspot.
+  uint16_t m_cursor_x;
+  uint16_t m_cursor_y;
+  // Owned.
+  rfb::frame_source* m_frame_source;
+  // Zero for no limit.
+  const uint64_t m_frame_interval_ns;
+  // When the next frame may be produced.
+  uint64_t m_next_frame_ns;
+  // The frame interval has passed.
+  bool m_frame_due;
+
+public:
+  // Takes ownership of source.  The default is noise.
+  rfb_server_automaton (const size_t sessions = 1,
+			const unsigned int frames_per_second = 30,
+			rfb::frame_source* source = 0,
+			const uint16_t width = 240,
+			const uint16_t height = 160) :
+    HIGHEST_VERSION (rfb::PROTOCOL_VERSION_3_3),
+    PIXEL_FORMAT (32, 24, ntohl (1) == 1, true, 255, 255, 255, 16, 8, 0),
+    WIDTH (width),
+    HEIGHT (height),
+    TILES_X ((WIDTH + TILE_SIZE - 1) / TILE_SIZE),
+    TILES_Y ((HEIGHT + TILE_SIZE - 1) / TILE_SIZE),
+    SERVER_INIT (WIDTH, HEIGHT, PIXEL_FORMAT, "This is an RFB server."),
+    m_data (size_t (WIDTH) * HEIGHT),
+    m_prev_data (size_t (WIDTH) * HEIGHT),
+    m_generation (0),
+    m_cursor_x (WIDTH / 2),
+    m_cursor_y (HEIGHT / 2),
+    m_frame_source (source != 0 ? source : new rfb::noise_frame_source ()),
+    m_frame_interval_ns (frames_per_second != 0 ? 1000000000ULL / frames_per_second : 0),
+    m_next_frame_ns (0),
+    m_frame_due (true)
+  {
+    std::cout << "server: big_endian = " << int (PIXEL_FORMAT.big_endian_flag) << std::endl;
+
+    m_supported_encodings.insert (rfb::RAW);
+    m_supported_encodings.insert (rfb::COPY_RECT);
+    m_supported_encodings.insert (rfb::ZRLE);
+    m_supported_encodings.insert (rfb::CACHED_TILE);
+    m_supported_encodings.insert (rfb::FENCE);
+    m_supported_encodings.insert (rfb::CONTINUOUS_UPDATES);
+    m_supported_encodings.insert (rfb::CURSOR);
+
+    rgb_t color;
+    const uint8_t red = 0x00; //0x12;
+    const uint8_t green = 0x00; //0x34;
+    const uint8_t blue = 0x00; //0x56;
+    if (PIXEL_FORMAT.big_endian_flag) {
+      color.big_endian.red = red;
+      color.big_endian.green = green;
+      color.big_endian.blue = blue;
+    }
+    else {
+      color.little_endian.red = red;
+      color.little_endian.green = green;
+      color.little_endian.blue = blue;
+    }
+
+    m_data.assign (m_data.size (), color);
+    m_prev_data = m_data;
+
+    // A white arrow with a black outline.  PIXEL_FORMAT puts red, green, and blue in the low 24 bits.
+    const size_t mask_row = (CURSOR_WIDTH + 7) / 8;
+    m_cursor_mask.assign (mask_row * CURSOR_HEIGHT, 0);
+    for (uint16_t y = 0; y != CURSOR_HEIGHT; ++y) {
+      for (uint16_t x = 0; x != CURSOR_WIDTH; ++x) {
+	const bool edge = x == 0 || (x + 1) * CURSOR_HEIGHT > y * CURSOR_WIDTH || y == CURSOR_HEIGHT - 1;
+	m_cursor_pixels[y * CURSOR_WIDTH + x].val = edge ? 0x00000000 : 0x00FFFFFF;
+	if (x * CURSOR_HEIGHT <= y * CURSOR_WIDTH) {
+	  m_cursor_mask[y * mask_row + x / 8] |= 0x80 >> (x % 8);
+	}
+      }
+    }
+
+    for (size_t id = 0; id != sessions; ++id) {
+      m_sessions.push_back (new session_t (*this, id));
+      m_sessions.back ()->send_protocol_version ();
+    }
+
+    schedule ();
+  }
+
+  ~rfb_server_automaton () {
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      delete *pos;
+    }
+    delete m_frame_source;
+  }
+
+private:
+  void schedule () const {
+    if (send_framebuffer_update_precondition ()) {
+      ioa::schedule (&rfb_server_automaton::send_framebuffer_update);
+    }
+    for (size_t id = 0; id != m_sessions.size (); ++id) {
+      if (send_precondition (id)) {
+	ioa::schedule (&rfb_server_automaton::send, int (id));
+      }
+    }
+    if (update_image_precondition ()) {
+      ioa::schedule (&rfb_server_automaton::update_image);
+    }
+  }
+
+  session_t* get_session (const int id) const {
+    if (id < 0 || size_t (id) >= m_sessions.size ()) {
+      return 0;
+    }
+    return m_sessions[id];
+  }
+
+  // True if (x, y, width, height) differs from the previous frame.
+  // Inside the moved band, pixels are compared to the source of the move instead.
+  bool tile_changed (const uint16_t x,
+		     const uint16_t y,
+		     const uint16_t width,
+		     const uint16_t height,
+		     const rfb::motion_t* motion) const {
+    for (uint16_t r = y; r != y + height; ++r) {
+      const size_t row = r * WIDTH;
+      // [a, b) is the part of the row inside the moved band.
+      uint16_t a = x;
+      uint16_t b = x;
+      if (motion != 0 && r >= motion->y_position && r < motion->y_position + motion->height) {
+	a = std::max (x, motion->x_position);
+	b = std::min (x + width, motion->x_position + motion->width);
+	if (a >= b) {
+	  a = b = x;
+	}
+      }
+      if (memcmp (&m_data[row + x], &m_prev_data[row + x], (a - x) * sizeof (rgb_t)) != 0) {
+	return true;
+      }
+      if (a != b) {
+	const size_t src = (r - motion->y_position + motion->src_y_position) * WIDTH + a - motion->x_position + motion->src_x_position;
+	if (memcmp (&m_data[row + a], &m_prev_data[src], (b - a) * sizeof (rgb_t)) != 0) {
+	  return true;
+	}
+      }
+      if (memcmp (&m_data[row + b], &m_prev_data[row + b], (x + width - b) * sizeof (rgb_t)) != 0) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  // The part of the framebuffer covered by the cursor.
+  void cursor_rect (uint16_t& x,
+		    uint16_t& y,
+		    uint16_t& width,
+		    uint16_t& height) const {
+    x = m_cursor_x;
+    y = m_cursor_y;
+    width = std::min (uint16_t (CURSOR_WIDTH), uint16_t (WIDTH - x));
+    height = std::min (uint16_t (CURSOR_HEIGHT), uint16_t (HEIGHT - y));
+  }
+
+  // Draw the cursor over a copy of the tile if it covers any of it.
+  void composite_cursor (tile_t& tile) const {
+    uint16_t x, y, width, height;
+    cursor_rect (x, y, width, height);
+    const int x0 = std::max (x, tile.x_position);
+    const int y0 = std::max (y, tile.y_position);
+    const int x1 = std::min (x + width, tile.x_position + tile.width);
+    const int y1 = std::min (y + height, tile.y_position + tile.height);
+    if (x0 >= x1 || y0 >= y1) {
+      return;
+    }
+
+    tile.composited.resize (tile.width * tile.height);
+    for (uint16_t r = 0; r != tile.height; ++r) {
+      memcpy (&tile.composited[r * tile.width], &m_data[(tile.y_position + r) * WIDTH + tile.x_position], tile.width * sizeof (rgb_t));
+    }
+    const size_t mask_row = (CURSOR_WIDTH + 7) / 8;
+    for (int py = y0; py != y1; ++py) {
+      const uint16_t cy = py - y;
+      for (int px = x0; px != x1; ++px) {
+	const uint16_t cx = px - x;
+	if (m_cursor_mask[cy * mask_row + cx / 8] & (0x80 >> (cx % 8))) {
+	  tile.composited[(py - tile.y_position) * tile.width + px - tile.x_position] = m_cursor_pixels[cy * CURSOR_WIDTH + cx].val;
+	}
+      }
+    }
+  }
+
+  // Move the cursor.  Only sessions that cannot draw the cursor are damaged.
+  void move_cursor (const uint16_t x,
+		    const uint16_t y) {
+    const uint16_t new_x = std::min (x, uint16_t (WIDTH - 1));
+    const uint16_t new_y = std::min (y, uint16_t (HEIGHT - 1));
+    if (new_x == m_cursor_x && new_y == m_cursor_y) {
+      return;
+    }
+
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      if (!(*pos)->m_cursor_shape) {
+	(*pos)->damage_cursor ();
+      }
+    }
+    m_cursor_x = new_x;
+    m_cursor_y = new_y;
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      if (!(*pos)->m_cursor_shape) {
+	(*pos)->damage_cursor ();
+      }
+    }
+  }
+
+  // Find what changed since the previous frame and fan it out to the sessions.
+  // Tiles outside hint are not compared.
+  void publish_damage (const rfb::damage_region& hint) {
+    bool copy_rect = false;
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      copy_rect = copy_rect || (*pos)->m_copy_rect;
+    }
+
+    // The source does not promise to stay inside the framebuffer.
+    std::vector<rfb::damage_rect_t> rects;
+    uint16_t x0 = WIDTH;
+    uint16_t y0 = HEIGHT;
+    uint16_t x1 = 0;
+    uint16_t y1 = 0;
+    for (std::vector<rfb::damage_rect_t>::const_iterator pos = hint.rects ().begin ();
+	 pos != hint.rects ().end ();
+	 ++pos) {
+      const rfb::damage_rect_t r = pos->clip (WIDTH, HEIGHT);
+      if (!r.empty ()) {
+	rects.push_back (r);
+	x0 = std::min (x0, r.x_position);
+	y0 = std::min (y0, r.y_position);
+	x1 = std::max (x1, uint16_t (r.x_position + r.width));
+	y1 = std::max (y1, uint16_t (r.y_position + r.height));
+      }
+    }
+
+    // Nothing outside the bounding box of the hint changed so a move is inside it.
+    rfb::motion_t motion;
+    const bool moved = copy_rect && !rects.empty () && m_motion_detector.detect (&m_prev_data[0].val, &m_data[0].val, WIDTH, x0, y0, x1 - x0, y1 - y0, motion);
+
+    std::vector<bool> hinted (TILES_X * TILES_Y);
+    for (std::vector<rfb::damage_rect_t>::const_iterator pos = rects.begin ();
+	 pos != rects.end ();
+	 ++pos) {
+      const uint16_t tx1 = std::min (TILES_X, uint16_t ((pos->x_position + pos->width + TILE_SIZE - 1) / TILE_SIZE));
+      const uint16_t ty1 = std::min (TILES_Y, uint16_t ((pos->y_position + pos->height + TILE_SIZE - 1) / TILE_SIZE));
+      for (uint16_t ty = pos->y_position / TILE_SIZE; ty < ty1; ++ty) {
+	for (uint16_t tx = pos->x_position / TILE_SIZE; tx < tx1; ++tx) {
+	  hinted[ty * TILES_X + tx] = true;
+	}
+      }
+    }
+
+    std::vector<bool> damage (TILES_X * TILES_Y);
+    std::vector<bool> moved_damage (moved ? damage.size () : 0);
+    // Tiles outside the bounding box are unchanged with or without the move.
+    for (uint16_t ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ++ty) {
+      const uint16_t y = ty * TILE_SIZE;
+      const uint16_t h = std::min (uint16_t (TILE_SIZE), uint16_t (HEIGHT - y));
+      for (uint16_t tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; ++tx) {
+	const uint16_t x = tx * TILE_SIZE;
+	const uint16_t w = std::min (uint16_t (TILE_SIZE), uint16_t (WIDTH - x));
+	damage[ty * TILES_X + tx] = hinted[ty * TILES_X + tx] && tile_changed (x, y, w, h, 0);
+	// A move can put different pixels in a tile the source did not touch.
+	if (moved) {
+	  moved_damage[ty * TILES_X + tx] = tile_changed (x, y, w, h, &motion);
+	}
+      }
+    }
+
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      (*pos)->add_damage (damage, moved ? &motion : 0, moved_damage);
+    }
+
+    for (std::vector<rfb::damage_rect_t>::const_iterator pos = rects.begin ();
+	 pos != rects.end ();
+	 ++pos) {
+      for (uint16_t y = pos->y_position; y != pos->y_position + pos->height; ++y) {
+	memcpy (&m_prev_data[y * WIDTH + pos->x_position], &m_data[y * WIDTH + pos->x_position], pos->width * sizeof (rgb_t));
+      }
+    }
+    m_tile_cache.set_generation (++m_generation);
+  }
+
+  // Send FramebufferUpdate messages to every session that has a request and something to send.
+  bool send_framebuffer_update_precondition () const {
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      if ((*pos)->send_framebuffer_update_precondition ()) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void send_framebuffer_update_effect () {
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      if ((*pos)->send_framebuffer_update_precondition ()) {
+	(*pos)->send_framebuffer_update ();
+      }
+    }
+  }
+
+  UP_INTERNAL (rfb_server_automaton, send_framebuffer_update);
+
+  // Send a message.
+  bool send_precondition (int id) const {
+    session_t* session = get_session (id);
+    return session != 0 && !session->m_sendq.empty () && session->has_credit () && ioa::binding_count (&rfb_server_automaton::send, id) != 0;
+  }
+
+  ioa::const_shared_ptr<ioa::buffer_interface> send_effect (int id) {
+    session_t* session = get_session (id);
+    ioa::const_shared_ptr<ioa::buffer_interface> retval = session->m_sendq.front ();
+    session->m_sendq.pop ();
+    session->sent (*retval);
+    return retval;
+  }
+
+public:
+  V_P_OUTPUT (rfb_server_automaton, send, ioa::const_shared_ptr<ioa::buffer_interface>, int);
+
+private:
+
+  // Input is applied as it arrives so the next update encoded for any session reflects it.
+  void receive_effect (const ioa::const_shared_ptr<ioa::buffer_interface>& val,
+		       int id) {
+    session_t* session = get_session (id);
+    if (session != 0 && val.get () != 0) {
+      rgram::buffer rbuf (*val.get ());
+      session->m_protocol.put (rbuf);
+    }
+  }
+
+public:
+  V_P_INPUT (rfb_server_automaton, receive, ioa::const_shared_ptr<ioa::buffer_interface>, int);
+
+private:
+  void receive_batch_effect (const ioa::const_shared_ptr<rgram::buffer_chain>& val,
+			     int id) {
+    session_t* session = get_session (id);
+    if (session != 0 && val.get () != 0) {
+      rgram::buffer rbuf (*val.get ());
+      session->m_protocol.put (rbuf);
+    }
+  }
+
+public:
+  V_P_INPUT (rfb_server_automaton, receive_batch, ioa::const_shared_ptr<rgram::buffer_chain>, int);
+
+private:
+  void credit_effect (const channel_credit_t& credit,
+		      int id) {
+    session_t* session = get_session (id);
+    if (session != 0) {
+      session->add_credit (credit);
+    }
+  }
+
+public:
+  V_P_INPUT (rfb_server_automaton, credit, channel_credit_t, int);
+
+private:
+  // Some client is waiting for a new frame.
+  bool frame_wanted () const {
+    for (std::vector<session_t*>::const_iterator pos = m_sessions.begin ();
+	 pos != m_sessions.end ();
+	 ++pos) {
+      if ((*pos)->wants_frame ()) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  bool update_image_precondition () const {
+    return m_frame_due && frame_wanted ();
+  }
+
+  void update_image_effect () {
+    rfb::damage_region damage;
+    m_frame_source->produce (&m_data[0].val, WIDTH, HEIGHT, damage);
+    if (!damage.empty ()) {
+      publish_damage (damage);
+    }
+
+    // Keep the cadence while frames are wanted.  After an idle period start over instead of catching up.
+    const uint64_t now = monotonic_ns ();
+    m_next_frame_ns += m_frame_interval_ns;
+    if (m_next_frame_ns <= now) {
+      m_next_frame_ns = now + m_frame_interval_ns;
+    }
+    const uint64_t delay = m_next_frame_ns - now;
+    m_frame_due = false;
+    ioa::schedule_after (&rfb_server_automaton::frame_timer, ioa::time (delay / 1000000000ULL, (delay / 1000) % 1000000));
+  }
+
+  UP_INTERNAL (rfb_server_automaton, update_image);
+
+  bool frame_timer_precondition () const {
+    return !m_frame_due;
+  }
+
+  void frame_timer_effect () {
+    m_frame_due = true;
+  }
+
+  UP_INTERNAL (rfb_server_automaton, frame_timer);
+
+};
+
+#endif
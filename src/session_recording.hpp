@@ -0,0 +1,294 @@
+#ifndef __session_recording_hpp__
+#define __session_recording_hpp__
+
+#include "monotonic_clock.hpp"
+
+#include <ioa/buffer.hpp>
+#include <ioa/shared_ptr.hpp>
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+  A file of the messages exchanged by an RFB server and client, laid out to be replayed from a memory mapping.
+
+  The first page holds the 8 bytes "RFBREC\0\2".
+  The rest is segments that each start on a page boundary.
+  A segment is one page of index followed by the payloads of the messages it indexes, packed end to end.
+  An index entry is
+
+    uint64_t  file offset of the payload
+    uint64_t  nanoseconds since recording started
+    uint32_t  length
+    uint8_t   direction
+    uint8_t   1 if the entry is in use
+    2 bytes of padding
+
+  Integers are big-endian.
+  A segment ends when its index is full or its payloads pass SEGMENT_SIZE and the next starts on the first page boundary after its last payload.
+  Each message is written before its index entry so a recording cut short by a crash is readable up to the last whole message.
+
+  Reading maps the file and hands out buffers that point into the mapping so nothing is copied.
+*/
+
+namespace rfb {
+
+  enum recording_direction_t {
+    SERVER_TO_CLIENT = 0,
+    CLIENT_TO_SERVER = 1
+  };
+
+  const char RECORDING_MAGIC[8] = { 'R', 'F', 'B', 'R', 'E', 'C', 0, 2 };
+  const size_t RECORDING_PAGE_SIZE = 4096;
+  const size_t INDEX_ENTRY_SIZE = 24;
+  const size_t INDEX_ENTRIES = RECORDING_PAGE_SIZE / INDEX_ENTRY_SIZE;
+  // Payload bytes after which a segment takes no more messages.
+  const size_t SEGMENT_SIZE = 1024 * 1024;
+
+  inline uint64_t recording_round_up (const uint64_t offset) {
+    return (offset + RECORDING_PAGE_SIZE - 1) / RECORDING_PAGE_SIZE * RECORDING_PAGE_SIZE;
+  }
+
+  inline void recording_put (uint8_t* p,
+			     const uint64_t value,
+			     const size_t bytes) {
+    for (size_t i = 0; i != bytes; ++i) {
+      p[i] = value >> (8 * (bytes - 1 - i));
+    }
+  }
+
+  inline uint64_t recording_get (const uint8_t* p,
+				 const size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i != bytes; ++i) {
+      value = (value << 8) | p[i];
+    }
+    return value;
+  }
+
+  class recording_writer
+  {
+  private:
+    int m_fd;
+    uint64_t m_start_ns;
+    // The index page of the current segment and the number of entries in it.
+    uint64_t m_index;
+    size_t m_entries;
+    // Where the next payload goes.
+    uint64_t m_end;
+
+    void write_at (const void* data,
+		   const size_t size,
+		   const uint64_t offset) {
+      size_t done = 0;
+      while (done != size) {
+	const ssize_t n = pwrite (m_fd, static_cast<const uint8_t*> (data) + done, size - done, offset + done);
+	if (n < 0) {
+	  perror ("pwrite");
+	  exit (EXIT_FAILURE);
+	}
+	done += n;
+      }
+    }
+
+  public:
+    recording_writer (const std::string& path) :
+      m_start_ns (monotonic_ns ()),
+      m_index (RECORDING_PAGE_SIZE),
+      m_entries (0),
+      m_end (2 * RECORDING_PAGE_SIZE)
+    {
+      m_fd = open (path.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (m_fd == -1) {
+	perror ("open");
+	exit (EXIT_FAILURE);
+      }
+      write_at (RECORDING_MAGIC, sizeof (RECORDING_MAGIC), 0);
+    }
+
+    ~recording_writer () {
+      close (m_fd);
+    }
+
+    void write (const recording_direction_t direction,
+		const ioa::buffer_interface& buf) {
+      const size_t size = buf.size ();
+      if (m_entries == INDEX_ENTRIES ||
+	  (m_entries != 0 && m_end + size - (m_index + RECORDING_PAGE_SIZE) > SEGMENT_SIZE)) {
+	m_index = recording_round_up (m_end);
+	m_entries = 0;
+	m_end = m_index + RECORDING_PAGE_SIZE;
+      }
+
+      write_at (buf.data (), size, m_end);
+
+      uint8_t entry[INDEX_ENTRY_SIZE];
+      memset (entry, 0, sizeof (entry));
+      recording_put (entry, m_end, 8);
+      recording_put (entry + 8, monotonic_ns () - m_start_ns, 8);
+      recording_put (entry + 16, size, 4);
+      entry[20] = direction;
+      entry[21] = 1;
+      write_at (entry, sizeof (entry), m_index + m_entries * INDEX_ENTRY_SIZE);
+
+      m_end += size;
+      ++m_entries;
+    }
+  };
+
+  // A read-only mapping of a whole file.
+  class recording_mapping
+  {
+  private:
+    const uint8_t* m_data;
+    size_t m_size;
+
+    recording_mapping (const recording_mapping&);
+    recording_mapping& operator= (const recording_mapping&);
+
+  public:
+    recording_mapping (const std::string& path) :
+      m_data (0),
+      m_size (0)
+    {
+      const int fd = open (path.c_str (), O_RDONLY);
+      if (fd == -1) {
+	perror ("open");
+	exit (EXIT_FAILURE);
+      }
+      struct stat st;
+      if (fstat (fd, &st) == -1) {
+	perror ("fstat");
+	exit (EXIT_FAILURE);
+      }
+      m_size = st.st_size;
+      if (m_size != 0) {
+	void* data = mmap (0, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+	  perror ("mmap");
+	  exit (EXIT_FAILURE);
+	}
+	// Replay reads front to back.
+	madvise (data, m_size, MADV_SEQUENTIAL);
+	m_data = static_cast<const uint8_t*> (data);
+      }
+      close (fd);
+    }
+
+    ~recording_mapping () {
+      if (m_data != 0) {
+	munmap (const_cast<uint8_t*> (m_data), m_size);
+      }
+    }
+
+    const uint8_t* data () const {
+      return m_data;
+    }
+
+    size_t size () const {
+      return m_size;
+    }
+  };
+
+  // A message in the mapping.  Keeps the mapping alive.
+  class recording_view :
+    public ioa::buffer_interface
+  {
+  private:
+    ioa::shared_ptr<recording_mapping> m_mapping;
+    const void* m_data;
+    size_t m_size;
+
+  public:
+    recording_view (const ioa::shared_ptr<recording_mapping>& mapping,
+		    const uint64_t offset,
+		    const size_t size) :
+      m_mapping (mapping),
+      m_data (mapping->data () + offset),
+      m_size (size)
+    { }
+
+    const void* data () const {
+      return m_data;
+    }
+
+    size_t size () const {
+      return m_size;
+    }
+  };
+
+  struct recorded_message_t
+  {
+    uint64_t ns;
+    recording_direction_t direction;
+    ioa::const_shared_ptr<ioa::buffer_interface> buffer;
+  };
+
+  class recording_reader
+  {
+  private:
+    ioa::shared_ptr<recording_mapping> m_mapping;
+    // The index page of the current segment and the next entry to read from it.
+    uint64_t m_index;
+    size_t m_entry;
+    // The end of the last payload read.
+    uint64_t m_end;
+
+  public:
+    recording_reader (const std::string& path) :
+      m_mapping (new recording_mapping (path)),
+      m_index (RECORDING_PAGE_SIZE),
+      m_entry (0),
+      m_end (2 * RECORDING_PAGE_SIZE)
+    {
+      if (m_mapping->size () < sizeof (RECORDING_MAGIC) ||
+	  memcmp (m_mapping->data (), RECORDING_MAGIC, sizeof (RECORDING_MAGIC)) != 0) {
+	std::cerr << path << " is not an RFB recording" << std::endl;
+	exit (EXIT_FAILURE);
+      }
+    }
+
+    // The next message.  False at the end of the recording or of the last whole message.
+    bool next (recorded_message_t& message) {
+      const uint8_t* data = m_mapping->data ();
+      const size_t size = m_mapping->size ();
+      for (;;) {
+	if (m_entry != INDEX_ENTRIES) {
+	  const uint64_t pos = m_index + m_entry * INDEX_ENTRY_SIZE;
+	  if (pos + INDEX_ENTRY_SIZE <= size && data[pos + 21] != 0) {
+	    const uint64_t offset = recording_get (data + pos, 8);
+	    const uint32_t length = recording_get (data + pos + 16, 4);
+	    if (offset > size || length > size - offset) {
+	      return false;
+	    }
+	    message.ns = recording_get (data + pos + 8, 8);
+	    message.direction = recording_direction_t (data[pos + 20]);
+	    message.buffer = ioa::const_shared_ptr<ioa::buffer_interface> (new recording_view (m_mapping, offset, length));
+	    m_end = offset + length;
+	    ++m_entry;
+	    return true;
+	  }
+	  if (m_entry == 0) {
+	    // Segments are never empty.
+	    return false;
+	  }
+	}
+	// Full or closed early.  The next segment starts after the last payload.
+	m_index = recording_round_up (m_end);
+	m_entry = 0;
+      }
+    }
+  };
+
+}
+
+#endif
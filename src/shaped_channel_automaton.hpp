@@ -0,0 +1,292 @@
+#ifndef __shaped_channel_automaton_hpp__
+#define __shaped_channel_automaton_hpp__
+
+#include "monotonic_clock.hpp"
+
+#include <ioa/ioa.hpp>
+#include <ioa/buffer.hpp>
+
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+/*
+  A channel with the delay, jitter, bandwidth, and segmentation of a real network.
+
+  Buffers are carried either as a byte stream or as datagrams.
+  A stream is split into segments of at most mtu bytes and arrives whole and in order, like TCP.
+  Datagrams are not split and may be lost or, with reorder set, arrive out of order, like UDP.
+
+  Each segment or datagram leaves when a token bucket of burst_bytes filled at bytes_per_second allows.
+  It arrives delay_ns plus a uniform random jitter of up to jitter_ns later.
+  Zero for bytes_per_second or mtu means no limit.
+  The random numbers come from seed so runs can be repeated.
+*/
+
+struct channel_shape_t
+{
+  uint64_t delay_ns;
+  uint64_t jitter_ns;
+  uint64_t bytes_per_second;
+  size_t burst_bytes;
+  size_t mtu;
+  bool datagrams;
+  // The fraction of datagrams lost.
+  double loss;
+  bool reorder;
+  uint32_t seed;
+
+  channel_shape_t () :
+    delay_ns (0),
+    jitter_ns (0),
+    bytes_per_second (0),
+    burst_bytes (64 * 1024),
+    mtu (0),
+    datagrams (false),
+    loss (0),
+    reorder (false),
+    seed (1)
+  { }
+};
+
+// Part of a buffer.  Keeps the buffer alive.
+class buffer_slice :
+  public ioa::buffer_interface
+{
+private:
+  ioa::const_shared_ptr<ioa::buffer_interface> m_buffer;
+  size_t m_offset;
+  size_t m_size;
+
+public:
+  buffer_slice (const ioa::const_shared_ptr<ioa::buffer_interface>& buffer,
+		const size_t offset,
+		const size_t size) :
+    m_buffer (buffer),
+    m_offset (offset),
+    m_size (size)
+  { }
+
+  const void* data () const {
+    return static_cast<const uint8_t*> (m_buffer->data ()) + m_offset;
+  }
+
+  size_t size () const {
+    return m_size;
+  }
+};
+
+// The timing model of the channel without the automaton.  Times are from monotonic_ns.
+class link_shaper
+{
+private:
+  struct packet_t
+  {
+    uint64_t arrival_ns;
+    // Breaks ties so equal arrival times keep their order.
+    uint64_t sequence;
+    ioa::const_shared_ptr<ioa::buffer_interface> buffer;
+
+    packet_t (const uint64_t a,
+	      const uint64_t s,
+	      const ioa::const_shared_ptr<ioa::buffer_interface>& b) :
+      arrival_ns (a),
+      sequence (s),
+      buffer (b)
+    { }
+
+    bool operator< (const packet_t& other) const {
+      // Earliest first out of a max-heap.
+      return arrival_ns != other.arrival_ns ? arrival_ns > other.arrival_ns : sequence > other.sequence;
+    }
+  };
+
+  const channel_shape_t m_shape;
+  uint32_t m_random;
+  // The token bucket as a virtual clock: the time at which the bucket would be full again.
+  uint64_t m_full_ns;
+  uint64_t m_last_arrival_ns;
+  uint64_t m_sequence;
+  std::priority_queue<packet_t> m_packets;
+  size_t m_lost;
+
+  uint32_t random () {
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    return m_random;
+  }
+
+  void transmit (const ioa::const_shared_ptr<ioa::buffer_interface>& buffer,
+		 const uint64_t now) {
+    uint64_t departure = now;
+    if (m_shape.bytes_per_second != 0) {
+      // The bucket holds enough tokens for this packet once it is no more than slack short of full.
+      const size_t size = buffer->size ();
+      const uint64_t slack_ns = (m_shape.burst_bytes > size ? m_shape.burst_bytes - size : 0) * 1000000000ULL / m_shape.bytes_per_second;
+      if (m_full_ns > now + slack_ns) {
+	departure = m_full_ns - slack_ns;
+      }
+      m_full_ns = std::max (m_full_ns, departure) + size * 1000000000ULL / m_shape.bytes_per_second;
+    }
+
+    uint64_t arrival = departure + m_shape.delay_ns;
+    if (m_shape.jitter_ns != 0) {
+      arrival += random () % (m_shape.jitter_ns + 1);
+    }
+    if (!(m_shape.datagrams && m_shape.reorder)) {
+      arrival = std::max (arrival, m_last_arrival_ns);
+    }
+    m_last_arrival_ns = std::max (m_last_arrival_ns, arrival);
+
+    if (m_shape.datagrams && m_shape.loss > 0 && random () < m_shape.loss * 4294967296.0) {
+      // Lost after using the link.
+      ++m_lost;
+      return;
+    }
+
+    m_packets.push (packet_t (arrival, m_sequence++, buffer));
+  }
+
+public:
+  link_shaper (const channel_shape_t& shape) :
+    m_shape (shape),
+    m_random (shape.seed != 0 ? shape.seed : 1),
+    m_full_ns (0),
+    m_last_arrival_ns (0),
+    m_sequence (0),
+    m_lost (0)
+  { }
+
+  void send (const ioa::const_shared_ptr<ioa::buffer_interface>& buffer,
+	     const uint64_t now) {
+    if (buffer.get () == 0 || m_shape.datagrams || m_shape.mtu == 0 || buffer->size () <= m_shape.mtu) {
+      transmit (buffer, now);
+      return;
+    }
+    for (size_t offset = 0; offset < buffer->size (); offset += m_shape.mtu) {
+      transmit (ioa::const_shared_ptr<ioa::buffer_interface> (new buffer_slice (buffer, offset, std::min (m_shape.mtu, buffer->size () - offset))), now);
+    }
+  }
+
+  bool empty () const {
+    return m_packets.empty ();
+  }
+
+  // When the next packet arrives.  Only valid if not empty.
+  uint64_t next_arrival_ns () const {
+    return m_packets.top ().arrival_ns;
+  }
+
+  bool ready (const uint64_t now) const {
+    return !m_packets.empty () && m_packets.top ().arrival_ns <= now;
+  }
+
+  ioa::const_shared_ptr<ioa::buffer_interface> receive () {
+    ioa::const_shared_ptr<ioa::buffer_interface> retval = m_packets.top ().buffer;
+    m_packets.pop ();
+    return retval;
+  }
+
+  // Datagrams lost so far.
+  size_t lost () const {
+    return m_lost;
+  }
+};
+
+// The pending wake up of the channel.  Times are from monotonic_ns.
+class wake_timer
+{
+private:
+  // The arrival the pending wake up is for or zero if there is none.
+  uint64_t m_wake_ns;
+
+public:
+  wake_timer () :
+    m_wake_ns (0)
+  { }
+
+  // Microseconds to wait for a packet arriving at arrival_ns, rounded up so the wake up is never early.
+  // Zero if the packet is due or a pending wake up comes no later.
+  uint64_t arm (const uint64_t arrival_ns,
+		const uint64_t now) {
+    if (m_wake_ns <= now) {
+      // A wake up in the past is not pending even if it has not fired.
+      m_wake_ns = 0;
+    }
+    if (arrival_ns <= now || (m_wake_ns != 0 && m_wake_ns <= arrival_ns)) {
+      return 0;
+    }
+    m_wake_ns = arrival_ns;
+    return (arrival_ns - now + 999) / 1000;
+  }
+
+  void fired () {
+    m_wake_ns = 0;
+  }
+};
+
+class shaped_channel_automaton :
+  public ioa::automaton
+{
+private:
+  link_shaper m_shaper;
+  wake_timer m_wake;
+
+  // Wake up when the next packet arrives unless something already will.
+  void arm () {
+    if (m_shaper.empty ()) {
+      return;
+    }
+    const uint64_t delay = m_wake.arm (m_shaper.next_arrival_ns (), monotonic_ns ());
+    if (delay != 0) {
+      ioa::schedule_after (&shaped_channel_automaton::wake, ioa::time (delay / 1000000, delay % 1000000));
+    }
+  }
+
+  void send_effect (const ioa::const_shared_ptr<ioa::buffer_interface>& val) {
+    m_shaper.send (val, monotonic_ns ());
+    arm ();
+  }
+
+  bool receive_precondition () const {
+    return m_shaper.ready (monotonic_ns ()) && ioa::binding_count (&shaped_channel_automaton::receive) != 0;
+  }
+
+  ioa::const_shared_ptr<ioa::buffer_interface> receive_effect () {
+    ioa::const_shared_ptr<ioa::buffer_interface> retval = m_shaper.receive ();
+    arm ();
+    return retval;
+  }
+
+  bool wake_precondition () const {
+    return true;
+  }
+
+  void wake_effect () {
+    // A wake up that was overtaken by an earlier one may still fire; arming again is harmless.
+    m_wake.fired ();
+    arm ();
+  }
+
+  void schedule () const {
+    if (receive_precondition ()) {
+      ioa::schedule (&shaped_channel_automaton::receive);
+    }
+  }
+
+public:
+  shaped_channel_automaton (const channel_shape_t& shape) :
+    m_shaper (shape)
+  {
+    schedule ();
+  }
+
+  V_UP_INPUT (shaped_channel_automaton, send, ioa::const_shared_ptr<ioa::buffer_interface>);
+  V_UP_OUTPUT (shaped_channel_automaton, receive, ioa::const_shared_ptr<ioa::buffer_interface>);
+
+private:
+  UP_INTERNAL (shaped_channel_automaton, wake);
+};
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef __synthetic_frame_sources_hpp__
+#define __synthetic_frame_sources_hpp__
+
+#include "frame_source.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+/*
+  Frame sources that imitate what a remote desktop shows.
+
+  Each reports exactly the rectangles it drew so a benchmark knows the true damage.
+  They are deterministic so runs can be compared.
+  The first frame, and the first after the size changes, draws everything.
+*/
+
+namespace rfb {
+
+  inline uint32_t synthetic_rgb (const uint8_t red,
+				 const uint8_t green,
+				 const uint8_t blue) {
+    return (uint32_t (red) << 16) | (uint32_t (green) << 8) | blue;
+  }
+
+  class synthetic_frame_source :
+    public frame_source
+  {
+  protected:
+    static const uint16_t GLYPH_WIDTH = 8;
+    static const uint16_t GLYPH_HEIGHT = 12;
+
+    uint16_t m_width;
+    uint16_t m_height;
+    uint32_t m_random;
+    size_t m_frame;
+
+    synthetic_frame_source () :
+      m_width (0),
+      m_height (0),
+      m_random (0x9E3779B9),
+      m_frame (0)
+    { }
+
+    // Xorshift so every run draws the same frames.
+    uint32_t random () {
+      m_random ^= m_random << 13;
+      m_random ^= m_random >> 17;
+      m_random ^= m_random << 5;
+      return m_random;
+    }
+
+    void fill (uint32_t* pixels,
+	       const uint16_t x,
+	       const uint16_t y,
+	       const uint16_t width,
+	       const uint16_t height,
+	       const uint32_t color) const {
+      for (uint16_t r = y; r != y + height; ++r) {
+	std::fill (pixels + r * m_width + x, pixels + r * m_width + x + width, color);
+      }
+    }
+
+    // A line of text-like glyphs.  Cells that do not fit are left alone.
+    void text (uint32_t* pixels,
+	       const uint16_t x,
+	       const uint16_t y,
+	       const uint16_t width,
+	       const uint32_t foreground,
+	       const uint32_t background) {
+      for (uint16_t cx = x; cx + GLYPH_WIDTH <= x + width; cx += GLYPH_WIDTH) {
+	const uint32_t glyph = random ();
+	// One in eight is a space.
+	const bool space = (glyph & 7) == 0;
+	for (uint16_t r = 0; r != GLYPH_HEIGHT; ++r) {
+	  uint32_t* row = pixels + (y + r) * m_width + cx;
+	  for (uint16_t c = 0; c != GLYPH_WIDTH; ++c) {
+	    // Six by eight inside a one pixel margin with a two pixel descender row.
+	    const bool inside = c >= 1 && c < 7 && r >= 2 && r < 10;
+	    const bool on = !space && inside && ((glyph >> (((r - 2) * 6 + c - 1) % 29 + 3)) & 1);
+	    row[c] = on ? foreground : background;
+	  }
+	}
+      }
+    }
+
+    // A desktop with a panel and two windows.
+    void desktop (uint32_t* pixels) {
+      fill (pixels, 0, 0, m_width, m_height, synthetic_rgb (0x3A, 0x6E, 0xA5));
+      const uint16_t panel = std::min (m_height, uint16_t (16));
+      fill (pixels, 0, m_height - panel, m_width, panel, synthetic_rgb (0xC0, 0xC0, 0xC0));
+      window (pixels, m_width / 16, m_height / 16, m_width / 2, m_height / 2);
+      window (pixels, m_width * 3 / 8, m_height / 3, m_width / 2, m_height / 2);
+    }
+
+    // A window with a title bar and text, clipped to the framebuffer.
+    void window (uint32_t* pixels,
+		 const uint16_t x,
+		 const uint16_t y,
+		 const uint16_t width,
+		 const uint16_t height) {
+      const uint16_t w = std::min (width, uint16_t (m_width - x));
+      const uint16_t h = std::min (height, uint16_t (m_height - y));
+      const uint16_t title = std::min (h, uint16_t (GLYPH_HEIGHT + 2));
+      fill (pixels, x, y, w, title, synthetic_rgb (0x00, 0x00, 0x80));
+      fill (pixels, x, y + title, w, h - title, synthetic_rgb (0xFF, 0xFF, 0xFF));
+      for (uint16_t ty = y + title + 2; ty + GLYPH_HEIGHT <= y + h; ty += GLYPH_HEIGHT) {
+	text (pixels, x + 2, ty, std::max (w, uint16_t (4)) - 4, synthetic_rgb (0x00, 0x00, 0x00), synthetic_rgb (0xFF, 0xFF, 0xFF));
+      }
+    }
+
+    // Draw the first frame.
+    virtual void reset (uint32_t* pixels) = 0;
+    // Draw a later frame and add what was drawn to damage.
+    virtual void next (uint32_t* pixels,
+		       damage_region& damage) = 0;
+
+  public:
+    void produce (uint32_t* pixels,
+		  const uint16_t width,
+		  const uint16_t height,
+		  damage_region& damage) {
+      if (m_frame == 0 || width != m_width || height != m_height) {
+	m_width = width;
+	m_height = height;
+	m_frame = 0;
+	reset (pixels);
+	damage.add (0, 0, m_width, m_height);
+      }
+      else {
+	next (pixels, damage);
+      }
+      ++m_frame;
+    }
+  };
+
+  // A desktop where nothing happens after the first frame.
+  class static_desktop_source :
+    public synthetic_frame_source
+  {
+  protected:
+    void reset (uint32_t* pixels) {
+      desktop (pixels);
+    }
+
+    void next (uint32_t*,
+	       damage_region&) { }
+  };
+
+  // A terminal that scrolls one line per frame.  Every row changes so the whole screen is damaged.
+  class terminal_scroll_source :
+    public synthetic_frame_source
+  {
+  private:
+    static uint32_t foreground () {
+      return synthetic_rgb (0xC0, 0xC0, 0xC0);
+    }
+
+    static uint32_t background () {
+      return synthetic_rgb (0x00, 0x00, 0x00);
+    }
+
+  protected:
+    void reset (uint32_t* pixels) {
+      fill (pixels, 0, 0, m_width, m_height, background ());
+      for (uint16_t y = 0; y + GLYPH_HEIGHT <= m_height; y += GLYPH_HEIGHT) {
+	// Lines of varying length.
+	text (pixels, 0, y, random () % (m_width + 1), foreground (), background ());
+      }
+    }
+
+    void next (uint32_t* pixels,
+	       damage_region& damage) {
+      if (m_height < GLYPH_HEIGHT) {
+	return;
+      }
+      const uint16_t lines = m_height / GLYPH_HEIGHT;
+      memmove (pixels, pixels + GLYPH_HEIGHT * m_width, size_t (lines - 1) * GLYPH_HEIGHT * m_width * sizeof (uint32_t));
+      const uint16_t y = (lines - 1) * GLYPH_HEIGHT;
+      fill (pixels, 0, y, m_width, GLYPH_HEIGHT, background ());
+      text (pixels, 0, y, random () % (m_width + 1), foreground (), background ());
+      damage.add (0, 0, m_width, lines * GLYPH_HEIGHT);
+    }
+  };
+
+  // A window dragged across a still desktop, bouncing off the edges.
+  class window_drag_source :
+    public synthetic_frame_source
+  {
+  private:
+    std::vector<uint32_t> m_background;
+    std::vector<uint32_t> m_window;
+    uint16_t m_window_width;
+    uint16_t m_window_height;
+    int m_x;
+    int m_y;
+    int m_dx;
+    int m_dy;
+
+    void blit (uint32_t* pixels) const {
+      for (uint16_t r = 0; r != m_window_height; ++r) {
+	memcpy (pixels + (m_y + r) * m_width + m_x, &m_window[r * m_window_width], m_window_width * sizeof (uint32_t));
+      }
+    }
+
+    void restore (uint32_t* pixels) const {
+      for (uint16_t r = 0; r != m_window_height; ++r) {
+	const size_t offset = (m_y + r) * m_width + m_x;
+	memcpy (pixels + offset, &m_background[offset], m_window_width * sizeof (uint32_t));
+      }
+    }
+
+  protected:
+    void reset (uint32_t* pixels) {
+      desktop (pixels);
+      m_background.assign (pixels, pixels + size_t (m_width) * m_height);
+
+      // Draw the window in the framebuffer once to capture it.
+      m_window_width = std::max (m_width / 3, 1);
+      m_window_height = std::max (m_height / 3, 1);
+      window (pixels, 0, 0, m_window_width, m_window_height);
+      m_window.resize (size_t (m_window_width) * m_window_height);
+      for (uint16_t r = 0; r != m_window_height; ++r) {
+	memcpy (&m_window[r * m_window_width], pixels + r * m_width, m_window_width * sizeof (uint32_t));
+      }
+      memcpy (pixels, &m_background[0], m_background.size () * sizeof (uint32_t));
+
+      m_x = 0;
+      m_y = 0;
+      m_dx = 3;
+      m_dy = 2;
+      blit (pixels);
+    }
+
+    void next (uint32_t* pixels,
+	       damage_region& damage) {
+      restore (pixels);
+      damage.add (m_x, m_y, m_window_width, m_window_height);
+      if (m_x + m_dx < 0 || m_x + m_dx + m_window_width > m_width) {
+	m_dx = -m_dx;
+      }
+      if (m_y + m_dy < 0 || m_y + m_dy + m_window_height > m_height) {
+	m_dy = -m_dy;
+      }
+      m_x = std::max (0, std::min (m_x + m_dx, m_width - m_window_width));
+      m_y = std::max (0, std::min (m_y + m_dy, m_height - m_window_height));
+      blit (pixels);
+      damage.add (m_x, m_y, m_window_width, m_window_height);
+    }
+  };
+
+  // Full-motion content in the middle of a desktop.  Smooth colour that moves every frame with a little noise.
+  class video_source :
+    public synthetic_frame_source
+  {
+  private:
+    uint16_t m_x;
+    uint16_t m_y;
+    uint16_t m_video_width;
+    uint16_t m_video_height;
+
+    void draw (uint32_t* pixels) {
+      const size_t t = m_frame * 4;
+      for (uint16_t r = 0; r != m_video_height; ++r) {
+	uint32_t* row = pixels + (m_y + r) * m_width + m_x;
+	for (uint16_t c = 0; c != m_video_width; ++c) {
+	  const uint32_t noise = random () & 0x0F;
+	  row[c] = synthetic_rgb ((c + t) ^ noise, (r + t / 2) ^ noise, (c + r + t * 3) ^ noise);
+	}
+      }
+    }
+
+  protected:
+    void reset (uint32_t* pixels) {
+      desktop (pixels);
+      m_video_width = m_width / 2;
+      m_video_height = m_height / 2;
+      m_x = (m_width - m_video_width) / 2;
+      m_y = (m_height - m_video_height) / 2;
+      draw (pixels);
+    }
+
+    void next (uint32_t* pixels,
+	       damage_region& damage) {
+      draw (pixels);
+      damage.add (m_x, m_y, m_video_width, m_video_height);
+    }
+  };
+
+  // A grid of small gauges.  A few change every frame.
+  class dashboard_source :
+    public synthetic_frame_source
+  {
+  private:
+    static const uint16_t WIDGET_WIDTH = 28;
+    static const uint16_t WIDGET_HEIGHT = 18;
+    static const uint16_t GAP = 4;
+
+    uint16_t m_columns;
+    uint16_t m_rows;
+
+    uint16_t x_of (const size_t index) const {
+      return GAP + (index % m_columns) * (WIDGET_WIDTH + GAP);
+    }
+
+    uint16_t y_of (const size_t index) const {
+      return GAP + (index / m_columns) * (WIDGET_HEIGHT + GAP);
+    }
+
+    void widget (uint32_t* pixels,
+		 const size_t index) {
+      const uint16_t x = x_of (index);
+      const uint16_t y = y_of (index);
+      const uint16_t value = random () % (WIDGET_WIDTH - 3);
+      fill (pixels, x, y, WIDGET_WIDTH, WIDGET_HEIGHT, synthetic_rgb (0x30, 0x30, 0x30));
+      const uint32_t color = value < WIDGET_WIDTH / 2 ? synthetic_rgb (0x20, 0xC0, 0x20) : synthetic_rgb (0xE0, 0x40, 0x20);
+      fill (pixels, x + 2, y + WIDGET_HEIGHT - 6, value + 1, 4, color);
+    }
+
+  protected:
+    void reset (uint32_t* pixels) {
+      fill (pixels, 0, 0, m_width, m_height, synthetic_rgb (0x10, 0x10, 0x10));
+      m_columns = m_width > GAP ? (m_width - GAP) / (WIDGET_WIDTH + GAP) : 0;
+      m_rows = m_height > GAP ? (m_height - GAP) / (WIDGET_HEIGHT + GAP) : 0;
+      for (size_t i = 0; i != size_t (m_columns) * m_rows; ++i) {
+	widget (pixels, i);
+      }
+    }
+
+    void next (uint32_t* pixels,
+	       damage_region& damage) {
+      const size_t count = size_t (m_columns) * m_rows;
+      if (count == 0) {
+	return;
+      }
+      for (size_t n = std::max (count / 8, size_t (1)); n != 0; --n) {
+	const size_t i = random () % count;
+	widget (pixels, i);
+	damage.add (x_of (i), y_of (i), WIDGET_WIDTH, WIDGET_HEIGHT);
+      }
+    }
+  };
+
+  // Smooth gradients over the whole screen that shift every frame.
+  class gradient_source :
+    public synthetic_frame_source
+  {
+  private:
+    void draw (uint32_t* pixels) const {
+      const size_t t = m_frame * 2;
+      for (uint16_t y = 0; y != m_height; ++y) {
+	uint32_t* row = pixels + y * m_width;
+	const uint8_t green = y * 255 / std::max (m_height - 1, 1);
+	for (uint16_t x = 0; x != m_width; ++x) {
+	  row[x] = synthetic_rgb ((x * 255 / std::max (m_width - 1, 1) + t) & 0xFF, green, ((x + y) + t) & 0xFF);
+	}
+      }
+    }
+
+  protected:
+    void reset (uint32_t* pixels) {
+      draw (pixels);
+    }
+
+    void next (uint32_t* pixels,
+	       damage_region& damage) {
+      draw (pixels);
+      damage.add (0, 0, m_width, m_height);
+    }
+  };
+
+  // The names make_frame_source understands.
+  inline std::vector<std::string> frame_source_names () {
+    std::vector<std::string> names;
+    names.push_back ("noise");
+    names.push_back ("static");
+    names.push_back ("terminal");
+    names.push_back ("drag");
+    names.push_back ("video");
+    names.push_back ("dashboard");
+    names.push_back ("gradient");
+    return names;
+  }
+
+  // A new source by name or 0 if the name is unknown.
+  inline frame_source* make_frame_source (const std::string& name) {
+    if (name == "noise") {
+      return new noise_frame_source ();
+    }
+    if (name == "static") {
+      return new static_desktop_source ();
+    }
+    if (name == "terminal") {
+      return new terminal_scroll_source ();
+    }
+    if (name == "drag") {
+      return new window_drag_source ();
+    }
+    if (name == "video") {
+      return new video_source ();
+    }
+    if (name == "dashboard") {
+      return new dashboard_source ();
+    }
+    if (name == "gradient") {
+      return new gradient_source ();
+    }
+    return 0;
+  }
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef __tile_cache_hpp__
+#define __tile_cache_hpp__
+
+#include <substrate/rgram.hpp>
+#include "rfb.hpp"
+#include "encoder_selector.hpp"
+
+#include <ioa/shared_ptr.hpp>
+
+#include <map>
+#include <algorithm>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+  Encode-once cache for tiles of the current frame.
+
+  Encoded tiles are keyed by rectangle, client pixel format, and encoding so sessions with the same format and encoding share the work.
+  Tile statistics do not depend on the client and are keyed by rectangle alone.
+  The cache holds one generation of the frame and empties itself when the generation advances.
+  Encoded bytes are reference counted so a rectangle in a pending update keeps them alive after eviction.
+*/
+
+namespace rfb {
+
+  class tile_cache
+  {
+  public:
+    typedef ioa::const_shared_ptr<std::vector<uint8_t> > data_ptr;
+
+  private:
+    struct key_t
+    {
+      uint64_t rect;
+      pixel_format_t format;
+      int32_t encoding;
+
+      key_t (const uint64_t r,
+	     const pixel_format_t& f,
+	     const int32_t e) :
+	rect (r),
+	format (f),
+	encoding (e)
+      { }
+
+      bool operator< (const key_t& other) const {
+	if (rect != other.rect) {
+	  return rect < other.rect;
+	}
+	if (encoding != other.encoding) {
+	  return encoding < other.encoding;
+	}
+	const pixel_format_t& a = format;
+	const pixel_format_t& b = other.format;
+	const uint16_t x[] = { a.bits_per_pixel, a.depth, a.big_endian_flag, a.true_colour_flag, a.red_max, a.green_max, a.blue_max, a.red_shift, a.green_shift, a.blue_shift };
+	const uint16_t y[] = { b.bits_per_pixel, b.depth, b.big_endian_flag, b.true_colour_flag, b.red_max, b.green_max, b.blue_max, b.red_shift, b.green_shift, b.blue_shift };
+	return std::lexicographical_compare (x, x + sizeof (x) / sizeof (x[0]), y, y + sizeof (y) / sizeof (y[0]));
+      }
+    };
+
+    typedef std::map<key_t, data_ptr> data_map;
+    typedef std::map<uint64_t, tile_statistics_t> statistics_map;
+
+    uint64_t m_generation;
+    data_map m_data;
+    statistics_map m_statistics;
+    uint64_t m_hits;
+    uint64_t m_misses;
+
+    static uint64_t rect (const uint16_t x,
+			  const uint16_t y,
+			  const uint16_t width,
+			  const uint16_t height) {
+      return (uint64_t (x) << 48) | (uint64_t (y) << 32) | (uint64_t (width) << 16) | height;
+    }
+
+  public:
+    tile_cache () :
+      m_generation (0),
+      m_hits (0),
+      m_misses (0)
+    { }
+
+    // Evict everything if the frame has changed.
+    void set_generation (const uint64_t generation) {
+      if (generation != m_generation) {
+	m_generation = generation;
+	m_data.clear ();
+	m_statistics.clear ();
+      }
+    }
+
+    uint64_t generation () const {
+      return m_generation;
+    }
+
+    bool find (const uint16_t x,
+	       const uint16_t y,
+	       const uint16_t width,
+	       const uint16_t height,
+	       const pixel_format_t& format,
+	       const int32_t encoding,
+	       data_ptr& data) {
+      data_map::const_iterator pos = m_data.find (key_t (rect (x, y, width, height), format, encoding));
+      if (pos == m_data.end ()) {
+	++m_misses;
+	return false;
+      }
+      ++m_hits;
+      data = pos->second;
+      return true;
+    }
+
+    // Takes the contents of data.
+    data_ptr insert (const uint16_t x,
+		     const uint16_t y,
+		     const uint16_t width,
+		     const uint16_t height,
+		     const pixel_format_t& format,
+		     const int32_t encoding,
+		     std::vector<uint8_t>& data) {
+      const data_ptr retval (encoded_pixel_data_t::take (data));
+      m_data.insert (std::make_pair (key_t (rect (x, y, width, height), format, encoding), retval));
+      return retval;
+    }
+
+    bool find_statistics (const uint16_t x,
+			  const uint16_t y,
+			  const uint16_t width,
+			  const uint16_t height,
+			  tile_statistics_t& stats) const {
+      statistics_map::const_iterator pos = m_statistics.find (rect (x, y, width, height));
+      if (pos == m_statistics.end ()) {
+	return false;
+      }
+      stats = pos->second;
+      return true;
+    }
+
+    void insert_statistics (const uint16_t x,
+			    const uint16_t y,
+			    const uint16_t width,
+			    const uint16_t height,
+			    const tile_statistics_t& stats) {
+      m_statistics.insert (std::make_pair (rect (x, y, width, height), stats));
+    }
+
+    size_t size () const {
+      return m_data.size ();
+    }
+
+    uint64_t hits () const {
+      return m_hits;
+    }
+
+    uint64_t misses () const {
+      return m_misses;
+    }
+  };
+
+}
+
+#endif
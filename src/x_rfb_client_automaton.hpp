@@ -1,7 +1,8 @@
 #ifndef __x_rfb_client_automaton_hpp__
 #define __x_rfb_client_automaton_hpp__
 
-#include "rfb.hpp"
+#include "decode_pipeline.hpp"
+#include "damage_region.hpp"
 
 #include <ioa/ioa.hpp>
 
@@ -12,316 +13,78 @@
 #include <fcntl.h>
 // #include <stdio.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 // TODO:  Clean-up this file.
 
+/*
+  An RFB client that shows the framebuffer in an X window.
+  The protocol is rfb_client's, run on a decode_pipeline's worker thread so decoding overlaps presenting.
+  This automaton is the pipeline's front presenter and forwards X input to the server.
+*/
+
 class x_rfb_client_automaton :
-  public ioa::automaton
+  public ioa::automaton,
+  private rfb_client::presenter
 {
 private:
-
-  struct recv_protocol_version_gramel :
-    public rgram::gramel
-  {
-    x_rfb_client_automaton& m_client;
-    rfb::protocol_version_gramel m_protocol_version;
-
-    recv_protocol_version_gramel (x_rfb_client_automaton& client) :
-      m_client (client)
-    { }
-
-    void put (rgram::buffer& buf) {
-      assert (!done ());
-      m_protocol_version.put (buf);
-      if (done ()) {
-	m_client.recv_protocol_version (m_protocol_version.get ());
-      }
-    }
-
-    bool done () const {
-      return m_protocol_version.done ();
-    }
-
-    void reset () {
-      m_protocol_version.reset ();
-    }
-  };
-
-  struct recv_security_type_gramel :
-    public rgram::gramel
-  {
-    x_rfb_client_automaton& m_client;
-    rfb::security_type_gramel m_security_type;
-
-    recv_security_type_gramel (x_rfb_client_automaton& client) :
-      m_client (client)
-    { }
-
-    void put (rgram::buffer& buf) {
-      assert (!done ());
-      m_security_type.put (buf);
-      if (done ()) {
-	m_client.recv_security_type (m_security_type.get ());
-      }
-    }
-
-    bool done () const {
-      return m_security_type.done ();
-    }
-
-    void reset () {
-      m_security_type.reset ();
-    }
-  };
-
-  struct recv_server_init_gramel :
-    public rgram::gramel
-  {
-    x_rfb_client_automaton& m_client;
-    rfb::server_init_gramel m_init;
-
-    recv_server_init_gramel (x_rfb_client_automaton& client) :
-      m_client (client)
-    {
-    }
-
-    void put (rgram::buffer& buf) {
-      assert (!done ());
-      m_init.put (buf);
-      if (done ()) {
-	m_client.recv_server_init (m_init.get ());
-      }
-    }
-
-    bool done () const {
-      return m_init.done ();
-    }
-
-    void reset () {
-      m_init.reset ();
-    }
-  };
-
-  struct recv_server_message_gramel :
-    public rgram::gramel
-  {
-    x_rfb_client_automaton& m_client;
-    rfb::server_message_gramel m_message;
-
-    recv_server_message_gramel (x_rfb_client_automaton& client) :
-      m_client (client)
-    {
-    }
-
-    void put (rgram::buffer& buf) {
-      assert (!done ());
-      m_message.put (buf);
-      if (done ()) {
-	switch (m_message.m_choice.get ()) {
-	case rfb::FRAMEBUFFER_UPDATE_TYPE:
-	  m_client.recv_framebuffer_update ();
-	  break;
-	default:
-	  std::cerr << "Unknown server message.  Type = " << int (m_message.m_choice.get ()) << std::endl;
-	  abort ();
-	}
-	// Reset to start over.
-	m_message.reset ();
-      }
-    }
-
-    bool done () const {
-      return m_message.done ();
-    }
-
-    void reset () {
-      m_message.reset ();
-    }
-
-    void add_encoding (const int32_t type,
-		       rfb::pixel_data_gramel* gramel) {
-      m_message.add_encoding (type, gramel);
-    }
-  };
-
-  struct protocol_gramel :
-    public rgram::gramel
-  {
-    recv_protocol_version_gramel m_recv_protocol;
-    recv_security_type_gramel m_recv_security;
-    recv_server_init_gramel m_recv_init;
-    recv_server_message_gramel m_recv_server;
-    rgram::sequence_gramel m_sequence;
-
-    protocol_gramel (x_rfb_client_automaton& client) :
-      m_recv_protocol (client),
-      m_recv_security (client),
-      m_recv_init (client),
-      m_recv_server (client)
-    {
-      m_sequence.append (&m_recv_protocol);
-      m_sequence.append (&m_recv_security);
-      m_sequence.append (&m_recv_init);
-      m_sequence.append (&m_recv_server);
-    }
-    
-    void put (rgram::buffer& buf) {
-      assert (!done ());
-      m_sequence.put (buf);
-    }
-
-    bool done () const {
-      return m_sequence.done ();
-    }
-
-    void reset () {
-      m_sequence.reset ();
-    }
-
-    void add_encoding (const int32_t type,
-		       rfb::pixel_data_gramel* gramel) {
-      m_recv_server.add_encoding (type, gramel);
-    }
-  };
-
-  class pixel_gramel :
-    public rgram::gramel
-  {
-  private:
-    uint32_t m_uint;
-    uint8_t m_count;
-
-  public:
-    typedef uint32_t value_type;
-
-    pixel_gramel () :
-      m_count (0)
-    { }
-
-    void put (rgram::buffer& buf) {
-      assert (!done ());
-      m_count += buf.consume (&m_uint, sizeof (m_uint) - m_count);
-    }
-
-    bool done () const {
-      return m_count == sizeof (m_uint);
-    }
-
-    uint32_t get () const {
-      return m_uint;
-    }
-
-    void reset () {
-      m_count = 0;
-    }
-  };
-
-  struct raw_pixel_data_gramel :
-    public rfb::pixel_data_gramel
-  {
-    x_rfb_client_automaton& m_client;
-    uint16_t x_position;
-    uint16_t y_position;
-    uint16_t width;
-    uint16_t height;
-    uint16_t x_off;
-    uint16_t y_off;
-    pixel_gramel pixel;
-    bool dimensions_set;
-
-    raw_pixel_data_gramel (x_rfb_client_automaton& client) :
-      m_client (client),
-      x_off (0),
-      y_off (0),
-      dimensions_set (false)
-    { }
-
-    void put (rgram::buffer& buf) {
-      assert (!done ());
-
-      while (!done () && !buf.empty ()) {
-	pixel.put (buf);
-	if (pixel.done ()) {
-	  m_client.m_data[(y_position + y_off) * m_client.WIDTH + (x_position + x_off)] = pixel.get ();
-	  ++x_off;
-	  if (x_off == width) {
-	    x_off = 0;
-	    ++y_off;
-	  }
-	  pixel.reset ();
-	}
-      }
-    }
-
-    bool done () const {
-      return dimensions_set && y_off == height;
-    }
-
-    void reset () {
-      x_off = 0;
-      y_off = 0;
-      pixel.reset ();
-      dimensions_set = false;
-    }
-
-    void set_dimensions (const uint16_t xpos,
-			 const uint16_t ypos,
-			 const uint16_t w,
-			 const uint16_t h) {
-      x_position = xpos;
-      y_position = ypos;
-      width = w;
-      height = h;
-      dimensions_set = true;
-    }
-  };
-
-  raw_pixel_data_gramel m_raw_pixel_data;
-  protocol_gramel m_protocol;
-  std::queue<ioa::const_shared_ptr<ioa::buffer_interface> > m_sendq;
-  const rfb::protocol_version_t HIGHEST_VERSION;
-  rfb::protocol_version_t m_protocol_version;
-  rfb::pixel_format_t m_pixel_format;
-  std::vector<int32_t> m_encodings;
-  bool m_incremental;
-  static const uint16_t WIDTH = 640;
-  static const uint16_t HEIGHT = 480;
-  uint16_t m_server_width;
-  uint16_t m_server_height;
-
   enum state_t {
     SCHEDULE_READ_READY,
     READ_READY_WAIT,
   };
 
+  enum pipeline_state_t {
+    SCHEDULE_PIPELINE_READY,
+    PIPELINE_READY_WAIT,
+  };
+
   static const unsigned int X_OFFSET = 0;
   static const unsigned int Y_OFFSET = 0;
   static const unsigned int BORDER_WIDTH = 0;
 
+  // Try to put the framebuffer in huge pages.
+  const bool m_huge_pages;
+  // Try to share the framebuffer with the X server.  False if the X server does not support MIT-SHM.
+  bool m_shared_memory;
   state_t m_state;
+  pipeline_state_t m_pipeline_state;
   Display* m_display;
   int m_fd;
   int m_screen;
   Window m_window;
   Atom m_del_window;
-  uint32_t m_data[WIDTH * HEIGHT];
+  // The size of the image.
+  uint16_t m_width;
+  uint16_t m_height;
   XImage* m_image;
+  // True if m_image and the framebuffer are in a segment shared with the X server.
+  bool m_shm;
+  XShmSegmentInfo m_shm_info;
+  // The cursor sent by the server.  Drawn by the X server so pointer motion needs no updates.
+  Cursor m_cursor;
+  // What has been decoded but not shown.
+  rfb::damage_region m_damage;
+  decode_pipeline m_pipeline;
 
 public:
-  x_rfb_client_automaton () :
-    m_raw_pixel_data (*this),
-    m_protocol (*this),
-    HIGHEST_VERSION (rfb::PROTOCOL_VERSION_3_3),
-    m_incremental (false), // Request entire screen first time.
-    m_state (SCHEDULE_READ_READY)
+  x_rfb_client_automaton (const size_t request_window = 1,
+			  const bool huge_pages = false,
+			  const bool shared_memory = true) :
+    m_huge_pages (huge_pages),
+    m_shared_memory (shared_memory),
+    m_state (SCHEDULE_READ_READY),
+    m_pipeline_state (SCHEDULE_PIPELINE_READY),
+    m_window (None),
+    m_width (0),
+    m_height (0),
+    m_image (0),
+    m_shm (false),
+    m_cursor (None),
+    m_pipeline (*this, request_window, huge_pages)
   {
-    m_protocol.add_encoding (rfb::RAW, &m_raw_pixel_data);
-    m_encodings.push_back (rfb::RAW);
-    // m_encodings.push_back (rfb::COPY_RECT);
-    // m_encodings.push_back (rfb::RRE);
-    // m_encodings.push_back (rfb::HEXTILE);
-    // m_encodings.push_back (rfb::ZRLE);
-
     // Open connection with the X server.
     m_display = XOpenDisplay (NULL);
     if (m_display == NULL) {
@@ -329,6 +92,9 @@ public:
       exit (EXIT_FAILURE);
     }
 
+    m_shared_memory = m_shared_memory && XShmQueryExtension (m_display);
+    std::cout << "client: shared_memory = " << m_shared_memory << std::endl;
+
     // Get the connection file descriptor.
     m_fd = ConnectionNumber (m_display);
 
@@ -348,68 +114,43 @@ public:
 
     m_screen = DefaultScreen (m_display);
 
-    // Create a window.
-    m_window = XCreateSimpleWindow (m_display,
-    				    RootWindow (m_display, m_screen),
-    				    X_OFFSET, Y_OFFSET, WIDTH, HEIGHT, BORDER_WIDTH,
-    				    BlackPixel (m_display, m_screen),
-    				    WhitePixel (m_display, m_screen));
-  
-    // Prosses Window Close Event through event handler so XNextEvent does Not fail
-    m_del_window = XInternAtom (m_display, "WM_DELETE_WINDOW", 0);
-    XSetWMProtocols (m_display, m_window, &m_del_window, 1);
-    
-    // Select events in which we are interested.
-    XSelectInput (m_display, m_window, StructureNotifyMask | ExposureMask);
-  
-    // Show the window.
-    XMapWindow (m_display, m_window);
-    XFlush (m_display);
-    
-    m_pixel_format.depth = DefaultDepth (m_display, m_screen);
+    rfb::pixel_format_t pixel_format;
+    pixel_format.depth = DefaultDepth (m_display, m_screen);
     Visual* visual = DefaultVisual (m_display, m_screen);
-    
+
     // Set the pixel format.
-    m_pixel_format.bits_per_pixel = 32;
-    assert (m_pixel_format.depth == 24);
-    m_pixel_format.big_endian_flag = (htonl(1) == 1);
-    m_pixel_format.true_colour_flag = true;
+    pixel_format.bits_per_pixel = 32;
+    assert (pixel_format.depth == 24);
+    pixel_format.big_endian_flag = (htonl(1) == 1);
+    pixel_format.true_colour_flag = true;
     if (visual->red_mask == 0x00FF0000 &&
 	visual->green_mask == 0x0000FF00 &&
 	visual->blue_mask  == 0x000000FF) {
-      m_pixel_format.red_max = 0xFF;
-      m_pixel_format.green_max = 0xFF;
-      m_pixel_format.blue_max = 0xFF;
-      m_pixel_format.red_shift = 16;
-      m_pixel_format.green_shift = 8;
-      m_pixel_format.blue_shift = 0;
+      pixel_format.red_max = 0xFF;
+      pixel_format.green_max = 0xFF;
+      pixel_format.blue_max = 0xFF;
+      pixel_format.red_shift = 16;
+      pixel_format.green_shift = 8;
+      pixel_format.blue_shift = 0;
     }
     else {
       std::cerr << "Unknown X pixel format" << std::endl;
       exit (EXIT_FAILURE);
     }
-    
-    std::cout << "client: big_endian = " << int (m_pixel_format.big_endian_flag) << std::endl;
-
-    m_image = XCreateImage (m_display,
-    			    CopyFromParent,
-    			    m_pixel_format.depth,
-    			    ZPixmap,
-    			    0,
-    			    reinterpret_cast<char*> (m_data),
-    			    WIDTH,
-    			    HEIGHT,
-    			    32,
-    			    0);
-    
-    assert (1 == XInitImage (m_image));
 
-    // Black it out.
-    memset (m_data, 0, HEIGHT * WIDTH * sizeof (uint32_t));
+    std::cout << "client: big_endian = " << int (pixel_format.big_endian_flag) << std::endl;
+    m_pipeline.set_pixel_format (pixel_format);
 
     schedule ();
   }
 
+  ~x_rfb_client_automaton () {
+    // The worker may be copying into the shared segment.
+    m_pipeline.stop ();
+    // Detach any shared segment.
+    destroy_image ();
+  }
+
 private:
   void schedule () const {
     if (send_precondition ()) {
@@ -418,117 +159,292 @@ private:
     if (schedule_read_precondition ()) {
       ioa::schedule (&x_rfb_client_automaton::schedule_read);
     }
+    if (schedule_pipeline_read_precondition ()) {
+      ioa::schedule (&x_rfb_client_automaton::schedule_pipeline_read);
+    }
   }
 
-private:
+  // Size the image and window to the server's framebuffer.
+  // Returns the shared segment when there is one.  Otherwise the client allocates the framebuffer and resized wraps it in an image.
+  uint32_t* allocate (const uint16_t w,
+		      const uint16_t h) {
+    destroy_image ();
+
+    m_width = w;
+    m_height = h;
+    m_damage.clear ();
+
+    // X does not allow empty windows.
+    const unsigned int width = std::max (m_width, uint16_t (1));
+    const unsigned int height = std::max (m_height, uint16_t (1));
+    if (m_window == None) {
+      // Create a window.
+      m_window = XCreateSimpleWindow (m_display,
+				      RootWindow (m_display, m_screen),
+				      X_OFFSET, Y_OFFSET, width, height, BORDER_WIDTH,
+				      BlackPixel (m_display, m_screen),
+				      WhitePixel (m_display, m_screen));
+
+      // Prosses Window Close Event through event handler so XNextEvent does Not fail
+      m_del_window = XInternAtom (m_display, "WM_DELETE_WINDOW", 0);
+      XSetWMProtocols (m_display, m_window, &m_del_window, 1);
+
+      // Select events in which we are interested.
+      XSelectInput (m_display, m_window, StructureNotifyMask | ExposureMask | KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask);
+
+      // Show the window.
+      XMapWindow (m_display, m_window);
+      XFlush (m_display);
+    }
+    else {
+      XResizeWindow (m_display, m_window, width, height);
+      XFlush (m_display);
+    }
 
-  void recv_protocol_version (const rfb::protocol_version_t& version) {
-    std::cout << "client: " << __func__ << std::endl;
+    if (m_width == 0 || m_height == 0) {
+      return 0;
+    }
 
-    if (version == rfb::PROTOCOL_VERSION_3_3) {
-      // The server send us a version we can understand.
-      // Use the lowest version mutually supported.
-      m_protocol_version = std::min (version, HIGHEST_VERSION);
+    if (m_shared_memory && create_shm_image ()) {
+      return reinterpret_cast<uint32_t*> (m_shm_info.shmaddr);
     }
-    else {
-      // The version is either too high, too low, or garbage.
-      // Use our own and let the server disconnect if not supported.
-      m_protocol_version = HIGHEST_VERSION;
+
+    return 0;
+  }
+
+  void resized (const uint16_t width,
+		const uint16_t height,
+		uint32_t* data) {
+    if (data == 0 || m_shm) {
+      return;
     }
 
-    send_protocol_version ();
+    m_image = XCreateImage (m_display,
+			    CopyFromParent,
+			    m_pipeline.pixel_format ().depth,
+			    ZPixmap,
+			    0,
+			    reinterpret_cast<char*> (data),
+			    width,
+			    height,
+			    32,
+			    0);
+    assert (1 == XInitImage (m_image));
   }
 
-  void send_protocol_version () {
-    std::cout << "client: " << __func__ << std::endl;
-    ioa::buffer* buf = new ioa::buffer ();
-    m_protocol_version.write_to_buffer (*buf);
-    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  static bool& shm_error () {
+    static bool error = false;
+    return error;
   }
 
-  void recv_security_type (const rfb::security_type_t& msg) {
-    std::cout << "client: " << __func__ << std::endl;
-    assert (msg.security == rfb::NONE);
+  static int shm_error_handler (Display*,
+				XErrorEvent*) {
+    shm_error () = true;
+    return 0;
+  }
+
+  // Put the framebuffer in a segment the X server reads directly so presenting does not copy it through the socket.
+  // Returns false if shared memory cannot be used.
+  bool create_shm_image () {
+    XImage* image = XShmCreateImage (m_display, DefaultVisual (m_display, m_screen), m_pipeline.pixel_format ().depth, ZPixmap, 0, &m_shm_info, m_width, m_height);
+    if (image == 0) {
+      return false;
+    }
+    // The decoders assume 32-bit pixels and no padding.
+    if (image->bits_per_pixel != 32 || size_t (image->bytes_per_line) != m_width * sizeof (uint32_t)) {
+      XDestroyImage (image);
+      return false;
+    }
 
-    send_client_init ();
+    const size_t bytes = size_t (image->bytes_per_line) * image->height;
+    m_shm_info.shmid = -1;
+#ifdef SHM_HUGETLB
+    if (m_huge_pages && bytes >= page_buffer::HUGE_PAGE_SIZE) {
+      const size_t huge_bytes = (bytes + page_buffer::HUGE_PAGE_SIZE - 1) / page_buffer::HUGE_PAGE_SIZE * page_buffer::HUGE_PAGE_SIZE;
+      m_shm_info.shmid = shmget (IPC_PRIVATE, huge_bytes, IPC_CREAT | SHM_HUGETLB | 0600);
+    }
+#endif
+    if (m_shm_info.shmid == -1) {
+      m_shm_info.shmid = shmget (IPC_PRIVATE, bytes, IPC_CREAT | 0600);
+    }
+    if (m_shm_info.shmid == -1) {
+      perror ("shmget");
+      XDestroyImage (image);
+      return false;
+    }
+
+    m_shm_info.shmaddr = static_cast<char*> (shmat (m_shm_info.shmid, 0, 0));
+    if (m_shm_info.shmaddr == reinterpret_cast<char*> (-1)) {
+      perror ("shmat");
+      shmctl (m_shm_info.shmid, IPC_RMID, 0);
+      XDestroyImage (image);
+      return false;
+    }
+    m_shm_info.readOnly = False;
+
+    // Attaching fails asynchronously, for example when the X server is on another machine.
+    shm_error () = false;
+    XErrorHandler handler = XSetErrorHandler (shm_error_handler);
+    XShmAttach (m_display, &m_shm_info);
+    XSync (m_display, False);
+    XSetErrorHandler (handler);
+    // The segment goes away when both sides detach.
+    shmctl (m_shm_info.shmid, IPC_RMID, 0);
+    if (shm_error ()) {
+      std::cerr << "client: MIT-SHM attach failed" << std::endl;
+      shmdt (m_shm_info.shmaddr);
+      XDestroyImage (image);
+      m_shared_memory = false;
+      return false;
+    }
+
+    // New segments are zeroed.
+    image->data = m_shm_info.shmaddr;
+    m_image = image;
+    m_shm = true;
+    return true;
   }
-  
-  void send_client_init () {
-    std::cout << "client: " << __func__ << std::endl;
-    ioa::buffer* buf = new ioa::buffer ();
-    rfb::client_init_t msg (true);
-    msg.write_to_buffer (*buf);
-    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+
+  void destroy_image () {
+    if (m_image != 0) {
+      if (m_shm) {
+	XShmDetach (m_display, &m_shm_info);
+	XSync (m_display, False);
+	shmdt (m_shm_info.shmaddr);
+	m_shm = false;
+      }
+      // The pixels are not the image's to free.
+      m_image->data = 0;
+      XDestroyImage (m_image);
+      m_image = 0;
+    }
   }
 
-  void recv_server_init (const rfb::server_init_t& msg) {
-    std::cout << "client: " << __func__ << std::endl;
-    m_server_width = std::min (WIDTH, msg.framebuffer_width);
-    m_server_height = std::min (HEIGHT, msg.framebuffer_height);
-    // We are going to ignore the server pixel format and send our own.
+  void region_updated (const uint16_t x,
+		       const uint16_t y,
+		       const uint16_t width,
+		       const uint16_t height) {
+    m_damage.add (x, y, width, height);
+  }
 
-    send_set_pixel_format ();
-    send_set_encodings ();
-    send_framebuffer_update_request ();
+  void update_done () {
+    // Show the part that changed.
+    for (std::vector<rfb::damage_rect_t>::const_iterator pos = m_damage.rects ().begin ();
+	 pos != m_damage.rects ().end ();
+	 ++pos) {
+      present (pos->x_position, pos->y_position, pos->width, pos->height);
+    }
+    m_damage.clear ();
+    flush ();
   }
 
-  void send_set_pixel_format () {
-    std::cout << "client: " << __func__ << std::endl;
-    ioa::buffer* buf = new ioa::buffer ();
-    rfb::set_pixel_format_t msg (m_pixel_format);
-    msg.write_to_buffer (*buf);
-    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  // Copy part of the image to the window.
+  void present (const int x,
+		const int y,
+		const int width,
+		const int height) {
+    // Clip to the image.
+    const int x0 = std::max (x, 0);
+    const int y0 = std::max (y, 0);
+    const int x1 = std::min (x + width, int (m_width));
+    const int y1 = std::min (y + height, int (m_height));
+    if (m_image == 0 || x0 >= x1 || y0 >= y1) {
+      return;
+    }
+    if (m_shm) {
+      XShmPutImage (m_display,
+		    m_window,
+		    DefaultGC (m_display, m_screen),
+		    m_image,
+		    x0, y0,
+		    x0, y0,
+		    x1 - x0, y1 - y0,
+		    False);
+    }
+    else {
+      XPutImage (m_display,
+		 m_window,
+		 DefaultGC (m_display, m_screen),
+		 m_image,
+		 x0, y0,
+		 x0, y0,
+		 x1 - x0, y1 - y0);
+    }
   }
 
-  void send_set_encodings () {
-    std::cout << "client: " << __func__ << std::endl;
-    ioa::buffer* buf = new ioa::buffer ();
-    rfb::set_encodings_t msg (m_encodings);
-    msg.write_to_buffer (*buf);
-    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  // Send what has been presented.
+  void flush () {
+    if (m_shm) {
+      // The X server reads the segment when it handles the request.  Wait so the next update is not decoded into it first.
+      XSync (m_display, False);
+    }
+    else {
+      XFlush (m_display);
+    }
   }
 
-  void send_framebuffer_update_request () {
-    std::cout << "client: " << __func__ << std::endl;
-    ioa::buffer* buf = new ioa::buffer ();
-    // We want the whole image.
-    rfb::framebuffer_update_request_t msg (m_incremental, 0, 0, m_server_width, m_server_height);
-    // Can switch to incremental.
-    m_incremental = true;
-    msg.write_to_buffer (*buf);
-    m_sendq.push (ioa::const_shared_ptr<ioa::buffer_interface> (buf));
+  // Replace the window's cursor.  The X cursor has two colours so each opaque pixel becomes black or white.
+  void cursor_changed (const uint16_t hotspot_x,
+		       const uint16_t hotspot_y,
+		       const uint16_t width,
+		       const uint16_t height,
+		       const uint8_t* image,
+		       const uint8_t* mask) {
+    const rfb::pixel_format_t& pixel_format = m_pipeline.pixel_format ();
+    // X bitmaps are least significant bit first.  The RFB mask is most significant bit first.
+    const size_t row_bytes = (width + 7) / 8;
+    std::vector<char> source (std::max (size_t (1), row_bytes * height), 0);
+    std::vector<char> shape (source.size (), 0);
+    const size_t bytes_per_pixel = pixel_format.bits_per_pixel / 8;
+    for (uint16_t y = 0; y != height; ++y) {
+      for (uint16_t x = 0; x != width; ++x) {
+	if (mask[y * row_bytes + x / 8] & (0x80 >> (x % 8))) {
+	  shape[y * row_bytes + x / 8] |= 1 << (x % 8);
+	  uint32_t pixel;
+	  memcpy (&pixel, &image[(y * width + x) * bytes_per_pixel], sizeof (pixel));
+	  const unsigned int luminance =
+	    ((pixel >> pixel_format.red_shift) & pixel_format.red_max) * 255 / pixel_format.red_max +
+	    ((pixel >> pixel_format.green_shift) & pixel_format.green_max) * 255 / pixel_format.green_max +
+	    ((pixel >> pixel_format.blue_shift) & pixel_format.blue_max) * 255 / pixel_format.blue_max;
+	  if (luminance >= 3 * 128) {
+	    source[y * row_bytes + x / 8] |= 1 << (x % 8);
+	  }
+	}
+      }
+    }
+
+    // An empty cursor hides the pointer.
+    const unsigned int w = std::max (width, uint16_t (1));
+    const unsigned int h = std::max (height, uint16_t (1));
+    Pixmap source_pixmap = XCreateBitmapFromData (m_display, m_window, &source[0], w, h);
+    Pixmap shape_pixmap = XCreateBitmapFromData (m_display, m_window, &shape[0], w, h);
+    XColor foreground;
+    XColor background;
+    foreground.red = foreground.green = foreground.blue = 0xFFFF;
+    background.red = background.green = background.blue = 0;
+    Cursor cursor = XCreatePixmapCursor (m_display, source_pixmap, shape_pixmap, &foreground, &background, std::min (hotspot_x, uint16_t (w - 1)), std::min (hotspot_y, uint16_t (h - 1)));
+    XFreePixmap (m_display, source_pixmap);
+    XFreePixmap (m_display, shape_pixmap);
+
+    XDefineCursor (m_display, m_window, cursor);
+    if (m_cursor != None) {
+      XFreeCursor (m_display, m_cursor);
+    }
+    m_cursor = cursor;
   }
 
-  void recv_framebuffer_update () {
-    std::cout << "client: " << __func__ << std::endl;
-
-    ioa::time now = ioa::time::now ();
-    std::cout << "@(" << now.sec () << "," << now.usec () << ")" << std::endl;
-
-    // Show the image.
-    // TODO:  Only show the part that changed.
-    XPutImage (m_display,
-    	       m_window,
-    	       DefaultGC (m_display, m_screen),
-    	       m_image,
-    	       0, 0,
-    	       0, 0,
-    	       WIDTH, HEIGHT);
-    XFlush (m_display);
-
-    // Request.
-    send_framebuffer_update_request ();
+  // The RFB button mask for the X modifier state.  Button1Mask through Button5Mask are consecutive bits.
+  static uint8_t button_mask (const unsigned int state) {
+    return (state / Button1Mask) & 0x1F;
   }
 
   // Send a message.
   bool send_precondition () const {
-    return !m_sendq.empty () && ioa::binding_count (&x_rfb_client_automaton::send) != 0;
+    return m_pipeline.has_message () && ioa::binding_count (&x_rfb_client_automaton::send) != 0;
   }
 
   ioa::const_shared_ptr<ioa::buffer_interface> send_effect () {
-    ioa::const_shared_ptr<ioa::buffer_interface> retval = m_sendq.front ();
-    m_sendq.pop ();
-    return retval;
+    return m_pipeline.next_message ();
   }
 
 public:
@@ -537,14 +453,24 @@ public:
 private:
 
   void receive_effect (const ioa::const_shared_ptr<ioa::buffer_interface>& val) {
+    // Decoded on the worker.
+    m_pipeline.receive (val);
+  }
+
+public:
+  V_UP_INPUT (x_rfb_client_automaton, receive, ioa::const_shared_ptr<ioa::buffer_interface>);
+
+private:
+
+  void receive_batch_effect (const ioa::const_shared_ptr<rgram::buffer_chain>& val) {
     if (val.get () != 0) {
-      rgram::buffer rbuf (*val.get ());
-      m_protocol.put (rbuf);
+      m_pipeline.receive (*val.get ());
     }
   }
 
 public:
-  V_UP_INPUT (x_rfb_client_automaton, receive, ioa::const_shared_ptr<ioa::buffer_interface>);
+  V_UP_INPUT (x_rfb_client_automaton, receive_batch, ioa::const_shared_ptr<rgram::buffer_chain>);
+
 
 private:
   bool schedule_read_precondition () const {
@@ -564,29 +490,82 @@ private:
 
   void read_ready_effect () {
     XEvent event;
+    bool exposed = false;
     
     // Handle XEvents and flush the input.
-    if (XPending (m_display)) {
+    // Drain them all so input is not held back a readiness notification at a time.
+    while (XPending (m_display)) {
       XNextEvent (m_display, &event);
-      if (event.type == Expose) {
-  	XPutImage (m_display, 
-		   m_window,
-		   DefaultGC (m_display, m_screen),
-		   m_image,
-		   0, 0,
-		   0, 0,
-		   WIDTH, HEIGHT);
+      switch (event.type) {
+      case Expose:
+	if (!exposed) {
+	  m_pipeline.begin_present ();
+	}
+	present (event.xexpose.x, event.xexpose.y, event.xexpose.width, event.xexpose.height);
+	exposed = true;
+	break;
+      case KeyPress:
+      case KeyRelease:
+	{
+	  // The keysym after modifiers.
+	  char text[8];
+	  KeySym keysym;
+	  XLookupString (&event.xkey, text, sizeof (text), &keysym, 0);
+	  m_pipeline.send_key_event (event.type == KeyPress, keysym);
+	}
+	break;
+      case ButtonPress:
+      case ButtonRelease:
+	{
+	  // The state is from before the event.
+	  uint8_t mask = button_mask (event.xbutton.state);
+	  if (event.xbutton.button >= 1 && event.xbutton.button <= 8) {
+	    const uint8_t bit = 1 << (event.xbutton.button - 1);
+	    mask = event.type == ButtonPress ? (mask | bit) : (mask & ~bit);
+	  }
+	  m_pipeline.send_pointer_event (mask, event.xbutton.x, event.xbutton.y);
+	}
+	break;
+      case MotionNotify:
+	m_pipeline.send_pointer_event (button_mask (event.xmotion.state), event.xmotion.x, event.xmotion.y);
+	break;
       }
     }
+
+    if (exposed) {
+      flush ();
+      m_pipeline.end_present ();
+    }
     
     m_state = SCHEDULE_READ_READY;
   }
   
   UP_INTERNAL (x_rfb_client_automaton, read_ready);
 
+  bool schedule_pipeline_read_precondition () const {
+    return m_pipeline_state == SCHEDULE_PIPELINE_READY;
+  }
+
+  void schedule_pipeline_read_effect () {
+    ioa::schedule_read_ready (&x_rfb_client_automaton::pipeline_ready, m_pipeline.fd ());
+    m_pipeline_state = PIPELINE_READY_WAIT;
+  }
+
+  UP_INTERNAL (x_rfb_client_automaton, schedule_pipeline_read);
+
+  bool pipeline_ready_precondition () const {
+    return m_pipeline_state == PIPELINE_READY_WAIT;
+  }
+
+  // The worker finished an update, needs a resize, or has messages to send.
+  void pipeline_ready_effect () {
+    m_pipeline.poll ();
+    m_pipeline_state = SCHEDULE_PIPELINE_READY;
+  }
+
+  UP_INTERNAL (x_rfb_client_automaton, pipeline_ready);
+
 };
 
-const uint16_t x_rfb_client_automaton::HEIGHT;
-const uint16_t x_rfb_client_automaton::WIDTH;
 
 #endif
@@ -0,0 +1,689 @@
+#ifndef __zrle_hpp__
+#define __zrle_hpp__
+
+#include <substrate/rgram.hpp>
+#include "rfb.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+
+#include <stdint.h>
+#include <zlib.h>
+
+/*
+  ZRLE encoding (RFC 6143, Section 7.7.6).
+
+  A rectangle is divided into 64x64 tiles that are encoded left-to-right, top-to-bottom.
+  Each tile is encoded as raw, solid, packed palette, plain RLE, or palette RLE, whichever is smallest.
+  The tiles of all rectangles are compressed with a single zlib stream that lives as long as the connection.
+*/
+
+namespace rfb {
+
+  const uint16_t ZRLE_TILE_SIZE = 64;
+
+  // Largest palette usable by palette RLE.
+  const size_t ZRLE_MAX_PALETTE = 127;
+
+  enum zrle_subencoding_t {
+    ZRLE_RAW = 0,
+    ZRLE_SOLID = 1,
+    // 2-16 are packed palettes.
+    ZRLE_PLAIN_RLE = 128,
+    // 130-255 are palette RLE.
+  };
+
+  // Layout of a CPIXEL on the wire.
+  struct cpixel_format_t
+  {
+    size_t bytes;
+    unsigned int shift;
+    bool big_endian;
+
+    cpixel_format_t (const pixel_format_t& format) :
+      bytes (format.bits_per_pixel / 8),
+      shift (0),
+      big_endian (format.big_endian_flag)
+    {
+      if (format.true_colour_flag &&
+	  format.bits_per_pixel == 32 &&
+	  format.depth <= 24) {
+	const uint32_t mask =
+	  (uint32_t (format.red_max) << format.red_shift) |
+	  (uint32_t (format.green_max) << format.green_shift) |
+	  (uint32_t (format.blue_max) << format.blue_shift);
+	if ((mask & 0xFF000000) == 0) {
+	  // Colour fits in the least significant 3 bytes.
+	  bytes = 3;
+	}
+	else if ((mask & 0x000000FF) == 0) {
+	  // Colour fits in the most significant 3 bytes.
+	  bytes = 3;
+	  shift = 8;
+	}
+      }
+    }
+
+    void write (uint8_t* ptr,
+		uint32_t pixel) const {
+      pixel >>= shift;
+      if (big_endian) {
+	for (size_t i = bytes; i != 0; --i) {
+	  ptr[i - 1] = pixel;
+	  pixel >>= 8;
+	}
+      }
+      else {
+	for (size_t i = 0; i != bytes; ++i) {
+	  ptr[i] = pixel;
+	  pixel >>= 8;
+	}
+      }
+    }
+
+    uint32_t read (const uint8_t* ptr) const {
+      uint32_t pixel = 0;
+      if (big_endian) {
+	for (size_t i = 0; i != bytes; ++i) {
+	  pixel = (pixel << 8) | ptr[i];
+	}
+      }
+      else {
+	for (size_t i = bytes; i != 0; --i) {
+	  pixel = (pixel << 8) | ptr[i - 1];
+	}
+      }
+      return pixel << shift;
+    }
+  };
+
+  // Small open-addressed map from pixel values to palette indices.
+  class zrle_palette
+  {
+  private:
+    static const size_t SLOTS = 256;
+    uint32_t m_keys[SLOTS];
+    uint8_t m_index[SLOTS];
+    bool m_used[SLOTS];
+    uint32_t m_colors[ZRLE_MAX_PALETTE];
+    size_t m_size;
+    bool m_overflow;
+
+    static size_t hash (const uint32_t pixel) {
+      return (pixel * 2654435761u) >> 24;
+    }
+
+  public:
+    zrle_palette () {
+      clear ();
+    }
+
+    void clear () {
+      memset (m_used, 0, sizeof (m_used));
+      m_size = 0;
+      m_overflow = false;
+    }
+
+    // Insert a pixel if not present.  Sets the overflow flag when the palette is full.
+    void insert (const uint32_t pixel) {
+      size_t slot = hash (pixel);
+      while (m_used[slot]) {
+	if (m_keys[slot] == pixel) {
+	  return;
+	}
+	slot = (slot + 1) % SLOTS;
+      }
+      if (m_size == ZRLE_MAX_PALETTE) {
+	m_overflow = true;
+	return;
+      }
+      m_used[slot] = true;
+      m_keys[slot] = pixel;
+      m_index[slot] = m_size;
+      m_colors[m_size++] = pixel;
+    }
+
+    uint8_t index (const uint32_t pixel) const {
+      size_t slot = hash (pixel);
+      while (m_keys[slot] != pixel) {
+	slot = (slot + 1) % SLOTS;
+      }
+      return m_index[slot];
+    }
+
+    size_t size () const {
+      return m_size;
+    }
+
+    bool overflow () const {
+      return m_overflow;
+    }
+
+    uint32_t color (const size_t idx) const {
+      return m_colors[idx];
+    }
+  };
+
+  inline size_t zrle_run_length_bytes (const size_t length) {
+    return (length - 1) / 255 + 1;
+  }
+
+  inline uint8_t* zrle_write_run_length (uint8_t* ptr,
+					 size_t length) {
+    for (length -= 1; length >= 255; length -= 255) {
+      *ptr++ = 255;
+    }
+    *ptr++ = length;
+    return ptr;
+  }
+
+  inline size_t zrle_packed_bits (const size_t palette_size) {
+    return palette_size == 2 ? 1 : (palette_size <= 4 ? 2 : 4);
+  }
+
+  // Produces the uncompressed tile data.  Independent of the zlib stream so tiles can be prepared in parallel.
+  class zrle_tile_encoder
+  {
+  private:
+    zrle_palette m_palette;
+
+    // Append the encoding of one tile to out.
+    void encode_tile (const uint32_t* pixels,
+		      const size_t stride,
+		      const uint16_t width,
+		      const uint16_t height,
+		      const cpixel_format_t& cpixel,
+		      std::vector<uint8_t>& out) {
+      const size_t cp = cpixel.bytes;
+
+      // Gather statistics.
+      m_palette.clear ();
+      size_t runs = 0;
+      size_t run_bytes = 0;
+      size_t long_run_bytes = 0;
+      uint32_t prev = pixels[0];
+      size_t length = 0;
+      for (uint16_t y = 0; y != height; ++y) {
+	const uint32_t* row = pixels + y * stride;
+	for (uint16_t x = 0; x != width; ++x) {
+	  const uint32_t pixel = row[x];
+	  if (pixel == prev) {
+	    ++length;
+	  }
+	  else {
+	    m_palette.insert (prev);
+	    ++runs;
+	    run_bytes += zrle_run_length_bytes (length);
+	    long_run_bytes += length == 1 ? 0 : zrle_run_length_bytes (length);
+	    prev = pixel;
+	    length = 1;
+	  }
+	}
+      }
+      m_palette.insert (prev);
+      ++runs;
+      run_bytes += zrle_run_length_bytes (length);
+      long_run_bytes += length == 1 ? 0 : zrle_run_length_bytes (length);
+
+      // Pick the smallest subencoding.
+      const size_t colors = m_palette.size ();
+      const size_t raw_size = width * height * cp;
+      size_t best_size = raw_size;
+      uint8_t best = ZRLE_RAW;
+
+      if (!m_palette.overflow ()) {
+	if (colors == 1) {
+	  best_size = cp;
+	  best = ZRLE_SOLID;
+	}
+	else {
+	  if (colors <= 16) {
+	    const size_t packed_size = colors * cp + height * ((width * zrle_packed_bits (colors) + 7) / 8);
+	    if (packed_size < best_size) {
+	      best_size = packed_size;
+	      best = colors;
+	    }
+	  }
+	  const size_t palette_rle_size = colors * cp + runs + long_run_bytes;
+	  if (palette_rle_size < best_size) {
+	    best_size = palette_rle_size;
+	    best = 128 + colors;
+	  }
+	}
+      }
+      if (best != ZRLE_SOLID) {
+	const size_t plain_rle_size = runs * cp + run_bytes;
+	if (plain_rle_size < best_size) {
+	  best_size = plain_rle_size;
+	  best = ZRLE_PLAIN_RLE;
+	}
+      }
+
+      // Write the tile.
+      const size_t offset = out.size ();
+      out.resize (offset + 1 + best_size);
+      uint8_t* ptr = &out[offset];
+      *ptr++ = best;
+
+      if (best == ZRLE_RAW) {
+	for (uint16_t y = 0; y != height; ++y) {
+	  const uint32_t* row = pixels + y * stride;
+	  for (uint16_t x = 0; x != width; ++x) {
+	    cpixel.write (ptr, row[x]);
+	    ptr += cp;
+	  }
+	}
+      }
+      else if (best == ZRLE_SOLID) {
+	cpixel.write (ptr, pixels[0]);
+	ptr += cp;
+      }
+      else if (best <= 16) {
+	ptr = write_palette (ptr, cpixel);
+	const size_t bits = zrle_packed_bits (colors);
+	for (uint16_t y = 0; y != height; ++y) {
+	  const uint32_t* row = pixels + y * stride;
+	  uint8_t byte = 0;
+	  size_t nbits = 0;
+	  for (uint16_t x = 0; x != width; ++x) {
+	    byte = (byte << bits) | m_palette.index (row[x]);
+	    nbits += bits;
+	    if (nbits == 8) {
+	      *ptr++ = byte;
+	      byte = 0;
+	      nbits = 0;
+	    }
+	  }
+	  if (nbits != 0) {
+	    *ptr++ = byte << (8 - nbits);
+	  }
+	}
+      }
+      else {
+	const bool plain = (best == ZRLE_PLAIN_RLE);
+	if (!plain) {
+	  ptr = write_palette (ptr, cpixel);
+	}
+	prev = pixels[0];
+	length = 0;
+	for (uint16_t y = 0; y != height; ++y) {
+	  const uint32_t* row = pixels + y * stride;
+	  for (uint16_t x = 0; x != width; ++x) {
+	    if (row[x] == prev) {
+	      ++length;
+	    }
+	    else {
+	      ptr = write_run (ptr, prev, length, plain, cpixel);
+	      prev = row[x];
+	      length = 1;
+	    }
+	  }
+	}
+	ptr = write_run (ptr, prev, length, plain, cpixel);
+      }
+
+      assert (ptr == &out[0] + out.size ());
+    }
+
+    uint8_t* write_palette (uint8_t* ptr,
+			    const cpixel_format_t& cpixel) const {
+      for (size_t i = 0; i != m_palette.size (); ++i) {
+	cpixel.write (ptr, m_palette.color (i));
+	ptr += cpixel.bytes;
+      }
+      return ptr;
+    }
+
+    uint8_t* write_run (uint8_t* ptr,
+			const uint32_t pixel,
+			const size_t length,
+			const bool plain,
+			const cpixel_format_t& cpixel) const {
+      if (plain) {
+	cpixel.write (ptr, pixel);
+	return zrle_write_run_length (ptr + cpixel.bytes, length);
+      }
+      else if (length == 1) {
+	*ptr++ = m_palette.index (pixel);
+	return ptr;
+      }
+      else {
+	*ptr++ = m_palette.index (pixel) | 128;
+	return zrle_write_run_length (ptr, length);
+      }
+    }
+
+  public:
+    // Append the uncompressed tiles of a rectangle to out.
+    // pixels points to the upper-left pixel of the rectangle and stride is the width of the framebuffer.
+    // Pixel values must already be in the client's pixel format.
+    void encode (const uint32_t* pixels,
+		 const size_t stride,
+		 const uint16_t width,
+		 const uint16_t height,
+		 const pixel_format_t& format,
+		 std::vector<uint8_t>& out) {
+      const cpixel_format_t cpixel (format);
+      for (uint16_t y = 0; y < height; y += ZRLE_TILE_SIZE) {
+	const uint16_t h = std::min (ZRLE_TILE_SIZE, uint16_t (height - y));
+	for (uint16_t x = 0; x < width; x += ZRLE_TILE_SIZE) {
+	  const uint16_t w = std::min (ZRLE_TILE_SIZE, uint16_t (width - x));
+	  encode_tile (pixels + y * stride + x, stride, w, h, cpixel, out);
+	}
+      }
+    }
+  };
+
+  class zrle_encoder
+  {
+  private:
+    z_stream m_stream;
+    zrle_tile_encoder m_tile_encoder;
+    // Uncompressed tile data and compressed output.  Kept to avoid reallocation.
+    std::vector<uint8_t> m_raw;
+    std::vector<uint8_t> m_compressed;
+
+  public:
+    zrle_encoder (const int level = Z_DEFAULT_COMPRESSION) {
+      memset (&m_stream, 0, sizeof (m_stream));
+      if (deflateInit (&m_stream, level) != Z_OK) {
+	std::cerr << "deflateInit failed" << std::endl;
+	abort ();
+      }
+    }
+
+    ~zrle_encoder () {
+      deflateEnd (&m_stream);
+    }
+
+    // Compress uncompressed tiles and append the ZRLE data (length and zlib data) to out.
+    // Rectangles must be compressed in the order they are sent.
+    void compress (const std::vector<uint8_t>& raw,
+		   std::vector<uint8_t>& out) {
+      const size_t offset = out.size ();
+      // Placeholder for the length.
+      out.resize (offset + sizeof (uint32_t));
+      size_t used = out.size ();
+
+      if (!raw.empty ()) {
+	// Compress and flush so the client can decode the entire rectangle.
+	m_stream.next_in = const_cast<Bytef*> (&raw[0]);
+	m_stream.avail_in = raw.size ();
+	do {
+	  if (out.size () - used < 64) {
+	    out.resize (std::max (used + 1024, 2 * out.size ()));
+	  }
+	  m_stream.next_out = &out[used];
+	  m_stream.avail_out = out.size () - used;
+	  if (deflate (&m_stream, Z_SYNC_FLUSH) != Z_OK) {
+	    std::cerr << "deflate failed" << std::endl;
+	    abort ();
+	  }
+	  used = out.size () - m_stream.avail_out;
+	} while (m_stream.avail_out == 0);
+      }
+
+      out.resize (used);
+      const uint32_t length = htonl (used - offset - sizeof (uint32_t));
+      memcpy (&out[offset], &length, sizeof (length));
+    }
+
+    // Append the ZRLE data (length and zlib data) for a rectangle.
+    void encode (const uint32_t* pixels,
+		 const size_t stride,
+		 const uint16_t width,
+		 const uint16_t height,
+		 const pixel_format_t& format,
+		 ioa::buffer& buf) {
+      m_raw.clear ();
+      m_tile_encoder.encode (pixels, stride, width, height, format, m_raw);
+      m_compressed.clear ();
+      compress (m_raw, m_compressed);
+      buf.append (&m_compressed[0], m_compressed.size ());
+    }
+  };
+
+  class zrle_decoder
+  {
+  private:
+    z_stream m_stream;
+    // Inflated data that has not been decoded.
+    std::vector<uint8_t> m_pending;
+    size_t m_pending_idx;
+
+    uint32_t* m_data;
+    size_t m_stride;
+    uint16_t m_width;
+    uint16_t m_height;
+    uint16_t m_tile_x;
+    uint16_t m_tile_y;
+    cpixel_format_t m_cpixel;
+    uint32_t m_palette[ZRLE_MAX_PALETTE];
+    // Where tiles go when the rectangle is discarded.
+    std::vector<uint32_t> m_scratch;
+
+    // Decode one tile from [ptr, limit).  Returns the end of the tile or 0 if more data is needed.
+    const uint8_t* decode_tile (const uint8_t* ptr,
+				const uint8_t* limit,
+				uint32_t* pixels,
+				const uint16_t width,
+				const uint16_t height) {
+      const size_t cp = m_cpixel.bytes;
+
+      if (ptr == limit) {
+	return 0;
+      }
+      const uint8_t subencoding = *ptr++;
+
+      if (subencoding == ZRLE_RAW) {
+	if (size_t (limit - ptr) < width * height * cp) {
+	  return 0;
+	}
+	for (uint16_t y = 0; y != height; ++y) {
+	  uint32_t* row = pixels + y * m_stride;
+	  for (uint16_t x = 0; x != width; ++x) {
+	    row[x] = m_cpixel.read (ptr);
+	    ptr += cp;
+	  }
+	}
+      }
+      else if (subencoding == ZRLE_SOLID) {
+	if (size_t (limit - ptr) < cp) {
+	  return 0;
+	}
+	const uint32_t pixel = m_cpixel.read (ptr);
+	ptr += cp;
+	for (uint16_t y = 0; y != height; ++y) {
+	  std::fill (pixels + y * m_stride, pixels + y * m_stride + width, pixel);
+	}
+      }
+      else if (subencoding <= 16) {
+	const size_t bits = zrle_packed_bits (subencoding);
+	const size_t row_bytes = (width * bits + 7) / 8;
+	if (size_t (limit - ptr) < subencoding * cp + height * row_bytes) {
+	  return 0;
+	}
+	ptr = read_palette (ptr, subencoding);
+	const uint8_t mask = (1 << bits) - 1;
+	for (uint16_t y = 0; y != height; ++y) {
+	  uint32_t* row = pixels + y * m_stride;
+	  size_t shift = 8;
+	  for (uint16_t x = 0; x != width; ++x) {
+	    shift -= bits;
+	    row[x] = m_palette[(*ptr >> shift) & mask];
+	    if (shift == 0) {
+	      ++ptr;
+	      shift = 8;
+	    }
+	  }
+	  if (shift != 8) {
+	    ++ptr;
+	  }
+	}
+      }
+      else if (subencoding == ZRLE_PLAIN_RLE || subencoding >= 130) {
+	const bool plain = (subencoding == ZRLE_PLAIN_RLE);
+	if (!plain) {
+	  const size_t palette_size = subencoding - 128;
+	  if (size_t (limit - ptr) < palette_size * cp) {
+	    return 0;
+	  }
+	  ptr = read_palette (ptr, palette_size);
+	}
+
+	const size_t count = width * height;
+	size_t idx = 0;
+	while (idx != count) {
+	  uint32_t pixel;
+	  size_t length = 1;
+	  if (plain) {
+	    if (size_t (limit - ptr) < cp) {
+	      return 0;
+	    }
+	    pixel = m_cpixel.read (ptr);
+	    ptr += cp;
+	  }
+	  else {
+	    if (ptr == limit) {
+	      return 0;
+	    }
+	    pixel = m_palette[*ptr & 127];
+	  }
+
+	  if (plain || (*ptr++ & 128) != 0) {
+	    do {
+	      if (ptr == limit) {
+		return 0;
+	      }
+	      length += *ptr;
+	    } while (*ptr++ == 255);
+	  }
+
+	  if (length > count - idx) {
+	    std::cerr << "ZRLE run exceeds tile" << std::endl;
+	    abort ();
+	  }
+
+	  for (; length != 0; --length, ++idx) {
+	    pixels[(idx / width) * m_stride + idx % width] = pixel;
+	  }
+	}
+      }
+      else {
+	std::cerr << "Unknown ZRLE subencoding.  Type = " << int (subencoding) << std::endl;
+	abort ();
+      }
+
+      return ptr;
+    }
+
+    const uint8_t* read_palette (const uint8_t* ptr,
+				 const size_t size) {
+      for (size_t i = 0; i != size; ++i) {
+	m_palette[i] = m_cpixel.read (ptr);
+	ptr += m_cpixel.bytes;
+      }
+      return ptr;
+    }
+
+    void decode_tiles () {
+      while (!done ()) {
+	const uint16_t w = std::min (ZRLE_TILE_SIZE, uint16_t (m_width - m_tile_x));
+	const uint16_t h = std::min (ZRLE_TILE_SIZE, uint16_t (m_height - m_tile_y));
+	const uint8_t* begin = m_pending.empty () ? 0 : &m_pending[0];
+	const uint8_t* end = decode_tile (begin + m_pending_idx,
+					  begin + m_pending.size (),
+					  m_data != 0 ? m_data + m_tile_y * m_stride + m_tile_x : &m_scratch[0],
+					  w, h);
+	if (end == 0) {
+	  break;
+	}
+	m_pending_idx = end - begin;
+
+	m_tile_x += ZRLE_TILE_SIZE;
+	if (m_tile_x >= m_width) {
+	  m_tile_x = 0;
+	  m_tile_y += ZRLE_TILE_SIZE;
+	}
+      }
+
+      // Discard decoded data.
+      m_pending.erase (m_pending.begin (), m_pending.begin () + m_pending_idx);
+      m_pending_idx = 0;
+    }
+
+  public:
+    zrle_decoder () :
+      m_pending_idx (0),
+      m_data (0),
+      m_stride (0),
+      m_width (0),
+      m_height (0),
+      m_tile_x (0),
+      m_tile_y (0),
+      m_cpixel (pixel_format_t (32, 24, false, true, 255, 255, 255, 16, 8, 0))
+    {
+      memset (&m_stream, 0, sizeof (m_stream));
+      if (inflateInit (&m_stream) != Z_OK) {
+	std::cerr << "inflateInit failed" << std::endl;
+	abort ();
+      }
+    }
+
+    ~zrle_decoder () {
+      inflateEnd (&m_stream);
+    }
+
+    // Start a new rectangle.  data points to the upper-left pixel of the rectangle.
+    // If data is null the rectangle is decoded and thrown away so the zlib stream stays in step.
+    void set_rectangle (uint32_t* data,
+			const size_t stride,
+			const uint16_t width,
+			const uint16_t height,
+			const pixel_format_t& format) {
+      m_data = data;
+      m_stride = stride;
+      if (m_data == 0) {
+	m_scratch.resize (ZRLE_TILE_SIZE * ZRLE_TILE_SIZE);
+	m_stride = ZRLE_TILE_SIZE;
+      }
+      m_width = width;
+      m_height = height;
+      m_tile_x = 0;
+      m_tile_y = 0;
+      m_cpixel = cpixel_format_t (format);
+    }
+
+    // Inflate a chunk of zlib data and decode all complete tiles.
+    void put (const void* ptr,
+	      const size_t size) {
+      m_stream.next_in = static_cast<Bytef*> (const_cast<void*> (ptr));
+      m_stream.avail_in = size;
+      // Keep going while output fills the space given since zlib may hold more even when the input is used up.
+      bool full = true;
+      while (m_stream.avail_in != 0 || full) {
+	const size_t used = m_pending.size ();
+	m_pending.resize (used + std::max (size_t (4096), 4 * size_t (m_stream.avail_in)));
+	m_stream.next_out = &m_pending[used];
+	m_stream.avail_out = m_pending.size () - used;
+	const int r = inflate (&m_stream, Z_SYNC_FLUSH);
+	if (r != Z_OK && r != Z_BUF_ERROR) {
+	  std::cerr << "inflate failed" << std::endl;
+	  abort ();
+	}
+	full = m_stream.avail_out == 0;
+	m_pending.resize (m_pending.size () - m_stream.avail_out);
+      }
+      decode_tiles ();
+    }
+
+    bool done () const {
+      return m_width == 0 || m_height == 0 || m_tile_y >= m_height;
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,93 @@
+#include "bounded_channel_automaton.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <vector>
+
+typedef ioa::const_shared_ptr<ioa::buffer_interface> message_type;
+
+static message_type message (const size_t size) {
+  std::vector<uint8_t> bytes (size);
+  ioa::buffer* buf = new ioa::buffer ();
+  buf->append (&bytes[0], size);
+  return message_type (buf);
+}
+
+static const char* credit_test () {
+  std::cout << __func__ << std::endl;
+  bounded_queue<message_type> queue (2, 1000);
+  // The whole room to start.
+  mu_assert (queue.has_credit ());
+  channel_credit_t credit = queue.take_credit ();
+  mu_assert (credit.items == 2 && credit.bytes == 1000);
+  mu_assert (!queue.has_credit ());
+
+  queue.push (message (300));
+  queue.push (message (400));
+  mu_assert (queue.size () == 2 && queue.bytes () == 700);
+  mu_assert (!queue.has_credit ());
+
+  // Delivering returns the room.
+  mu_assert (queue.pop ()->size () == 300);
+  credit = queue.take_credit ();
+  mu_assert (credit.items == 1 && credit.bytes == 300);
+  mu_assert (queue.pop ()->size () == 400);
+  credit = queue.take_credit ();
+  mu_assert (credit.items == 1 && credit.bytes == 400);
+  mu_assert (queue.empty ());
+
+  return 0;
+}
+
+static const char* overrun_test () {
+  std::cout << __func__ << std::endl;
+  bounded_queue<message_type> queue (2, 1000);
+  queue.take_credit ();
+
+  // Past the bytes with credit left.
+  queue.push (message (1500));
+  mu_assert (queue.take_statistics ().overruns == 0);
+  // No credit.
+  queue.push (message (10));
+  mu_assert (queue.statistics_changed ());
+  mu_assert (queue.take_statistics ().overruns == 1);
+  mu_assert (!queue.statistics_changed ());
+
+  // The room of the first makes up for the second.
+  queue.pop ();
+  queue.take_credit ();
+  queue.push (message (10));
+  mu_assert (queue.take_statistics ().overruns == 1);
+
+  return 0;
+}
+
+static const char* high_water_test () {
+  std::cout << __func__ << std::endl;
+  bounded_queue<int> queue (4, 1);
+  queue.take_credit ();
+  queue.push (1);
+  queue.push (2);
+  queue.push (3);
+  queue.pop ();
+  queue.pop ();
+  queue.push (4);
+  const channel_statistics_t statistics = queue.take_statistics ();
+  mu_assert (statistics.max_items == 3);
+  // Only buffers have bytes.
+  mu_assert (statistics.max_bytes == 0);
+  mu_assert (statistics.overruns == 0);
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (credit_test);
+  mu_run_test (overrun_test);
+  mu_run_test (high_water_test);
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include "content_cache.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <cstdlib>
+
+static const char* lru_test () {
+  std::cout << __func__ << std::endl;
+  rfb::lru_slots lru (3);
+  bool evicted;
+  mu_assert (lru.insert (evicted) == 0 && !evicted);
+  mu_assert (lru.insert (evicted) == 1 && !evicted);
+  mu_assert (lru.insert (evicted) == 2 && !evicted);
+  lru.touch (0);
+  // 1 is the least recently used.
+  mu_assert (lru.insert (evicted) == 1 && evicted);
+  mu_assert (lru.insert (evicted) == 2 && evicted);
+  mu_assert (lru.insert (evicted) == 0 && evicted);
+  mu_assert (lru.size () == 3);
+
+  return 0;
+}
+
+static const char* index_test () {
+  std::cout << __func__ << std::endl;
+  rfb::content_cache_index index (2);
+  size_t slot;
+  mu_assert (!index.lookup (10, slot));
+  mu_assert (index.insert (10) == 0);
+  mu_assert (index.insert (20) == 1);
+  mu_assert (index.lookup (10, slot) && slot == 0);
+  // Evicts 20.
+  mu_assert (index.insert (30) == 1);
+  mu_assert (!index.lookup (20, slot));
+  mu_assert (index.lookup (30, slot) && slot == 1);
+
+  return 0;
+}
+
+static const char* hash_test () {
+  std::cout << __func__ << std::endl;
+  uint32_t a[4] = { 1, 2, 3, 4 };
+  uint32_t b[4] = { 1, 2, 3, 5 };
+  mu_assert (rfb::content_hash (a, 2, 2, 2) == rfb::content_hash (a, 2, 2, 2));
+  mu_assert (rfb::content_hash (a, 2, 2, 2) != rfb::content_hash (b, 2, 2, 2));
+  // Same pixels, different shape.
+  mu_assert (rfb::content_hash (a, 4, 4, 1) != rfb::content_hash (a, 1, 1, 4));
+
+  return 0;
+}
+
+// Replay a random stream of tiles through a server index and a client store.
+static const char* lockstep_test () {
+  std::cout << __func__ << std::endl;
+  const size_t CONTENTS = 40;
+  const uint16_t SIZE = 4;
+  std::vector<std::vector<uint32_t> > contents (CONTENTS);
+  for (size_t i = 0; i != CONTENTS; ++i) {
+    contents[i].assign (SIZE * SIZE, i * 1000);
+    contents[i][i % (SIZE * SIZE)] = i;
+  }
+
+  rfb::content_cache_index index (16);
+  rfb::content_cache_store store (16);
+  size_t hits = 0;
+  srand (1);
+  for (size_t n = 0; n != 10000; ++n) {
+    const std::vector<uint32_t>& tile = contents[rand () % CONTENTS];
+    const uint64_t hash = rfb::content_hash (&tile[0], SIZE, SIZE, SIZE);
+    size_t slot;
+    if (index.lookup (hash, slot)) {
+      std::vector<uint32_t> painted (SIZE * SIZE);
+      mu_assert (store.paint (slot, &painted[0], SIZE, SIZE, SIZE));
+      mu_assert (painted == tile);
+      ++hits;
+    }
+    else {
+      mu_assert (index.insert (hash) == store.insert (&tile[0], SIZE, SIZE, SIZE));
+    }
+  }
+  mu_assert (hits != 0);
+
+  return 0;
+}
+
+static const char* paint_size_test () {
+  std::cout << __func__ << std::endl;
+  rfb::content_cache_store store;
+  uint32_t pixels[4] = { 1, 2, 3, 4 };
+  const size_t slot = store.insert (pixels, 2, 2, 2);
+  uint32_t out[4];
+  mu_assert (!store.paint (slot, out, 4, 4, 1));
+  mu_assert (!store.paint (slot + 1, out, 2, 2, 2));
+  mu_assert (store.paint (slot, out, 2, 2, 2));
+  mu_assert (out[3] == 4);
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (lru_test);
+  mu_run_test (index_test);
+  mu_run_test (hash_test);
+  mu_run_test (lockstep_test);
+  mu_run_test (paint_size_test);
+
+  return 0;
+}
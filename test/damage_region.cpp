@@ -0,0 +1,105 @@
+#include "damage_region.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+
+static bool has (const rfb::damage_region& region,
+		 const uint16_t x,
+		 const uint16_t y,
+		 const uint16_t width,
+		 const uint16_t height) {
+  for (std::vector<rfb::damage_rect_t>::const_iterator pos = region.rects ().begin ();
+       pos != region.rects ().end ();
+       ++pos) {
+    if (pos->x_position == x && pos->y_position == y && pos->width == width && pos->height == height) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char* empty_test () {
+  std::cout << __func__ << std::endl;
+  rfb::damage_region region;
+  mu_assert (region.empty ());
+  region.add (10, 10, 0, 5);
+  region.add (10, 10, 5, 0);
+  mu_assert (region.empty ());
+
+  return 0;
+}
+
+static const char* adjacent_test () {
+  std::cout << __func__ << std::endl;
+  rfb::damage_region region;
+  // A 2x2 block of tiles becomes one rectangle.
+  region.add (0, 0, 16, 16);
+  region.add (16, 0, 16, 16);
+  region.add (0, 16, 16, 16);
+  region.add (16, 16, 16, 16);
+  mu_assert (region.rects ().size () == 1);
+  mu_assert (has (region, 0, 0, 32, 32));
+
+  // Contained rectangles disappear.
+  region.add (4, 4, 8, 8);
+  mu_assert (region.rects ().size () == 1);
+
+  region.clear ();
+  mu_assert (region.empty ());
+
+  return 0;
+}
+
+static const char* disjoint_test () {
+  std::cout << __func__ << std::endl;
+  rfb::damage_region region;
+  region.add (0, 0, 16, 16);
+  region.add (100, 100, 16, 16);
+  mu_assert (region.rects ().size () == 2);
+  mu_assert (has (region, 0, 0, 16, 16));
+  mu_assert (has (region, 100, 100, 16, 16));
+
+  return 0;
+}
+
+static const char* limit_test () {
+  std::cout << __func__ << std::endl;
+  rfb::damage_region region (2);
+  region.add (0, 0, 10, 10);
+  region.add (200, 200, 10, 10);
+  // Closest to the first so merging with it wastes the least.
+  region.add (12, 0, 10, 10);
+  mu_assert (region.rects ().size () == 2);
+  mu_assert (has (region, 0, 0, 22, 10));
+  mu_assert (has (region, 200, 200, 10, 10));
+
+  return 0;
+}
+
+static const char* clip_test () {
+  std::cout << __func__ << std::endl;
+  // Inside.
+  rfb::damage_rect_t r = rfb::damage_rect_t (10, 20, 30, 40).clip (100, 100);
+  mu_assert (r.x_position == 10 && r.y_position == 20 && r.width == 30 && r.height == 40);
+  // Past the edges, including a size that would overflow 16 bits.
+  r = rfb::damage_rect_t (10, 20, 65535, 65535).clip (100, 80);
+  mu_assert (r.x_position == 10 && r.y_position == 20 && r.width == 90 && r.height == 60);
+  // Outside.
+  mu_assert (rfb::damage_rect_t (100, 0, 10, 10).clip (100, 100).empty ());
+  mu_assert (rfb::damage_rect_t (65535, 65535, 65535, 65535).clip (100, 100).empty ());
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (empty_test);
+  mu_run_test (adjacent_test);
+  mu_run_test (disjoint_test);
+  mu_run_test (limit_test);
+  mu_run_test (clip_test);
+
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include "decode_pipeline.hpp"
+#include "checksum_presenter.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <ioa/buffer.hpp>
+
+#include <poll.h>
+
+struct recording_presenter :
+  public checksum_presenter
+{
+  size_t resizes;
+
+  recording_presenter () :
+    resizes (0)
+  { }
+
+  void resized (const uint16_t width,
+		const uint16_t height,
+		uint32_t* d) {
+    checksum_presenter::resized (width, height, d);
+    ++resizes;
+  }
+};
+
+static const uint16_t WIDTH = 4;
+static const uint16_t HEIGHT = 2;
+
+static ioa::const_shared_ptr<ioa::buffer_interface> handshake () {
+  ioa::buffer* buf = new ioa::buffer ();
+  rfb::PROTOCOL_VERSION_3_3.write_to_buffer (*buf);
+  rfb::security_type_t (rfb::NONE).write_to_buffer (*buf);
+  rfb::server_init_t (WIDTH, HEIGHT, rfb_client::default_pixel_format (), "test").write_to_buffer (*buf);
+  return ioa::const_shared_ptr<ioa::buffer_interface> (buf);
+}
+
+// Fill the framebuffer with value.
+static ioa::const_shared_ptr<ioa::buffer_interface> update (const uint32_t value) {
+  std::vector<uint8_t> pixels (WIDTH * HEIGHT * sizeof (uint32_t));
+  for (uint32_t i = 0; i != WIDTH * HEIGHT; ++i) {
+    memcpy (&pixels[i * sizeof (uint32_t)], &value, sizeof (uint32_t));
+  }
+  rfb::framebuffer_update_t msg;
+  msg.add_rectangle (rfb::rectangle_t (0, 0, WIDTH, HEIGHT, new rfb::encoded_pixel_data_t (rfb::RAW, pixels)));
+  ioa::buffer* buf = new ioa::buffer ();
+  msg.write_to_buffer (*buf);
+  return ioa::const_shared_ptr<ioa::buffer_interface> (buf);
+}
+
+// Poll until the presenter has seen updates updates.  False on timeout.
+static bool wait_for (decode_pipeline& pipeline,
+		      const checksum_presenter& presenter,
+		      const size_t updates) {
+  for (size_t i = 0; i != 100 && presenter.updates () < updates; ++i) {
+    struct pollfd pfd;
+    pfd.fd = pipeline.fd ();
+    pfd.events = POLLIN;
+    ::poll (&pfd, 1, 50);
+    pipeline.poll ();
+  }
+  return presenter.updates () >= updates;
+}
+
+// Take messages until there are count or none arrive for a while.
+static size_t drain (decode_pipeline& pipeline,
+		     const size_t count) {
+  size_t n = 0;
+  for (size_t i = 0; i != 100 && n < count; ++i) {
+    while (pipeline.has_message ()) {
+      pipeline.next_message ();
+      ++n;
+    }
+    if (n < count) {
+      struct pollfd pfd;
+      pfd.fd = pipeline.fd ();
+      pfd.events = POLLIN;
+      ::poll (&pfd, 1, 50);
+      pipeline.poll ();
+    }
+  }
+  return n;
+}
+
+static const char* handoff_test () {
+  std::cout << __func__ << std::endl;
+  recording_presenter presenter;
+  decode_pipeline pipeline (presenter);
+  pipeline.receive (handshake ());
+  pipeline.receive (update (7));
+  mu_assert (wait_for (pipeline, presenter, 1));
+  mu_assert (presenter.resizes == 1);
+  mu_assert (pipeline.width () == WIDTH && pipeline.height () == HEIGHT);
+  for (size_t i = 0; i != WIDTH * HEIGHT; ++i) {
+    mu_assert (pipeline.data ()[i] == 7);
+  }
+  // ProtocolVersion, ClientInit, SetPixelFormat, SetEncodings, and two FramebufferUpdateRequests.
+  mu_assert (drain (pipeline, 6) == 6);
+  mu_assert (!pipeline.has_message ());
+
+  return 0;
+}
+
+static const char* coalesce_test () {
+  std::cout << __func__ << std::endl;
+  recording_presenter presenter;
+  decode_pipeline pipeline (presenter);
+  pipeline.receive (handshake ());
+  // Not polled in between so later updates merge into earlier ones.
+  for (uint32_t i = 1; i <= 10; ++i) {
+    pipeline.receive (update (i));
+  }
+  for (size_t i = 0; i != 100 && (pipeline.data () == 0 || pipeline.data ()[0] != 10); ++i) {
+    wait_for (pipeline, presenter, presenter.updates () + 1);
+  }
+  // Only whole updates are presented.
+  for (size_t i = 0; i != WIDTH * HEIGHT; ++i) {
+    mu_assert (pipeline.data ()[i] == 10);
+  }
+  mu_assert (presenter.updates () <= 10);
+
+  return 0;
+}
+
+static const char* input_test () {
+  std::cout << __func__ << std::endl;
+  rfb_client::presenter presenter;
+  decode_pipeline pipeline (presenter);
+  // Input does not wait for the worker.
+  pipeline.send_key_event (true, 'a');
+  mu_assert (pipeline.has_message ());
+  ioa::const_shared_ptr<ioa::buffer_interface> msg = pipeline.next_message ();
+  mu_assert (msg->size () == 8);
+  mu_assert (static_cast<const uint8_t*> (msg->data ())[0] == rfb::KEY_EVENT_TYPE);
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (handoff_test);
+  mu_run_test (coalesce_test);
+  mu_run_test (input_test);
+
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include "encoder_pool.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+
+struct sum_task :
+  public encoder_pool::task
+{
+  size_t m_n;
+  size_t m_sum;
+
+  sum_task (const size_t n) :
+    m_n (n),
+    m_sum (0)
+  { }
+
+  void run () {
+    for (size_t i = 1; i <= m_n; ++i) {
+      m_sum += i;
+    }
+  }
+};
+
+static const char* run_test (const size_t threads) {
+  encoder_pool pool (threads);
+  std::vector<sum_task> sums;
+  for (size_t i = 0; i != 100; ++i) {
+    sums.push_back (sum_task (i * 1000));
+  }
+  std::vector<encoder_pool::task*> tasks;
+  for (size_t i = 0; i != sums.size (); ++i) {
+    tasks.push_back (&sums[i]);
+  }
+
+  // Run more than once to exercise reuse of the workers.
+  for (size_t round = 0; round != 3; ++round) {
+    for (size_t i = 0; i != sums.size (); ++i) {
+      sums[i].m_sum = 0;
+    }
+    pool.run (tasks);
+    for (size_t i = 0; i != sums.size (); ++i) {
+      mu_assert (sums[i].m_sum == sums[i].m_n * (sums[i].m_n + 1) / 2);
+    }
+  }
+
+  return 0;
+}
+
+static const char* serial_test () {
+  std::cout << __func__ << std::endl;
+  return run_test (0);
+}
+
+static const char* parallel_test () {
+  std::cout << __func__ << std::endl;
+  return run_test (4);
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (serial_test);
+  mu_run_test (parallel_test);
+
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include <substrate/rgram.hpp>
+#include "encoder_selector.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <cmath>
+
+static const uint64_t MS = 1000000;
+
+static bool near (const double actual,
+		  const double expected) {
+  return std::fabs (actual - expected) < 0.05 * expected;
+}
+
+static const char* latency_test () {
+  std::cout << __func__ << std::endl;
+  rfb::encoder_selector selector;
+  const double initial = selector.bytes_per_ns ();
+  // Small updates one at a time over a slow round trip.  Their time is latency, not bytes.
+  uint64_t now = 0;
+  for (size_t i = 0; i != 100; ++i) {
+    selector.record_transmission (1000, now, now + 50 * MS + 1000);
+    now += 60 * MS;
+  }
+  mu_assert (selector.min_rtt_ns () == 50 * MS + 1000);
+  mu_assert (selector.bytes_per_ns () == initial);
+
+  return 0;
+}
+
+static const char* idle_test () {
+  std::cout << __func__ << std::endl;
+  rfb::encoder_selector selector;
+  // 10 ms of latency and 0.1 bytes per nanosecond.  A small update shows the latency.
+  uint64_t now = 0;
+  selector.record_transmission (100, now, now + 10 * MS + 1000);
+  for (size_t i = 0; i != 100; ++i) {
+    now += 100 * MS;
+    selector.record_transmission (1000000, now, now + 10 * MS + 10 * MS + 1000);
+  }
+  mu_assert (near (selector.bytes_per_ns (), 0.1));
+
+  return 0;
+}
+
+static const char* pipelined_test () {
+  std::cout << __func__ << std::endl;
+  rfb::encoder_selector selector;
+  // Updates sent back to back drain at 0.05 bytes per nanosecond behind 20 ms of latency.
+  for (size_t i = 0; i != 100; ++i) {
+    selector.record_transmission (100000, i * MS, 20 * MS + (i + 1) * 2 * MS);
+  }
+  mu_assert (near (selector.bytes_per_ns (), 0.05));
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (latency_test);
+  mu_run_test (idle_test);
+  mu_run_test (pipelined_test);
+
+  return 0;
+}
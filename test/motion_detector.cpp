@@ -0,0 +1,79 @@
+#include "motion_detector.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <cstdlib>
+
+static const uint16_t WIDTH = 64;
+static const uint16_t HEIGHT = 48;
+
+static void fill (uint32_t* data) {
+  for (size_t i = 0; i != WIDTH * HEIGHT; ++i) {
+    data[i] = rand ();
+  }
+}
+
+static const char* vertical_test () {
+  std::cout << __func__ << std::endl;
+  uint32_t prev[WIDTH * HEIGHT];
+  uint32_t curr[WIDTH * HEIGHT];
+  fill (prev);
+  fill (curr);
+  // Scroll up by 3 rows.
+  memcpy (curr, prev + 3 * WIDTH, (HEIGHT - 3) * WIDTH * sizeof (uint32_t));
+
+  rfb::motion_detector detector;
+  rfb::motion_t motion;
+  mu_assert (detector.detect (prev, curr, WIDTH, 0, 0, WIDTH, HEIGHT, motion));
+  mu_assert (motion.x_position == 0 && motion.y_position == 0);
+  mu_assert (motion.width == WIDTH && motion.height == HEIGHT - 3);
+  mu_assert (motion.src_x_position == 0 && motion.src_y_position == 3);
+
+  return 0;
+}
+
+static const char* horizontal_test () {
+  std::cout << __func__ << std::endl;
+  uint32_t prev[WIDTH * HEIGHT];
+  uint32_t curr[WIDTH * HEIGHT];
+  fill (prev);
+  fill (curr);
+  // Move right by 5 columns.
+  for (uint16_t y = 0; y != HEIGHT; ++y) {
+    memcpy (curr + y * WIDTH + 5, prev + y * WIDTH, (WIDTH - 5) * sizeof (uint32_t));
+  }
+
+  rfb::motion_detector detector;
+  rfb::motion_t motion;
+  mu_assert (detector.detect (prev, curr, WIDTH, 0, 0, WIDTH, HEIGHT, motion));
+  mu_assert (motion.x_position == 5 && motion.y_position == 0);
+  mu_assert (motion.width == WIDTH - 5 && motion.height == HEIGHT);
+  mu_assert (motion.src_x_position == 0 && motion.src_y_position == 0);
+
+  return 0;
+}
+
+static const char* no_motion_test () {
+  std::cout << __func__ << std::endl;
+  uint32_t prev[WIDTH * HEIGHT];
+  uint32_t curr[WIDTH * HEIGHT];
+  fill (prev);
+  fill (curr);
+
+  rfb::motion_detector detector;
+  rfb::motion_t motion;
+  mu_assert (!detector.detect (prev, curr, WIDTH, 0, 0, WIDTH, HEIGHT, motion));
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (vertical_test);
+  mu_run_test (horizontal_test);
+  mu_run_test (no_motion_test);
+
+  return 0;
+}
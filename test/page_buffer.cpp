@@ -0,0 +1,65 @@
+#include "page_buffer.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <stdint.h>
+
+static const char* aligned_test () {
+  std::cout << __func__ << std::endl;
+  page_buffer buf;
+  mu_assert (buf.data () == 0 && buf.size () == 0);
+
+  buf.allocate (100 * 100 * sizeof (uint32_t), false);
+  mu_assert (buf.data () != 0);
+  mu_assert (buf.size () == 100 * 100 * sizeof (uint32_t));
+  mu_assert (reinterpret_cast<uintptr_t> (buf.data ()) % sysconf (_SC_PAGESIZE) == 0);
+  mu_assert (!buf.huge_pages ());
+
+  // Starts zeroed and is writable to the end.
+  const uint32_t* p = static_cast<const uint32_t*> (buf.data ());
+  for (size_t i = 0; i != 100 * 100; ++i) {
+    mu_assert (p[i] == 0);
+  }
+  static_cast<uint32_t*> (buf.data ())[100 * 100 - 1] = 1;
+
+  return 0;
+}
+
+static const char* reallocate_test () {
+  std::cout << __func__ << std::endl;
+  page_buffer buf;
+  buf.allocate (4096, false);
+  static_cast<uint8_t*> (buf.data ())[0] = 1;
+  buf.allocate (8192, false);
+  mu_assert (buf.size () == 8192);
+  mu_assert (static_cast<uint8_t*> (buf.data ())[0] == 0);
+  buf.allocate (0, false);
+  mu_assert (buf.data () == 0 && buf.size () == 0);
+
+  return 0;
+}
+
+static const char* huge_pages_test () {
+  std::cout << __func__ << std::endl;
+  // Works whether or not the system has huge pages.
+  page_buffer buf;
+  const size_t bytes = 3840 * 2160 * sizeof (uint32_t);
+  buf.allocate (bytes, true);
+  mu_assert (buf.data () != 0);
+  mu_assert (buf.size () == bytes);
+  mu_assert (reinterpret_cast<uintptr_t> (buf.data ()) % sysconf (_SC_PAGESIZE) == 0);
+  static_cast<uint8_t*> (buf.data ())[bytes - 1] = 1;
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (aligned_test);
+  mu_run_test (reallocate_test);
+  mu_run_test (huge_pages_test);
+
+  return 0;
+}
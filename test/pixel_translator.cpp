@@ -0,0 +1,127 @@
+#include "pixel_translator.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+
+static const rfb::pixel_format_t SERVER (32, 24, htonl (1) == 1, true, 255, 255, 255, 16, 8, 0);
+
+static const char* identity_test () {
+  std::cout << __func__ << std::endl;
+  rfb::pixel_translator translator (SERVER);
+  translator.set_client_format (SERVER);
+  mu_assert (translator.kernel () == rfb::pixel_translator::IDENTITY);
+
+  const uint32_t src[2] = { 0x123456, 0xABCDEF };
+  uint32_t dst[2];
+  translator.translate (src, dst, 2);
+  mu_assert (dst[0] == src[0] && dst[1] == src[1]);
+
+  return 0;
+}
+
+static const char* rgb565_test () {
+  std::cout << __func__ << std::endl;
+  rfb::pixel_translator translator (SERVER);
+  translator.set_client_format (rfb::pixel_format_t (16, 16, false, true, 31, 63, 31, 11, 5, 0));
+  mu_assert (translator.kernel () == rfb::pixel_translator::SHIFT);
+
+  // Enough pixels to use the vector and scalar paths.
+  uint32_t src[7];
+  for (size_t i = 0; i != 7; ++i) {
+    src[i] = 0xFF8040 + i;
+  }
+  uint32_t dst[7];
+  translator.translate (src, dst, 7);
+  for (size_t i = 0; i != 7; ++i) {
+    mu_assert (dst[i] == ((0xFF >> 3) << 11 | (0x80 >> 2) << 5 | ((0x40 + i) >> 3)));
+  }
+
+  // Room for the widest pixel since the compiler cannot tell which size pack writes.
+  uint8_t bytes[4] = { 0, 0, 0, 0 };
+  translator.pack (dst, bytes, 1);
+  mu_assert (bytes[0] == (dst[0] & 0xFF) && bytes[1] == (dst[0] >> 8));
+  // Only two bytes are written.
+  mu_assert (bytes[2] == 0 && bytes[3] == 0);
+
+  return 0;
+}
+
+static const char* table_test () {
+  std::cout << __func__ << std::endl;
+  rfb::pixel_translator translator (SERVER);
+  // Maxes that are not 2^n - 1.
+  translator.set_client_format (rfb::pixel_format_t (8, 8, false, true, 5, 5, 3, 0, 3, 6));
+  mu_assert (translator.kernel () == rfb::pixel_translator::TABLE);
+
+  const uint32_t src[2] = { 0xFFFFFF, 0x000000 };
+  uint32_t dst[2];
+  translator.translate (src, dst, 2);
+  mu_assert (dst[0] == (5 | 5 << 3 | 3 << 6));
+  mu_assert (dst[1] == 0);
+
+  return 0;
+}
+
+static const char* colour_map_test () {
+  std::cout << __func__ << std::endl;
+  rfb::pixel_translator translator (SERVER);
+  rfb::pixel_format_t format (8, 8, false, false, 0, 0, 0, 0, 0, 0);
+  mu_assert (rfb::pixel_translator::valid (format));
+  translator.set_client_format (format);
+
+  const uint32_t src[2] = { 0xFFFFFF, 0xFF0000 };
+  uint32_t dst[2];
+  translator.translate (src, dst, 2);
+  mu_assert (dst[0] == 215);
+  mu_assert (dst[1] == 180);
+
+  const std::vector<uint16_t> map = rfb::pixel_translator::colour_map ();
+  mu_assert (map.size () == 3 * 216);
+  mu_assert (map[3 * 180] == 65535 && map[3 * 180 + 1] == 0 && map[3 * 180 + 2] == 0);
+
+  return 0;
+}
+
+static const char* byte_order_test () {
+  std::cout << __func__ << std::endl;
+  rfb::pixel_translator translator (SERVER);
+  rfb::pixel_format_t format = SERVER;
+  format.big_endian_flag = !SERVER.big_endian_flag;
+  translator.set_client_format (format);
+  mu_assert (translator.identity ());
+
+  const uint32_t src = 0x00123456;
+  uint8_t bytes[4] = { 0, 0, 0, 0 };
+  translator.pack (&src, bytes, 1);
+  if (format.big_endian_flag) {
+    mu_assert (bytes[0] == 0x00 && bytes[1] == 0x12 && bytes[2] == 0x34 && bytes[3] == 0x56);
+  }
+  else {
+    mu_assert (bytes[0] == 0x56 && bytes[1] == 0x34 && bytes[2] == 0x12 && bytes[3] == 0x00);
+  }
+
+  return 0;
+}
+
+static const char* invalid_test () {
+  std::cout << __func__ << std::endl;
+  mu_assert (!rfb::pixel_translator::valid (rfb::pixel_format_t (24, 24, false, true, 255, 255, 255, 16, 8, 0)));
+  mu_assert (!rfb::pixel_translator::valid (rfb::pixel_format_t (16, 16, false, true, 255, 255, 255, 16, 8, 0)));
+  mu_assert (!rfb::pixel_translator::valid (rfb::pixel_format_t (16, 16, false, false, 0, 0, 0, 0, 0, 0)));
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (identity_test);
+  mu_run_test (rgb565_test);
+  mu_run_test (table_test);
+  mu_run_test (colour_map_test);
+  mu_run_test (byte_order_test);
+  mu_run_test (invalid_test);
+
+  return 0;
+}
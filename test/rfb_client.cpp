@@ -0,0 +1,323 @@
+#include "rfb_client.hpp"
+#include "checksum_presenter.hpp"
+#include "damage_region.hpp"
+#include "zrle.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <ioa/buffer.hpp>
+
+struct recording_presenter :
+  public checksum_presenter
+{
+  size_t resizes;
+  uint32_t* data;
+  std::vector<rfb::damage_rect_t> regions;
+
+  recording_presenter () :
+    resizes (0),
+    data (0)
+  { }
+
+  void resized (const uint16_t width,
+		const uint16_t height,
+		uint32_t* d) {
+    checksum_presenter::resized (width, height, d);
+    ++resizes;
+    data = d;
+  }
+
+  void region_updated (const uint16_t x,
+		       const uint16_t y,
+		       const uint16_t width,
+		       const uint16_t height) {
+    checksum_presenter::region_updated (x, y, width, height);
+    regions.push_back (rfb::damage_rect_t (x, y, width, height));
+  }
+};
+
+static const uint16_t WIDTH = 4;
+static const uint16_t HEIGHT = 2;
+
+static size_t drain (rfb_client& client) {
+  size_t count = 0;
+  while (client.has_message ()) {
+    client.next_message ();
+    ++count;
+  }
+  return count;
+}
+
+// Everything up to and including ServerInit.
+static void handshake (rfb_client& client) {
+  ioa::buffer buf;
+  rfb::PROTOCOL_VERSION_3_3.write_to_buffer (buf);
+  rfb::security_type_t (rfb::NONE).write_to_buffer (buf);
+  rfb::server_init_t (WIDTH, HEIGHT, rfb_client::default_pixel_format (), "test").write_to_buffer (buf);
+  client.receive (buf);
+}
+
+// A RAW rectangle over the whole framebuffer followed by a CopyRect of the top left 2x1 to the bottom right.
+static void update (rfb_client& client) {
+  std::vector<uint8_t> pixels (WIDTH * HEIGHT * sizeof (uint32_t));
+  for (uint32_t i = 0; i != WIDTH * HEIGHT; ++i) {
+    memcpy (&pixels[i * sizeof (uint32_t)], &i, sizeof (uint32_t));
+  }
+  rfb::framebuffer_update_t msg;
+  msg.add_rectangle (rfb::rectangle_t (0, 0, WIDTH, HEIGHT, new rfb::encoded_pixel_data_t (rfb::RAW, pixels)));
+  msg.add_rectangle (rfb::rectangle_t (2, 1, 2, 1, new rfb::copy_rect_t (0, 0)));
+  ioa::buffer buf;
+  msg.write_to_buffer (buf);
+  client.receive (buf);
+}
+
+static const char* handshake_test () {
+  std::cout << __func__ << std::endl;
+  recording_presenter presenter;
+  rfb_client client (presenter);
+  mu_assert (!client.has_message ());
+
+  handshake (client);
+  // ProtocolVersion, ClientInit, SetPixelFormat, SetEncodings, and FramebufferUpdateRequest.
+  mu_assert (drain (client) == 5);
+  mu_assert (client.width () == WIDTH && client.height () == HEIGHT);
+  mu_assert (presenter.resizes == 1);
+  mu_assert (presenter.data != 0 && presenter.data == client.data ());
+
+  return 0;
+}
+
+static const char* update_test () {
+  std::cout << __func__ << std::endl;
+  recording_presenter presenter;
+  rfb_client client (presenter);
+  handshake (client);
+  drain (client);
+
+  update (client);
+  const uint32_t expected[WIDTH * HEIGHT] = { 0, 1, 2, 3, 4, 5, 0, 1 };
+  mu_assert (memcmp (client.data (), expected, sizeof (expected)) == 0);
+  mu_assert (presenter.regions.size () == 2);
+  mu_assert (presenter.regions[1].x_position == 2 && presenter.regions[1].y_position == 1 && presenter.regions[1].width == 2 && presenter.regions[1].height == 1);
+  mu_assert (presenter.updates () == 1 && client.update_count () == 1);
+  mu_assert (presenter.pixels () == WIDTH * HEIGHT + 2);
+  // The answered request is replaced.
+  mu_assert (drain (client) == 1);
+
+  return 0;
+}
+
+static const char* checksum_test () {
+  std::cout << __func__ << std::endl;
+  checksum_presenter p1;
+  checksum_presenter p2;
+  rfb_client c1 (p1);
+  rfb_client c2 (p2, 4);
+  handshake (c1);
+  handshake (c2);
+  const uint64_t empty = p1.checksum ();
+  mu_assert (p2.checksum () == empty);
+
+  update (c1);
+  update (c2);
+  mu_assert (p1.checksum () != empty);
+  mu_assert (p1.checksum () == p2.checksum ());
+
+  return 0;
+}
+
+static const char* input_test () {
+  std::cout << __func__ << std::endl;
+  rfb_client::presenter presenter;
+  rfb_client client (presenter);
+  handshake (client);
+  // Input goes ahead of the queued handshake replies.
+  client.send_pointer_event (1, 100, -5);
+  ioa::const_shared_ptr<ioa::buffer_interface> msg = client.next_message ();
+  mu_assert (msg->size () == 6);
+  const uint8_t* p = static_cast<const uint8_t*> (msg->data ());
+  mu_assert (p[0] == rfb::POINTER_EVENT_TYPE && p[1] == 1);
+  // Clamped to the framebuffer.
+  mu_assert (p[2] == 0 && p[3] == WIDTH - 1);
+  mu_assert (p[4] == 0 && p[5] == 0);
+
+  return 0;
+}
+
+// A FramebufferUpdate of one ZRLE rectangle over the whole framebuffer.
+static void zrle_update (rfb::zrle_encoder& encoder,
+			 const std::vector<uint32_t>& pixels,
+			 const uint16_t width,
+			 const uint16_t height,
+			 ioa::buffer& buf,
+			 const uint16_t x = 0,
+			 const uint16_t y = 0) {
+  ioa::buffer zrle;
+  encoder.encode (&pixels[0], width, width, height, rfb_client::default_pixel_format (), zrle);
+  std::vector<uint8_t> data (static_cast<const uint8_t*> (zrle.data ()), static_cast<const uint8_t*> (zrle.data ()) + zrle.size ());
+  rfb::framebuffer_update_t msg;
+  msg.add_rectangle (rfb::rectangle_t (x, y, width, height, new rfb::encoded_pixel_data_t (rfb::ZRLE, data)));
+  msg.write_to_buffer (buf);
+}
+
+static const char* fragment_test () {
+  std::cout << __func__ << std::endl;
+  // Several ZRLE tiles so a tile is decoded before the rest of the rectangle arrives.
+  const uint16_t width = 150;
+  const uint16_t height = 70;
+  ioa::buffer init;
+  rfb::PROTOCOL_VERSION_3_3.write_to_buffer (init);
+  rfb::security_type_t (rfb::NONE).write_to_buffer (init);
+  rfb::server_init_t (width, height, rfb_client::default_pixel_format (), "test").write_to_buffer (init);
+
+  std::vector<uint32_t> pixels (width * height);
+  for (size_t i = 0; i != pixels.size (); ++i) {
+    pixels[i] = (i % width) / 10 * 0x010203 + i / width;
+  }
+  // The zlib stream continues from one update to the next.
+  rfb::zrle_encoder encoder;
+  ioa::buffer first;
+  zrle_update (encoder, pixels, width, height, first);
+  ioa::buffer second;
+  zrle_update (encoder, pixels, width, height, second);
+
+  // One byte at a time.
+  rfb_client::presenter presenter;
+  rfb_client client (presenter);
+  client.receive (init);
+  const uint8_t* p = static_cast<const uint8_t*> (first.data ());
+  for (size_t i = 0; i != first.size (); ++i) {
+    ioa::buffer b;
+    b.append (p + i, 1);
+    client.receive (b);
+  }
+  mu_assert (client.update_count () == 1);
+  mu_assert (std::equal (pixels.begin (), pixels.end (), client.data ()));
+
+  // Both updates in one chain of 100 byte pieces.
+  rfb_client batched (presenter);
+  batched.receive (init);
+  rgram::buffer_chain chain;
+  const ioa::buffer* updates[] = { &first, &second };
+  for (size_t k = 0; k != 2; ++k) {
+    p = static_cast<const uint8_t*> (updates[k]->data ());
+    for (size_t i = 0; i < updates[k]->size (); i += 100) {
+      ioa::buffer* b = new ioa::buffer ();
+      b->append (p + i, std::min (size_t (100), updates[k]->size () - i));
+      chain.push_back (ioa::const_shared_ptr<ioa::buffer_interface> (b));
+    }
+  }
+  batched.receive (chain);
+  mu_assert (batched.update_count () == 2);
+  mu_assert (std::equal (pixels.begin (), pixels.end (), batched.data ()));
+
+  return 0;
+}
+
+static const char* out_of_bounds_test () {
+  std::cout << __func__ << std::endl;
+  const uint16_t width = 150;
+  const uint16_t height = 70;
+  ioa::buffer init;
+  rfb::PROTOCOL_VERSION_3_3.write_to_buffer (init);
+  rfb::security_type_t (rfb::NONE).write_to_buffer (init);
+  rfb::server_init_t (width, height, rfb_client::default_pixel_format (), "test").write_to_buffer (init);
+
+  std::vector<uint32_t> pixels (width * height);
+  for (size_t i = 0; i != pixels.size (); ++i) {
+    pixels[i] = (i * 0x010203) & 0xFFFFFF;
+  }
+  rfb::zrle_encoder encoder;
+  ioa::buffer first;
+  zrle_update (encoder, pixels, width, height, first, 10, 1);
+  ioa::buffer second;
+  zrle_update (encoder, pixels, width, height, second);
+
+  rfb_client::presenter presenter;
+  rfb_client client (presenter);
+  client.receive (init);
+  // Dropped without touching the framebuffer.
+  client.receive (first);
+  mu_assert (client.update_count () == 1);
+  mu_assert (std::count (client.data (), client.data () + width * height, 0) == width * height);
+  // The zlib stream is still in step.
+  client.receive (second);
+  mu_assert (client.update_count () == 2);
+  mu_assert (std::equal (pixels.begin (), pixels.end (), client.data ()));
+
+  return 0;
+}
+
+static const char* raw_out_of_bounds_test () {
+  std::cout << __func__ << std::endl;
+  recording_presenter presenter;
+  rfb_client client (presenter);
+  handshake (client);
+  drain (client);
+
+  // One pixel too wide, then a good update.
+  std::vector<uint8_t> pixels ((WIDTH + 1) * HEIGHT * sizeof (uint32_t), 0xFF);
+  rfb::framebuffer_update_t msg;
+  msg.add_rectangle (rfb::rectangle_t (0, 0, WIDTH + 1, HEIGHT, new rfb::encoded_pixel_data_t (rfb::RAW, pixels)));
+  ioa::buffer buf;
+  msg.write_to_buffer (buf);
+  client.receive (buf);
+  mu_assert (client.update_count () == 1);
+  mu_assert (presenter.regions.empty ());
+  mu_assert (std::count (client.data (), client.data () + WIDTH * HEIGHT, 0) == WIDTH * HEIGHT);
+
+  update (client);
+  const uint32_t expected[WIDTH * HEIGHT] = { 0, 1, 2, 3, 4, 5, 0, 1 };
+  mu_assert (memcmp (client.data (), expected, sizeof (expected)) == 0);
+
+  return 0;
+}
+
+static const char* desktop_size_test () {
+  std::cout << __func__ << std::endl;
+  recording_presenter presenter;
+  rfb_client client (presenter);
+  handshake (client);
+  ioa::buffer buf;
+  rfb::end_of_continuous_updates_t ().write_to_buffer (buf);
+  client.receive (buf);
+  drain (client);
+
+  // Continuous updates only cover damage so the whole new framebuffer must be requested.
+  std::vector<uint8_t> none;
+  rfb::framebuffer_update_t msg;
+  msg.add_rectangle (rfb::rectangle_t (0, 0, 2 * WIDTH, 3 * HEIGHT, new rfb::encoded_pixel_data_t (rfb::DESKTOP_SIZE, none)));
+  ioa::buffer update;
+  msg.write_to_buffer (update);
+  client.receive (update);
+  mu_assert (client.width () == 2 * WIDTH && client.height () == 3 * HEIGHT);
+
+  mu_assert (client.has_message ());
+  ioa::const_shared_ptr<ioa::buffer_interface> enable = client.next_message ();
+  const uint8_t* p = static_cast<const uint8_t*> (enable->data ());
+  mu_assert (p[0] == rfb::ENABLE_CONTINUOUS_UPDATES_TYPE);
+  mu_assert (client.has_message ());
+  ioa::const_shared_ptr<ioa::buffer_interface> request = client.next_message ();
+  p = static_cast<const uint8_t*> (request->data ());
+  mu_assert (request->size () == 10 && p[0] == rfb::FRAMEBUFFER_UPDATE_REQUEST_TYPE && p[1] == 0);
+  mu_assert (p[6] == 0 && p[7] == 2 * WIDTH && p[8] == 0 && p[9] == 3 * HEIGHT);
+  mu_assert (!client.has_message ());
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (handshake_test);
+  mu_run_test (update_test);
+  mu_run_test (checksum_test);
+  mu_run_test (input_test);
+  mu_run_test (fragment_test);
+  mu_run_test (out_of_bounds_test);
+  mu_run_test (raw_out_of_bounds_test);
+  mu_run_test (desktop_size_test);
+
+  return 0;
+}
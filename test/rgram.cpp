@@ -119,6 +119,61 @@ static const char* uint32_test () {
   return 0;
 }
 
+static const char* split_uint32_test () {
+  std::cout << __func__ << std::endl;
+  const uint32_t i = 0x01020304;
+  const uint32_t n = htonl (i);
+  rgram::uint32_gramel receiver;
+
+  // One byte per buffer.
+  for (size_t k = 0; k != sizeof (n); ++k) {
+    ioa::buffer ibuf;
+    ibuf.append (reinterpret_cast<const char*> (&n) + k, 1);
+    rgram::buffer rbuf (ibuf);
+    receiver.put (rbuf);
+    mu_assert (rbuf.empty ());
+  }
+
+  mu_assert (receiver.done ());
+  mu_assert (receiver.get () == i);
+
+  return 0;
+}
+
+static const char* chain_test () {
+  std::cout << __func__ << std::endl;
+  const uint32_t i = 0x01020304;
+  const uint32_t n = htonl (i);
+  const char c = 'A';
+  rgram::buffer_chain chain;
+  ioa::buffer* b1 = new ioa::buffer ();
+  b1->append (&n, 1);
+  chain.push_back (ioa::const_shared_ptr<ioa::buffer_interface> (b1));
+  // Empty and missing buffers are passed over.
+  chain.push_back (ioa::const_shared_ptr<ioa::buffer_interface> (new ioa::buffer ()));
+  chain.push_back (ioa::const_shared_ptr<ioa::buffer_interface> ());
+  ioa::buffer* b2 = new ioa::buffer ();
+  b2->append (reinterpret_cast<const char*> (&n) + 1, sizeof (n) - 1);
+  b2->append (&c, sizeof (c));
+  chain.push_back (ioa::const_shared_ptr<ioa::buffer_interface> (b2));
+
+  rgram::buffer rbuf (chain);
+  rgram::uint32_gramel r1;
+  rgram::char_gramel r2;
+  rgram::sequence_gramel receiver;
+  receiver.append (&r1);
+  receiver.append (&r2);
+
+  receiver.put (rbuf);
+
+  mu_assert (receiver.done ());
+  mu_assert (r1.get () == i);
+  mu_assert (r2.get () == c);
+  mu_assert (rbuf.empty ());
+
+  return 0;
+}
+
 static const char* fixed_array_test () {
   std::cout << __func__ << std::endl;
   const size_t SIZE = 5;
@@ -230,6 +285,36 @@ static const char* choice_test () {
   return 0;
 }
 
+static const char* empty_choice_test () {
+  std::cout << __func__ << std::endl;
+
+  rgram::empty_gramel r1;
+  rgram::int8_gramel r2;
+
+  rgram::choice_gramel<rgram::char_gramel> receiver;
+  receiver.choices.insert (std::make_pair ('A', &r1));
+  receiver.choices.insert (std::make_pair ('B', &r2));
+
+  ioa::buffer ibuf;
+
+  char c1 = 'A';
+  ibuf.append (&c1, sizeof (c1));
+
+  char c2 = 'B';
+  ibuf.append (&c2, sizeof (c2));
+
+  rgram::buffer rbuf (ibuf);
+
+  receiver.put (rbuf);
+
+  mu_assert (receiver.done ());
+  mu_assert (receiver.get () == c1);
+  // The next message is untouched.
+  mu_assert (rbuf.size () == 1);
+
+  return 0;
+}
+
 const char*
 all_tests ()
 {
@@ -240,10 +325,13 @@ all_tests ()
   mu_run_test (uint16_test);
   mu_run_test (int32_test);
   mu_run_test (uint32_test);
+  mu_run_test (split_uint32_test);
+  mu_run_test (chain_test);
   mu_run_test (fixed_array_test);
   mu_run_test (dynamic_array_test);
   mu_run_test (sequence_test);
   mu_run_test (choice_test);
+  mu_run_test (empty_choice_test);
 
   return 0;
 }
@@ -0,0 +1,154 @@
+#include "session_recording.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static std::string temporary_path () {
+  char path[] = "/tmp/session_recording_XXXXXX";
+  const int fd = mkstemp (path);
+  close (fd);
+  return path;
+}
+
+static ioa::buffer message (const char* text) {
+  ioa::buffer buf;
+  buf.append (text, strlen (text));
+  return buf;
+}
+
+static bool same (const rfb::recorded_message_t& message,
+		  const rfb::recording_direction_t direction,
+		  const char* text) {
+  return message.direction == direction &&
+    message.buffer->size () == strlen (text) &&
+    memcmp (message.buffer->data (), text, strlen (text)) == 0;
+}
+
+static const char* round_trip_test () {
+  std::cout << __func__ << std::endl;
+  const std::string path = temporary_path ();
+  {
+    rfb::recording_writer writer (path);
+    writer.write (rfb::SERVER_TO_CLIENT, message ("RFB 003.003\n"));
+    writer.write (rfb::CLIENT_TO_SERVER, message ("RFB 003.003\n"));
+    writer.write (rfb::CLIENT_TO_SERVER, ioa::buffer ());
+    writer.write (rfb::SERVER_TO_CLIENT, message ("update"));
+  }
+
+  rfb::recording_reader reader (path);
+  rfb::recorded_message_t m[4];
+  for (size_t i = 0; i != 4; ++i) {
+    mu_assert (reader.next (m[i]));
+  }
+  mu_assert (!reader.next (m[0]));
+  mu_assert (same (m[0], rfb::SERVER_TO_CLIENT, "RFB 003.003\n"));
+  mu_assert (same (m[1], rfb::CLIENT_TO_SERVER, "RFB 003.003\n"));
+  mu_assert (same (m[2], rfb::CLIENT_TO_SERVER, ""));
+  mu_assert (same (m[3], rfb::SERVER_TO_CLIENT, "update"));
+  mu_assert (m[0].ns <= m[1].ns && m[1].ns <= m[2].ns && m[2].ns <= m[3].ns);
+
+  unlink (path.c_str ());
+  return 0;
+}
+
+static const char* segments_test () {
+  std::cout << __func__ << std::endl;
+  const std::string path = temporary_path ();
+  // Enough small messages to fill several indexes and large ones to pass the segment size.
+  std::vector<uint8_t> large (rfb::SEGMENT_SIZE / 2 + 1);
+  {
+    rfb::recording_writer writer (path);
+    for (uint32_t i = 0; i != 1000; ++i) {
+      ioa::buffer buf;
+      if (i % 100 == 50) {
+	large[0] = i;
+	buf.append (&large[0], large.size ());
+      }
+      else {
+	buf.append (&i, sizeof (i));
+      }
+      writer.write (rfb::recording_direction_t (i % 2), buf);
+    }
+  }
+
+  rfb::recording_reader reader (path);
+  rfb::recorded_message_t m;
+  for (uint32_t i = 0; i != 1000; ++i) {
+    mu_assert (reader.next (m));
+    mu_assert (m.direction == rfb::recording_direction_t (i % 2));
+    if (i % 100 == 50) {
+      mu_assert (m.buffer->size () == large.size ());
+      mu_assert (static_cast<const uint8_t*> (m.buffer->data ())[0] == uint8_t (i));
+    }
+    else {
+      mu_assert (m.buffer->size () == sizeof (i));
+      mu_assert (memcmp (m.buffer->data (), &i, sizeof (i)) == 0);
+    }
+  }
+  mu_assert (!reader.next (m));
+
+  unlink (path.c_str ());
+  return 0;
+}
+
+static const char* view_test () {
+  std::cout << __func__ << std::endl;
+  const std::string path = temporary_path ();
+  {
+    rfb::recording_writer writer (path);
+    writer.write (rfb::SERVER_TO_CLIENT, message ("first"));
+    writer.write (rfb::SERVER_TO_CLIENT, message ("second"));
+  }
+
+  rfb::recorded_message_t first;
+  rfb::recorded_message_t second;
+  {
+    rfb::recording_reader reader (path);
+    mu_assert (reader.next (first));
+    mu_assert (reader.next (second));
+  }
+  // The payloads are read in place from a page-aligned segment and outlive the reader.
+  mu_assert (reinterpret_cast<uintptr_t> (first.buffer->data ()) % rfb::RECORDING_PAGE_SIZE == 0);
+  mu_assert (static_cast<const uint8_t*> (second.buffer->data ()) == static_cast<const uint8_t*> (first.buffer->data ()) + 5);
+  mu_assert (same (first, rfb::SERVER_TO_CLIENT, "first"));
+  mu_assert (same (second, rfb::SERVER_TO_CLIENT, "second"));
+
+  unlink (path.c_str ());
+  return 0;
+}
+
+static const char* truncated_test () {
+  std::cout << __func__ << std::endl;
+  const std::string path = temporary_path ();
+  {
+    rfb::recording_writer writer (path);
+    writer.write (rfb::SERVER_TO_CLIENT, message ("first"));
+    writer.write (rfb::SERVER_TO_CLIENT, message ("second"));
+  }
+  // Cut the last payload short.  The payloads start after the header page and the first index.
+  mu_assert (truncate (path.c_str (), 2 * rfb::RECORDING_PAGE_SIZE + 5 + 3) == 0);
+
+  rfb::recording_reader reader (path);
+  rfb::recorded_message_t m;
+  mu_assert (reader.next (m));
+  mu_assert (same (m, rfb::SERVER_TO_CLIENT, "first"));
+  mu_assert (!reader.next (m));
+
+  unlink (path.c_str ());
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (round_trip_test);
+  mu_run_test (segments_test);
+  mu_run_test (view_test);
+  mu_run_test (truncated_test);
+
+  return 0;
+}
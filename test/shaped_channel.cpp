@@ -0,0 +1,140 @@
+#include "shaped_channel_automaton.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+
+static const uint64_t MS = 1000000;
+
+static ioa::const_shared_ptr<ioa::buffer_interface> message (const size_t size,
+							     const uint8_t first = 0) {
+  std::vector<uint8_t> bytes (size);
+  for (size_t i = 0; i != size; ++i) {
+    bytes[i] = first + i;
+  }
+  ioa::buffer* buf = new ioa::buffer ();
+  buf->append (&bytes[0], size);
+  return ioa::const_shared_ptr<ioa::buffer_interface> (buf);
+}
+
+static const char* delay_test () {
+  std::cout << __func__ << std::endl;
+  channel_shape_t shape;
+  shape.delay_ns = 10 * MS;
+  link_shaper shaper (shape);
+  shaper.send (message (100), 0);
+  mu_assert (!shaper.ready (10 * MS - 1));
+  mu_assert (shaper.ready (10 * MS));
+  mu_assert (shaper.receive ()->size () == 100);
+  mu_assert (shaper.empty ());
+
+  return 0;
+}
+
+static const char* bandwidth_test () {
+  std::cout << __func__ << std::endl;
+  channel_shape_t shape;
+  shape.bytes_per_second = 1000;
+  shape.burst_bytes = 1000;
+  shape.mtu = 500;
+  link_shaper shaper (shape);
+  shaper.send (message (3000), 0);
+  // A full bucket lets two segments go at once and then one goes every half second.
+  const uint64_t expected[] = { 0, 0, 500 * MS, 1000 * MS, 1500 * MS, 2000 * MS };
+  std::vector<uint8_t> received;
+  for (size_t i = 0; i != 6; ++i) {
+    mu_assert (shaper.next_arrival_ns () == expected[i]);
+    mu_assert (shaper.ready (expected[i]));
+    ioa::const_shared_ptr<ioa::buffer_interface> segment = shaper.receive ();
+    mu_assert (segment->size () == 500);
+    const uint8_t* data = static_cast<const uint8_t*> (segment->data ());
+    received.insert (received.end (), data, data + segment->size ());
+  }
+  mu_assert (shaper.empty ());
+  // The stream is intact.
+  for (size_t i = 0; i != received.size (); ++i) {
+    mu_assert (received[i] == uint8_t (i));
+  }
+
+  return 0;
+}
+
+static const char* order_test () {
+  std::cout << __func__ << std::endl;
+  channel_shape_t shape;
+  shape.delay_ns = 10 * MS;
+  shape.jitter_ns = 50 * MS;
+  link_shaper stream (shape);
+  shape.datagrams = true;
+  shape.reorder = true;
+  link_shaper datagrams (shape);
+  for (uint8_t i = 0; i != 100; ++i) {
+    stream.send (message (1, i), i * MS);
+    datagrams.send (message (1, i), i * MS);
+  }
+
+  bool reordered = false;
+  uint64_t last = 0;
+  for (uint8_t i = 0; i != 100; ++i) {
+    // Jitter never reorders a stream.
+    mu_assert (static_cast<const uint8_t*> (stream.receive ()->data ())[0] == i);
+    const uint64_t arrival = datagrams.next_arrival_ns ();
+    mu_assert (arrival >= last);
+    last = arrival;
+    reordered = reordered || static_cast<const uint8_t*> (datagrams.receive ()->data ())[0] != i;
+  }
+  mu_assert (reordered);
+
+  return 0;
+}
+
+static const char* loss_test () {
+  std::cout << __func__ << std::endl;
+  channel_shape_t shape;
+  shape.datagrams = true;
+  shape.loss = 0.1;
+  link_shaper first (shape);
+  link_shaper second (shape);
+  for (size_t i = 0; i != 10000; ++i) {
+    first.send (message (1), 0);
+    second.send (message (1), 0);
+  }
+  mu_assert (first.lost () > 900 && first.lost () < 1100);
+  // The same seed loses the same datagrams.
+  mu_assert (first.lost () == second.lost ());
+
+  return 0;
+}
+
+static const char* wake_test () {
+  std::cout << __func__ << std::endl;
+  wake_timer timer;
+  // Rounded up to the next microsecond.
+  mu_assert (timer.arm (1500, 0) == 2);
+  // A later arrival is covered by the pending wake up.
+  mu_assert (timer.arm (5 * MS, 0) == 0);
+  // An earlier one is not.
+  mu_assert (timer.arm (1000, 0) == 1);
+  // Due now.
+  mu_assert (timer.arm (1000, 1000) == 0);
+  // A pending wake up that is already past does not count even if it has not fired.
+  mu_assert (timer.arm (5 * MS, 2000) == 4998);
+  mu_assert (timer.arm (6 * MS, 2000) == 0);
+  // Once fired the next arrival needs a new one.
+  timer.fired ();
+  mu_assert (timer.arm (6 * MS, 5 * MS) == 1000);
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (delay_test);
+  mu_run_test (bandwidth_test);
+  mu_run_test (order_test);
+  mu_run_test (loss_test);
+  mu_run_test (wake_test);
+
+  return 0;
+}
@@ -0,0 +1,116 @@
+#include "synthetic_frame_sources.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+
+static const uint16_t WIDTH = 240;
+static const uint16_t HEIGHT = 160;
+static const size_t FRAMES = 20;
+
+// True if every pixel that differs is inside the damage.
+static bool damage_covers (const std::vector<uint32_t>& before,
+			   const std::vector<uint32_t>& after,
+			   const rfb::damage_region& damage) {
+  std::vector<bool> covered (before.size ());
+  for (std::vector<rfb::damage_rect_t>::const_iterator pos = damage.rects ().begin ();
+       pos != damage.rects ().end ();
+       ++pos) {
+    if (pos->x_position + pos->width > WIDTH || pos->y_position + pos->height > HEIGHT) {
+      return false;
+    }
+    for (uint16_t y = pos->y_position; y != pos->y_position + pos->height; ++y) {
+      for (uint16_t x = pos->x_position; x != pos->x_position + pos->width; ++x) {
+	covered[y * WIDTH + x] = true;
+      }
+    }
+  }
+  for (size_t i = 0; i != before.size (); ++i) {
+    if (before[i] != after[i] && !covered[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const char* ground_truth_test () {
+  std::cout << __func__ << std::endl;
+  const std::vector<std::string> names = rfb::frame_source_names ();
+  for (std::vector<std::string>::const_iterator name = names.begin ();
+       name != names.end ();
+       ++name) {
+    rfb::frame_source* source = rfb::make_frame_source (*name);
+    mu_assert (source != 0);
+    std::vector<uint32_t> pixels (WIDTH * HEIGHT, 0xDEADBEEF);
+    for (size_t frame = 0; frame != FRAMES; ++frame) {
+      const std::vector<uint32_t> before (pixels);
+      rfb::damage_region damage;
+      source->produce (&pixels[0], WIDTH, HEIGHT, damage);
+      mu_assert (damage_covers (before, pixels, damage));
+      if (frame == 0) {
+	// Everything is drawn.
+	for (size_t i = 0; i != pixels.size (); ++i) {
+	  mu_assert (pixels[i] != 0xDEADBEEF);
+	}
+      }
+    }
+    delete source;
+  }
+  mu_assert (rfb::make_frame_source ("unknown") == 0);
+
+  return 0;
+}
+
+static const char* static_test () {
+  std::cout << __func__ << std::endl;
+  rfb::static_desktop_source source;
+  std::vector<uint32_t> pixels (WIDTH * HEIGHT);
+  rfb::damage_region damage;
+  source.produce (&pixels[0], WIDTH, HEIGHT, damage);
+  mu_assert (!damage.empty ());
+  damage.clear ();
+  source.produce (&pixels[0], WIDTH, HEIGHT, damage);
+  mu_assert (damage.empty ());
+
+  // A new size draws everything again.
+  source.produce (&pixels[0], WIDTH / 2, HEIGHT / 2, damage);
+  mu_assert (damage.rects ().size () == 1 && damage.rects ()[0].width == WIDTH / 2 && damage.rects ()[0].height == HEIGHT / 2);
+
+  return 0;
+}
+
+static const char* deterministic_test () {
+  std::cout << __func__ << std::endl;
+  const std::vector<std::string> names = rfb::frame_source_names ();
+  for (std::vector<std::string>::const_iterator name = names.begin ();
+       name != names.end ();
+       ++name) {
+    if (*name == "noise") {
+      continue;
+    }
+    rfb::frame_source* a = rfb::make_frame_source (*name);
+    rfb::frame_source* b = rfb::make_frame_source (*name);
+    std::vector<uint32_t> pa (WIDTH * HEIGHT);
+    std::vector<uint32_t> pb (WIDTH * HEIGHT);
+    for (size_t frame = 0; frame != 3; ++frame) {
+      rfb::damage_region damage;
+      a->produce (&pa[0], WIDTH, HEIGHT, damage);
+      b->produce (&pb[0], WIDTH, HEIGHT, damage);
+    }
+    delete a;
+    delete b;
+    mu_assert (pa == pb);
+  }
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (ground_truth_test);
+  mu_run_test (static_test);
+  mu_run_test (deterministic_test);
+
+  return 0;
+}
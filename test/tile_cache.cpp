@@ -0,0 +1,77 @@
+#include "tile_cache.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+
+static const rfb::pixel_format_t FORMAT_32 (32, 24, false, true, 255, 255, 255, 16, 8, 0);
+static const rfb::pixel_format_t FORMAT_16 (16, 16, false, true, 31, 63, 31, 11, 5, 0);
+
+static const char* hit_test () {
+  std::cout << __func__ << std::endl;
+  rfb::tile_cache cache;
+  rfb::tile_cache::data_ptr data;
+  mu_assert (!cache.find (0, 0, 64, 64, FORMAT_32, rfb::ZRLE, data));
+
+  std::vector<uint8_t> v (10, 7);
+  rfb::tile_cache::data_ptr inserted = cache.insert (0, 0, 64, 64, FORMAT_32, rfb::ZRLE, v);
+  mu_assert (v.empty ());
+  mu_assert (cache.find (0, 0, 64, 64, FORMAT_32, rfb::ZRLE, data));
+  mu_assert (data.get () == inserted.get ());
+  mu_assert (data->size () == 10);
+  mu_assert (cache.hits () == 1);
+  mu_assert (cache.misses () == 1);
+
+  return 0;
+}
+
+static const char* key_test () {
+  std::cout << __func__ << std::endl;
+  rfb::tile_cache cache;
+  rfb::tile_cache::data_ptr data;
+  std::vector<uint8_t> v (10, 7);
+  cache.insert (0, 0, 64, 64, FORMAT_32, rfb::ZRLE, v);
+
+  mu_assert (!cache.find (0, 0, 64, 64, FORMAT_16, rfb::ZRLE, data));
+  mu_assert (!cache.find (0, 0, 64, 64, FORMAT_32, rfb::RAW, data));
+  mu_assert (!cache.find (64, 0, 64, 64, FORMAT_32, rfb::ZRLE, data));
+  mu_assert (!cache.find (0, 0, 32, 64, FORMAT_32, rfb::ZRLE, data));
+
+  return 0;
+}
+
+static const char* generation_test () {
+  std::cout << __func__ << std::endl;
+  rfb::tile_cache cache;
+  rfb::tile_cache::data_ptr data;
+  std::vector<uint8_t> v (10, 7);
+  rfb::tile_statistics_t stats;
+  stats.colors = 3;
+
+  cache.set_generation (1);
+  rfb::tile_cache::data_ptr inserted = cache.insert (0, 0, 64, 64, FORMAT_32, rfb::RAW, v);
+  cache.insert_statistics (0, 0, 64, 64, stats);
+  cache.set_generation (1);
+  mu_assert (cache.find (0, 0, 64, 64, FORMAT_32, rfb::RAW, data));
+  mu_assert (cache.find_statistics (0, 0, 64, 64, stats));
+  mu_assert (stats.colors == 3);
+
+  cache.set_generation (2);
+  mu_assert (cache.size () == 0);
+  mu_assert (!cache.find (0, 0, 64, 64, FORMAT_32, rfb::RAW, data));
+  mu_assert (!cache.find_statistics (0, 0, 64, 64, stats));
+  // Evicted bytes live as long as someone holds them.
+  mu_assert (inserted->size () == 10);
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (hit_test);
+  mu_run_test (key_test);
+  mu_run_test (generation_test);
+
+  return 0;
+}
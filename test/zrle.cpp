@@ -0,0 +1,208 @@
+#include <substrate/rgram.hpp>
+#include "zrle.hpp"
+
+#include "minunit.h"
+
+#include <iostream>
+#include <ioa/buffer.hpp>
+
+static const rfb::pixel_format_t FORMAT (32, 24, false, true, 255, 255, 255, 16, 8, 0);
+
+static const uint16_t WIDTH = 150;
+static const uint16_t HEIGHT = 70;
+
+// Encode a rectangle and decode it in chunks of the given size.
+static bool roundtrip (rfb::zrle_encoder& encoder,
+		       rfb::zrle_decoder& decoder,
+		       const uint32_t* src,
+		       const size_t chunk) {
+  ioa::buffer ibuf;
+  encoder.encode (src, WIDTH, WIDTH, HEIGHT, FORMAT, ibuf);
+
+  uint32_t dest[WIDTH * HEIGHT];
+  memset (dest, 0, sizeof (dest));
+  decoder.set_rectangle (dest, WIDTH, WIDTH, HEIGHT, FORMAT);
+
+  rgram::buffer rbuf (ibuf);
+  rgram::uint32_gramel length;
+  length.put (rbuf);
+  if (!length.done () || length.get () != rbuf.size ()) {
+    return false;
+  }
+
+  while (!rbuf.empty ()) {
+    const size_t size = std::min (chunk, rbuf.size ());
+    decoder.put (rbuf.data (), size);
+    rbuf.skip (size);
+  }
+
+  return decoder.done () && std::equal (src, src + WIDTH * HEIGHT, dest);
+}
+
+static const char* solid_test () {
+  std::cout << __func__ << std::endl;
+  rfb::zrle_encoder encoder;
+  rfb::zrle_decoder decoder;
+  uint32_t src[WIDTH * HEIGHT];
+  std::fill (src, src + WIDTH * HEIGHT, 0x123456);
+
+  mu_assert (roundtrip (encoder, decoder, src, 1));
+
+  return 0;
+}
+
+static const char* palette_test () {
+  std::cout << __func__ << std::endl;
+  rfb::zrle_encoder encoder;
+  rfb::zrle_decoder decoder;
+  uint32_t src[WIDTH * HEIGHT];
+  const size_t sizes[] = { 2, 3, 5, 16, 17, 127 };
+
+  for (size_t i = 0; i != sizeof (sizes) / sizeof (sizes[0]); ++i) {
+    // Short runs favor packed palettes, long runs favor RLE.
+    for (size_t j = 0; j != WIDTH * HEIGHT; ++j) {
+      src[j] = 0x010101 * ((j / (1 + i * 37)) % sizes[i]);
+    }
+    mu_assert (roundtrip (encoder, decoder, src, 7));
+  }
+
+  return 0;
+}
+
+static const char* raw_test () {
+  std::cout << __func__ << std::endl;
+  rfb::zrle_encoder encoder;
+  rfb::zrle_decoder decoder;
+  uint32_t src[WIDTH * HEIGHT];
+  srand (1);
+  for (size_t j = 0; j != WIDTH * HEIGHT; ++j) {
+    src[j] = rand () & 0xFFFFFF;
+  }
+
+  mu_assert (roundtrip (encoder, decoder, src, 1000));
+  // The zlib stream continues across rectangles.
+  mu_assert (roundtrip (encoder, decoder, src, 13));
+
+  return 0;
+}
+
+// The ZRLE pixel data of a client.
+struct zrle_gramel :
+  public rfb::pixel_data_gramel
+{
+  uint32_t* m_data;
+  rgram::uint32_gramel m_length;
+  uint32_t m_remaining;
+  rfb::zrle_decoder m_decoder;
+  bool m_dimensions_set;
+
+  zrle_gramel (uint32_t* data) :
+    m_data (data),
+    m_remaining (0),
+    m_dimensions_set (false)
+  { }
+
+  void put (rgram::buffer& buf) {
+    if (!m_length.done ()) {
+      m_length.put (buf);
+      m_remaining = m_length.get ();
+    }
+    if (m_length.done ()) {
+      const size_t size = std::min (size_t (m_remaining), buf.size ());
+      m_decoder.put (buf.data (), size);
+      buf.skip (size);
+      m_remaining -= size;
+    }
+  }
+
+  bool done () const {
+    return m_dimensions_set && m_length.done () && m_remaining == 0;
+  }
+
+  void reset () {
+    m_length.reset ();
+    m_remaining = 0;
+    m_dimensions_set = false;
+  }
+
+  void set_dimensions (const uint16_t xpos,
+		       const uint16_t ypos,
+		       const uint16_t w,
+		       const uint16_t h) {
+    m_decoder.set_rectangle (m_data + ypos * WIDTH + xpos, WIDTH, w, h, FORMAT);
+    m_dimensions_set = true;
+  }
+};
+
+static const char* rectangle_test () {
+  std::cout << __func__ << std::endl;
+  rfb::zrle_encoder encoder;
+  uint32_t src[WIDTH * HEIGHT];
+  srand (2);
+  for (size_t j = 0; j != WIDTH * HEIGHT; ++j) {
+    src[j] = (rand () % 4) * 0x102030;
+  }
+
+  // A rectangle header followed by the ZRLE data of several tiles.
+  ioa::buffer ibuf;
+  const uint16_t header[] = { htons (0), htons (0), htons (WIDTH), htons (HEIGHT) };
+  ibuf.append (header, sizeof (header));
+  const int32_t encoding = htonl (rfb::ZRLE);
+  ibuf.append (&encoding, sizeof (encoding));
+  encoder.encode (src, WIDTH, WIDTH, HEIGHT, FORMAT, ibuf);
+
+  uint32_t dest[WIDTH * HEIGHT];
+  memset (dest, 0, sizeof (dest));
+  zrle_gramel pixel_data (dest);
+  rfb::rectangle_gramel rectangle;
+  rectangle.add_encoding (rfb::ZRLE, &pixel_data);
+
+  // One byte at a time so tiles are decoded before the rest of the rectangle arrives.
+  const uint8_t* p = static_cast<const uint8_t*> (ibuf.data ());
+  for (size_t i = 0; i != ibuf.size (); ++i) {
+    mu_assert (!rectangle.done ());
+    ioa::buffer b;
+    b.append (p + i, 1);
+    rgram::buffer rbuf (b);
+    rectangle.put (rbuf);
+  }
+
+  mu_assert (rectangle.done ());
+  mu_assert (std::equal (src, src + WIDTH * HEIGHT, dest));
+
+  return 0;
+}
+
+static const char* discard_test () {
+  std::cout << __func__ << std::endl;
+  rfb::zrle_encoder encoder;
+  rfb::zrle_decoder decoder;
+  uint32_t src[WIDTH * HEIGHT];
+  srand (3);
+  for (size_t j = 0; j != WIDTH * HEIGHT; ++j) {
+    src[j] = rand () & 0xFFFFFF;
+  }
+
+  // A rectangle with nowhere to go is still inflated so the next one decodes.
+  ioa::buffer ibuf;
+  encoder.encode (src, WIDTH, WIDTH, HEIGHT, FORMAT, ibuf);
+  decoder.set_rectangle (0, 0, WIDTH, HEIGHT, FORMAT);
+  decoder.put (static_cast<const uint8_t*> (ibuf.data ()) + 4, ibuf.size () - 4);
+  mu_assert (decoder.done ());
+
+  mu_assert (roundtrip (encoder, decoder, src, 100));
+
+  return 0;
+}
+
+const char*
+all_tests ()
+{
+  mu_run_test (solid_test);
+  mu_run_test (palette_test);
+  mu_run_test (raw_test);
+  mu_run_test (rectangle_test);
+  mu_run_test (discard_test);
+
+  return 0;
+}